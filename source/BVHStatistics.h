@@ -0,0 +1,93 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+
+//Uncomment to count the BVH work done per ray, main prints and resets the counters every second.
+//Every mesh test then adds a few atomic increments, so leave it off when benchmarking frame times.
+//Node cache misses come from a simulated per thread cache, not from hardware counters, so they only compare node layouts.
+//#define BVH_STATISTICS
+
+namespace dae
+{
+	//Set associative LRU cache of blockSize byte blocks, used to estimate how well a node layout caches.
+	//BVHNodeCache models a typical L2 (256 KB of 64 byte lines, 8 ways), BVHNodeTLB a second level TLB (1536 pages of 4 KB, 12 ways).
+	template<uintptr_t BlockSize, uint32_t Blocks, uint32_t Ways>
+	class BlockCacheSimulator final
+	{
+	public:
+		static BlockCacheSimulator& Get()
+		{
+			static thread_local BlockCacheSimulator cache{};
+			return cache;
+		}
+
+		//Returns the number of blocks missed while reading size bytes at pData
+		uint32_t Access(const void* pData, size_t size)
+		{
+			const uintptr_t firstBlock = reinterpret_cast<uintptr_t>(pData) / BlockSize;
+			const uintptr_t lastBlock = (reinterpret_cast<uintptr_t>(pData) + size - 1) / BlockSize;
+			uint32_t misses{};
+			for (uintptr_t block = firstBlock; block <= lastBlock; ++block)
+			{
+				misses += AccessBlock(block);
+			}
+			return misses;
+		}
+
+	private:
+		static constexpr uint32_t sets{ Blocks / Ways };
+
+		uint32_t AccessBlock(uintptr_t block)
+		{
+			//Each set is kept most recently used first, an unused way holds tag 0
+			uintptr_t* pSet = m_Tags + (block % sets) * Ways;
+			uint32_t way{};
+			while (way < Ways - 1 && pSet[way] != block + 1)
+			{
+				++way;
+			}
+			const bool isMiss = pSet[way] != block + 1;
+			std::copy_backward(pSet, pSet + way, pSet + way + 1);
+			pSet[0] = block + 1;
+			return isMiss ? 1 : 0;
+		}
+
+		uintptr_t m_Tags[Blocks]{};
+	};
+	using BVHNodeCache = BlockCacheSimulator<64, 256 * 1024 / 64, 8>;
+	using BVHNodeTLB = BlockCacheSimulator<4096, 1536, 12>;
+
+	struct BVHStatistics
+	{
+		std::atomic<uint64_t> meshRays{};
+		std::atomic<uint64_t> nodesVisited{};
+		std::atomic<uint64_t> trianglesTested{};
+		std::atomic<uint64_t> nodeCacheMisses{};
+		std::atomic<uint64_t> nodeTLBMisses{};
+
+		static BVHStatistics& Get()
+		{
+			static BVHStatistics statistics{};
+			return statistics;
+		}
+
+		void Reset()
+		{
+			meshRays = 0;
+			nodesVisited = 0;
+			trianglesTested = 0;
+			nodeCacheMisses = 0;
+			nodeTLBMisses = 0;
+		}
+
+		void Print() const
+		{
+			const double rays = static_cast<double>(std::max<uint64_t>(1, meshRays));
+			std::cout << "BVH: " << meshRays << " mesh rays | nodes/ray: " << nodesVisited / rays
+				<< " | triangles/ray: " << trianglesTested / rays << " | node cache misses/ray: " << nodeCacheMisses / rays
+				<< " | node TLB misses/ray: " << nodeTLBMisses / rays << std::endl;
+		}
+	};
+}
@@ -0,0 +1,516 @@
+#include "Benchmarks.h"
+#include "Scene.h"
+#include "Material.h"
+#include "Utils.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+
+using namespace dae;
+
+namespace
+{
+	//A unit sphere at the origin in front of a tilted wall of triangles, z = wallZ + wallSlope * x, every ray through the sphere also hits the wall behind it.
+	//The wall is a single leaf reaching in front of the sphere, so the leaf is tested after the sphere was hit and holds triangles behind that hit.
+	class Scene_SphereBeforeMesh final : public Scene
+	{
+	public:
+		static constexpr float wallZ{ 2.f };
+		static constexpr float wallSlope{ 1.5f };
+		static constexpr int wallQuads{ 2 };
+
+		Scene_SphereBeforeMesh(BVHLayout bvhLayout, LeafLayout leafLayout, TriangleKernel triangleKernel) :
+			m_BVHLayout{ bvhLayout }, m_LeafLayout{ leafLayout }, m_TriangleKernel{ triangleKernel }
+		{
+		}
+		~Scene_SphereBeforeMesh() override = default;
+
+		Scene_SphereBeforeMesh(const Scene_SphereBeforeMesh&) = delete;
+		Scene_SphereBeforeMesh(Scene_SphereBeforeMesh&&) noexcept = delete;
+		Scene_SphereBeforeMesh& operator=(const Scene_SphereBeforeMesh&) = delete;
+		Scene_SphereBeforeMesh& operator=(Scene_SphereBeforeMesh&&) noexcept = delete;
+
+		void Initialize() override
+		{
+			m_SphereMaterial = AddMaterial(new Material_Lambert(colors::White, 1.f));
+			m_MeshMaterial = AddMaterial(new Material_Lambert(colors::Red, 1.f));
+
+			AddSphere(Vector3{ 0.f, 0.f, 0.f }, 1.f, m_SphereMaterial);
+
+			TriangleMesh* pMesh = AddTriangleMesh();
+			pMesh->bvhLayout = m_BVHLayout;
+			pMesh->leafLayout = m_LeafLayout;
+			pMesh->triangleKernel = m_TriangleKernel;
+			//Splitting never pays off, so all triangles share the root leaf
+			pMesh->bvhBuildSettings.traversalCost = 1000.f;
+			//Quads from -2 to 2 on x and y
+			const float quadSize{ 4.f / wallQuads };
+			const auto getWallPoint = [](float x, float y) { return Vector3{ x, y, wallZ + wallSlope * x }; };
+			for (int y = 0; y < wallQuads; ++y)
+			{
+				for (int x = 0; x < wallQuads; ++x)
+				{
+					const float x0 = -2.f + x * quadSize;
+					const float y0 = -2.f + y * quadSize;
+					pMesh->AppendTriangle(Triangle{ getWallPoint(x0, y0), getWallPoint(x0, y0 + quadSize), getWallPoint(x0 + quadSize, y0) }, true);
+					pMesh->AppendTriangle(Triangle{ getWallPoint(x0 + quadSize, y0), getWallPoint(x0, y0 + quadSize), getWallPoint(x0 + quadSize, y0 + quadSize) }, true);
+				}
+			}
+			pMesh->UpdateBVH();
+
+			AddTriangleMeshInstance(pMesh, TriangleCullMode::NoCulling, m_MeshMaterial)->UpdateTransforms();
+			UpdateTopLevelBVH();
+		}
+
+		//Casts rays along +z on a grid over the sphere and the wall around it, returns how many got the wrong hit
+		int CountWrongHits(int& rayCount) const
+		{
+			constexpr float startZ{ -5.f };
+			constexpr float tolerance{ 1e-3f };
+			constexpr int gridSize{ 64 };
+			const Vector3 wallNormal = Vector3{ -wallSlope, 0.f, 1.f }.Normalized();
+
+			int wrongHits{};
+			for (int y = 0; y < gridSize; ++y)
+			{
+				for (int x = 0; x < gridSize; ++x)
+				{
+					//Samples from -1.5 to 1.5, offset so no ray runs exactly along a triangle edge, where neither kernel is watertight.
+					//Rays grazing the silhouette of the sphere may go either way.
+					const float rayX = -1.5f + (x + 0.5f) * 3.f / gridSize;
+					const float rayY = -1.5f + (y + 0.25f) * 3.f / gridSize;
+					const float radiusSquared = rayX * rayX + rayY * rayY;
+					if (std::abs(radiusSquared - 1.f) < 0.01f)
+					{
+						continue;
+					}
+
+					const Vector3 direction{ 0.f, 0.f, 1.f };
+					const Ray ray{ Vector3{ rayX, rayY, startZ }, direction, direction.Inversed() };
+					HitRecord hitRecord{};
+					GetClosestHit(ray, hitRecord);
+					++rayCount;
+
+					bool isRight{};
+					if (radiusSquared < 1.f)
+					{
+						const float sphereZ = -std::sqrt(1.f - radiusSquared);
+						isRight = hitRecord.didHit && hitRecord.materialIndex == m_SphereMaterial
+							&& std::abs(hitRecord.t - (sphereZ - startZ)) < tolerance
+							&& (hitRecord.normal - Vector3{ rayX, rayY, sphereZ }).Magnitude() < tolerance;
+					}
+					else
+					{
+						isRight = hitRecord.didHit && hitRecord.materialIndex == m_MeshMaterial
+							&& std::abs(hitRecord.t - (wallZ + wallSlope * rayX - startZ)) < tolerance
+							&& std::abs(std::abs(Vector3::Dot(hitRecord.normal, wallNormal)) - 1.f) < tolerance;
+					}
+					if (!isRight)
+					{
+						++wrongHits;
+					}
+				}
+			}
+			return wrongHits;
+		}
+
+	private:
+		BVHLayout m_BVHLayout;
+		LeafLayout m_LeafLayout;
+		TriangleKernel m_TriangleKernel;
+		unsigned char m_SphereMaterial{};
+		unsigned char m_MeshMaterial{};
+	};
+
+	//Fastest of a few runs of function in milliseconds, the first run also warms the caches
+	template<typename Function>
+	float TimeBest(const Function& function)
+	{
+		float bestTime{ FLT_MAX };
+		for (int pass = 0; pass < 5; ++pass)
+		{
+			const auto passStart = std::chrono::high_resolution_clock::now();
+			function();
+			bestTime = std::min(bestTime, std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - passStart).count());
+		}
+		return bestTime;
+	}
+
+	template<HitQuery Query, TriangleCullMode CullMode, typename LeafTriangle>
+	uint64_t CountTriangleHits(const std::vector<LeafTriangle>& triangles, const std::vector<Ray>& rays)
+	{
+		uint64_t hitCount{};
+		for (const Ray& ray : rays)
+		{
+			HitRecord hitRecord{};
+			for (const LeafTriangle& triangle : triangles)
+			{
+				hitCount += GeometryUtils::HitTest_Triangle<Query, CullMode>(triangle, ray, hitRecord);
+			}
+		}
+		return hitCount;
+	}
+
+	template<typename Packet>
+	uint64_t CountTrianglePacketHits(const std::vector<Packet>& packets, const std::vector<Ray>& rays)
+	{
+		uint64_t hitCount{};
+		for (const Ray& ray : rays)
+		{
+			for (const Packet& packet : packets)
+			{
+				int lane{};
+				float t{};
+				hitCount += GeometryUtils::HitTest_TrianglePacket<HitQuery::ClosestHit, TriangleCullMode::NoCulling>(packet, ray, lane, t);
+			}
+		}
+		return hitCount;
+	}
+
+	template<typename LeafTriangle>
+	bool DoesHitAnyTriangle(const std::vector<LeafTriangle>& triangles, const Ray& ray)
+	{
+		HitRecord hitRecord{};
+		for (const LeafTriangle& triangle : triangles)
+		{
+			if (GeometryUtils::HitTest_Triangle<HitQuery::AnyHit, TriangleCullMode::NoCulling>(triangle, ray, hitRecord))
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	template<typename Packet>
+	bool DoesHitAnyTrianglePacket(const std::vector<Packet>& packets, const Ray& ray)
+	{
+		for (const Packet& packet : packets)
+		{
+			int lane{};
+			float t{};
+			if (GeometryUtils::HitTest_TrianglePacket<HitQuery::AnyHit, TriangleCullMode::NoCulling>(packet, ray, lane, t))
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	BVHTriangle GetBVHTriangle(const Vector3& v0, const Vector3& v1, const Vector3& v2)
+	{
+		return { v0, v1 - v0, v2 - v0, Vector3::Cross(v1 - v0, v2 - v0).Normalized() };
+	}
+
+	//The OBJ parser Utils::ParseOBJ replaced, kept as the baseline of its benchmark.
+	//Only change: it stops when reading a command fails, the original repeated the last line at the end of the file.
+	bool ParseOBJWithIFStream(const std::string& filename, std::vector<Vector3>& positions, std::vector<Vector3>& normals, std::vector<int>& indices)
+	{
+		std::ifstream file(filename);
+		if (!file)
+			return false;
+
+		std::string sCommand;
+		// start a while iteration ending when the end of file is reached (ios::eof)
+		while (!file.eof())
+		{
+			//read the first word of the string, use the >> operator (istream::operator>>) 
+			if (!(file >> sCommand))
+				break;
+			//use conditional statements to process the different commands	
+			if (sCommand == "#")
+			{
+				// Ignore Comment
+			}
+			else if (sCommand == "v")
+			{
+				//Vertex
+				float x, y, z;
+				file >> x >> y >> z;
+				positions.push_back({ x, y, z });
+			}
+			else if (sCommand == "f")
+			{
+				float i0, i1, i2;
+				file >> i0 >> i1 >> i2;
+
+				indices.push_back((int)i0 - 1);
+				indices.push_back((int)i1 - 1);
+				indices.push_back((int)i2 - 1);
+			}
+			//read till end of line and ignore all remaining chars
+			file.ignore(1000, '\n');
+
+			if (file.eof())
+				break;
+		}
+
+		//Precompute normals
+		for (uint64_t index = 0; index < indices.size(); index += 3)
+		{
+			uint32_t i0 = indices[index];
+			uint32_t i1 = indices[index + 1];
+			uint32_t i2 = indices[index + 2];
+
+			Vector3 edgeV0V1 = positions[i1] - positions[i0];
+			Vector3 edgeV0V2 = positions[i2] - positions[i0];
+			Vector3 normal = Vector3::Cross(edgeV0V1, edgeV0V2);
+
+			normal.Normalize();
+			normals.push_back(normal);
+		}
+
+		return true;
+	}
+
+	//A UV sphere with a bumpy radius, positions written with six decimals like most exporters do
+	void WriteSphereOBJ(const std::string& filename, uint32_t triangleCount)
+	{
+		const uint32_t rings = std::max(2u, static_cast<uint32_t>(std::sqrt(triangleCount / 4.f)));
+		const uint32_t segments = 2 * rings;
+
+		std::ofstream file(filename);
+		file << "# Sphere of " << 2 * rings * segments << " triangles\n" << std::fixed << std::setprecision(6);
+		for (uint32_t ring = 0; ring <= rings; ++ring)
+		{
+			const float theta = PI * ring / rings;
+			for (uint32_t segment = 0; segment < segments; ++segment)
+			{
+				const float phi = 2.f * PI * segment / segments;
+				const float radius = 1.f + 0.05f * std::sin(7.f * theta) * std::cos(5.f * phi);
+				file << "v " << radius * std::sin(theta) * std::cos(phi) << ' ' << radius * std::cos(theta) << ' ' << radius * std::sin(theta) * std::sin(phi) << '\n';
+			}
+		}
+		//The poles repeat one vertex per segment, which leaves degenerate triangles there just like real scans have
+		for (uint32_t ring = 0; ring < rings; ++ring)
+		{
+			for (uint32_t segment = 0; segment < segments; ++segment)
+			{
+				const uint32_t v0 = ring * segments + segment + 1;
+				const uint32_t v1 = ring * segments + (segment + 1) % segments + 1;
+				file << "f " << v0 << ' ' << v0 + segments << ' ' << v1 << '\n';
+				file << "f " << v1 << ' ' << v0 + segments << ' ' << v1 + segments << '\n';
+			}
+		}
+	}
+}
+
+bool Benchmarks::RunHitChecks()
+{
+	const char* bvhLayoutNames[]{ "Binary", "Wide4", "Wide8", "Quantized4" };
+	const char* leafLayoutNames[]{ "Scalar", "Packet4", "Packet8" };
+	const char* triangleKernelNames[]{ "MollerTrumbore", "Affine" };
+
+	bool hasPassed{ true };
+	for (int bvhLayout = 0; bvhLayout < 4; ++bvhLayout)
+	{
+		for (int leafLayout = 0; leafLayout < 3; ++leafLayout)
+		{
+			for (int triangleKernel = 0; triangleKernel < 2; ++triangleKernel)
+			{
+				Scene_SphereBeforeMesh scene{ static_cast<BVHLayout>(bvhLayout), static_cast<LeafLayout>(leafLayout), static_cast<TriangleKernel>(triangleKernel) };
+				scene.Initialize();
+
+				int rayCount{};
+				const int wrongHits = scene.CountWrongHits(rayCount);
+				if (wrongHits > 0)
+				{
+					std::cout << "Hit check FAILED: " << bvhLayoutNames[bvhLayout] << " | " << leafLayoutNames[leafLayout] << " | " << triangleKernelNames[triangleKernel]
+						<< ": " << wrongHits << " of " << rayCount << " rays got the wrong hit" << std::endl;
+					hasPassed = false;
+				}
+			}
+		}
+	}
+	std::cout << (hasPassed ? "Hit checks passed" : "Hit checks FAILED") << std::endl;
+	return hasPassed;
+}
+
+bool Benchmarks::RunTriangleKernelBenchmark()
+{
+	constexpr int triangleCount{ 1024 };
+	constexpr int rayCount{ 4096 };
+	constexpr int packetWidth{ 8 };
+
+	//Random triangles around the unit cube, rays from a sphere around it through random points inside
+	std::mt19937 generator{ 7 };
+	std::uniform_real_distribution<float> distribution{ -1.f, 1.f };
+	const auto getRandomVector = [&]() { return Vector3{ distribution(generator), distribution(generator), distribution(generator) }; };
+
+	std::vector<BVHTriangle> triangles(triangleCount);
+	std::vector<BVHTriangleAffine> affineTriangles(triangleCount);
+	std::vector<BVHTrianglePacket<packetWidth>> packets(triangleCount / packetWidth);
+	std::vector<BVHTriangleAffinePacket<packetWidth>> affinePackets(triangleCount / packetWidth);
+	for (int i = 0; i < triangleCount; ++i)
+	{
+		const Vector3 center = getRandomVector();
+		const Vector3 v0 = center + getRandomVector() * 0.3f;
+		const Vector3 v1 = center + getRandomVector() * 0.3f;
+		const Vector3 v2 = center + getRandomVector() * 0.3f;
+		triangles[i] = GetBVHTriangle(v0, v1, v2);
+		affineTriangles[i] = GetTriangleAffine(triangles[i]);
+		packets[i / packetWidth].SetLane(i % packetWidth, triangles[i]);
+		affinePackets[i / packetWidth].SetLane(i % packetWidth, triangles[i]);
+	}
+	std::vector<Ray> rays(rayCount);
+	for (Ray& ray : rays)
+	{
+		ray.origin = getRandomVector().Normalized() * 3.f;
+		ray.direction = (getRandomVector() - ray.origin).Normalized();
+		ray.invertedDirection = ray.direction.Inversed();
+	}
+
+	//Both kernels should hit the same triangles at about the same t
+	uint64_t bothHitCount{};
+	uint64_t disagreeCount{};
+	float maxRelativeTDifference{};
+	for (const Ray& ray : rays)
+	{
+		for (int i = 0; i < triangleCount; ++i)
+		{
+			HitRecord hitRecord{};
+			HitRecord affineHitRecord{};
+			const bool isHit = GeometryUtils::HitTest_Triangle<HitQuery::ClosestHit, TriangleCullMode::NoCulling>(triangles[i], ray, hitRecord);
+			const bool isAffineHit = GeometryUtils::HitTest_Triangle<HitQuery::ClosestHit, TriangleCullMode::NoCulling>(affineTriangles[i], ray, affineHitRecord);
+			if (isHit != isAffineHit)
+			{
+				++disagreeCount;
+			}
+			else if (isHit)
+			{
+				++bothHitCount;
+				maxRelativeTDifference = std::max(maxRelativeTDifference, std::abs(hitRecord.t - affineHitRecord.t) / hitRecord.t);
+			}
+		}
+	}
+	std::cout << "Triangle kernels: " << triangleCount * rayCount << " tests, both hit " << bothHitCount << ", only one hit " << disagreeCount
+		<< ", max relative t difference " << maxRelativeTDifference << std::endl;
+
+	//The hit counts are printed so the tests cannot be optimized away
+	const float millionTests{ static_cast<float>(triangleCount) * rayCount / 1e6f };
+	uint64_t hitCount{};
+	const auto printSpeed = [&](const char* name, float time, float affineTime)
+		{
+			std::cout << name << ": Moller-Trumbore " << millionTests / time * 1000.f << " Mtests/s, affine " << millionTests / affineTime * 1000.f << " Mtests/s" << std::endl;
+		};
+	printSpeed("Scalar closest hit",
+		TimeBest([&]() { hitCount += CountTriangleHits<HitQuery::ClosestHit, TriangleCullMode::NoCulling>(triangles, rays); }),
+		TimeBest([&]() { hitCount += CountTriangleHits<HitQuery::ClosestHit, TriangleCullMode::NoCulling>(affineTriangles, rays); }));
+	printSpeed("Scalar any hit, back face culling",
+		TimeBest([&]() { hitCount += CountTriangleHits<HitQuery::AnyHit, TriangleCullMode::BackFaceCulling>(triangles, rays); }),
+		TimeBest([&]() { hitCount += CountTriangleHits<HitQuery::AnyHit, TriangleCullMode::BackFaceCulling>(affineTriangles, rays); }));
+	printSpeed("8 wide closest hit",
+		TimeBest([&]() { hitCount += CountTrianglePacketHits(packets, rays); }),
+		TimeBest([&]() { hitCount += CountTrianglePacketHits(affinePackets, rays); }));
+	std::cout << "(" << hitCount << " hits)" << std::endl;
+
+	//A grid of quads with jittered vertices and heights, rays from four directions aimed exactly at every inner vertex and edge midpoint.
+	//Each ray is only tested against the triangles sharing its target, one of them has to be hit.
+	constexpr int gridSize{ 64 };
+	const auto getGridPoint = [](int x, int y)
+		{
+			return Vector3{ x / float(gridSize) + 0.004f * std::sin(x * 1.7f + y), y / float(gridSize) + 0.0035f * std::cos(x + 2.3f * y), 0.01f * std::sin(x * 0.9f) * std::cos(y * 1.3f) };
+		};
+	//Cell x, y is split along its diagonal from x + 1, y to x, y + 1
+	const auto getLowerTriangle = [&](int x, int y) { return GetBVHTriangle(getGridPoint(x, y), getGridPoint(x + 1, y), getGridPoint(x, y + 1)); };
+	const auto getUpperTriangle = [&](int x, int y) { return GetBVHTriangle(getGridPoint(x + 1, y), getGridPoint(x + 1, y + 1), getGridPoint(x, y + 1)); };
+	struct SharedTarget
+	{
+		Vector3 point;
+		std::vector<BVHTriangle> triangles;
+	};
+
+	int edgeRayCount{};
+	int missCount{};
+	int affineMissCount{};
+	int packetMissCount{};
+	int affinePacketMissCount{};
+	for (int y = 1; y < gridSize; ++y)
+	{
+		for (int x = 1; x < gridSize; ++x)
+		{
+			const SharedTarget targets[]
+			{
+				{ getGridPoint(x, y), { getLowerTriangle(x, y), getLowerTriangle(x - 1, y), getUpperTriangle(x - 1, y), getLowerTriangle(x, y - 1), getUpperTriangle(x, y - 1), getUpperTriangle(x - 1, y - 1) } },
+				{ (getGridPoint(x, y) + getGridPoint(x + 1, y)) * 0.5f, { getLowerTriangle(x, y), getUpperTriangle(x, y - 1) } },
+				{ (getGridPoint(x, y) + getGridPoint(x, y + 1)) * 0.5f, { getLowerTriangle(x, y), getUpperTriangle(x - 1, y) } },
+				{ (getGridPoint(x + 1, y) + getGridPoint(x, y + 1)) * 0.5f, { getLowerTriangle(x, y), getUpperTriangle(x, y) } }
+			};
+			for (const SharedTarget& target : targets)
+			{
+				std::vector<BVHTriangleAffine> affineTriangles(target.triangles.size());
+				std::vector<BVHTrianglePacket<packetWidth>> packets(1);
+				std::vector<BVHTriangleAffinePacket<packetWidth>> affinePackets(1);
+				for (size_t i = 0; i < target.triangles.size(); ++i)
+				{
+					affineTriangles[i] = GetTriangleAffine(target.triangles[i]);
+					packets[0].SetLane(static_cast<int>(i), target.triangles[i]);
+					affinePackets[0].SetLane(static_cast<int>(i), target.triangles[i]);
+				}
+				for (int direction = 0; direction < 4; ++direction)
+				{
+					Ray ray{};
+					ray.origin = target.point + Vector3{ 0.3f * (direction - 1.5f), (direction % 2) ? 0.2f : -0.2f, -1.f };
+					ray.direction = (target.point - ray.origin).Normalized();
+					ray.invertedDirection = ray.direction.Inversed();
+					++edgeRayCount;
+					missCount += !DoesHitAnyTriangle(target.triangles, ray);
+					affineMissCount += !DoesHitAnyTriangle(affineTriangles, ray);
+					packetMissCount += !DoesHitAnyTrianglePacket(packets, ray);
+					affinePacketMissCount += !DoesHitAnyTrianglePacket(affinePackets, ray);
+				}
+			}
+		}
+	}
+	//Moller-Trumbore has no tolerance and is only reported, the affine kernel has to hit every target
+	const bool hasPassed = affineMissCount == 0 && affinePacketMissCount == 0;
+	std::cout << "Vertex and edge rays: " << edgeRayCount << ", missed by Moller-Trumbore " << missCount << " (8 wide " << packetMissCount
+		<< "), affine " << affineMissCount << " (8 wide " << affinePacketMissCount << ")" << (hasPassed ? "" : " FAILED") << std::endl;
+	return hasPassed;
+}
+
+bool Benchmarks::RunOBJParserBenchmark(uint32_t triangleCount)
+{
+	const std::string filename = (std::filesystem::temp_directory_path() / "RayTracerParserBenchmark.obj").string();
+	WriteSphereOBJ(filename, triangleCount);
+	const float fileMB = std::filesystem::file_size(filename) / (1024.f * 1024.f);
+
+	std::vector<Vector3> positions{};
+	std::vector<Vector3> normals{};
+	std::vector<int> indices{};
+	std::vector<Vector3> oldPositions{};
+	std::vector<Vector3> oldNormals{};
+	std::vector<int> oldIndices{};
+	bool isParsed{ true };
+	const float time = TimeBest([&]()
+		{
+			positions.clear();
+			normals.clear();
+			indices.clear();
+			isParsed = Utils::ParseOBJ(filename, positions, normals, indices) && isParsed;
+		});
+	const float oldTime = TimeBest([&]()
+		{
+			oldPositions.clear();
+			oldNormals.clear();
+			oldIndices.clear();
+			ParseOBJWithIFStream(filename, oldPositions, oldNormals, oldIndices);
+		});
+	std::filesystem::remove(filename);
+
+	//Bitwise, the new parser rounds every float exactly like the stream did
+	const auto isSame = [](const auto& values, const auto& oldValues)
+		{
+			return values.size() == oldValues.size() && std::memcmp(values.data(), oldValues.data(), values.size() * sizeof(values[0])) == 0;
+		};
+	const bool hasPassed = isParsed && isSame(positions, oldPositions) && isSame(indices, oldIndices) && isSame(normals, oldNormals);
+	std::cout << "OBJ parser: " << fileMB << " MB, " << positions.size() << " vertices, " << indices.size() / 3 << " triangles | ifstream "
+		<< oldTime << " ms (" << fileMB / oldTime * 1000.f << " MB/s) | ParseOBJ " << time << " ms (" << fileMB / time * 1000.f << " MB/s)"
+		<< (hasPassed ? "" : " | results differ FAILED") << std::endl;
+	return hasPassed;
+}
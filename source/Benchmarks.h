@@ -0,0 +1,20 @@
+#pragma once
+#include <cstdint>
+
+namespace dae
+{
+	//Correctness checks and microbenchmarks of single parts of the tracer, started from a key in main and reported on the console
+	namespace Benchmarks
+	{
+		//Traces rays through a sphere in front of a mesh for every BVH layout, leaf layout and triangle kernel.
+		//Fails when a ray gets the origin, normal or material of another primitive than the closest one it hits.
+		bool RunHitChecks();
+		//Times the Moller-Trumbore and affine triangle kernels in million tests per second, scalar and 8 wide,
+		//then aims rays at the vertices and edge midpoints of a bumpy grid mesh. Fails when the affine kernel, scalar or 8 wide,
+		//misses all triangles sharing such a target. Moller-Trumbore leaks at those targets and its misses are only reported.
+		bool RunTriangleKernelBenchmark();
+		//Writes a sphere of about triangleCount triangles as an OBJ file to the temp directory, then times Utils::ParseOBJ
+		//against the ifstream parser it replaced. Fails when the two disagree on any position, index or normal.
+		bool RunOBJParserBenchmark(uint32_t triangleCount = 200000);
+	}
+}
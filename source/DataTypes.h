@@ -1,5 +1,12 @@
 #pragma once
+#include <algorithm>
+#include <atomic>
+#include <bit>
 #include <cassert>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <thread>
 
 #include "Math.h"
 #include "vector"
@@ -14,6 +21,13 @@ namespace dae
 
 		unsigned char materialIndex{ 0 };
 	};
+	//Sphere of a SphereSet, its material is kept per set so four records load straight into one SIMD register each
+	struct alignas(16) SphereRecord
+	{
+		Vector3 origin{};
+		float radius{};
+	};
+	static_assert(sizeof(SphereRecord) == 16);
 
 	struct Plane
 	{
@@ -23,6 +37,49 @@ namespace dae
 		unsigned char materialIndex{ 0 };
 	};
 
+	//Width spheres stored SoA for the SIMD sphere kernel, unused lanes keep a negative squared radius and never hit
+	template<int Width>
+	struct alignas(32) SpherePacket
+	{
+		static constexpr int width{ Width };
+
+		float originX[Width]{};
+		float originY[Width]{};
+		float originZ[Width]{};
+		float sqrRadius[Width]{};
+
+		SpherePacket()
+		{
+			std::fill(std::begin(sqrRadius), std::end(sqrRadius), -FLT_MAX);
+		}
+		void SetLane(int lane, const Sphere& sphere)
+		{
+			originX[lane] = sphere.origin.x;
+			originY[lane] = sphere.origin.y;
+			originZ[lane] = sphere.origin.z;
+			sqrRadius[lane] = sphere.radius * sphere.radius;
+		}
+	};
+	//Width planes stored SoA as their normal and distance along it, unused lanes keep a zero normal and never hit
+	template<int Width>
+	struct alignas(32) PlanePacket
+	{
+		static constexpr int width{ Width };
+
+		float normalX[Width]{};
+		float normalY[Width]{};
+		float normalZ[Width]{};
+		float distance[Width]{};
+
+		void SetLane(int lane, const Plane& plane)
+		{
+			normalX[lane] = plane.normal.x;
+			normalY[lane] = plane.normal.y;
+			normalZ[lane] = plane.normal.z;
+			distance[lane] = Vector3::Dot(plane.normal, plane.origin);
+		}
+	};
+
 	enum class TriangleCullMode
 	{
 		FrontFaceCulling,
@@ -30,6 +87,14 @@ namespace dae
 		NoCulling
 	};
 
+	//Closest hit queries keep the nearest hit in a HitRecord, any hit queries (shadow rays) stop at the first hit and leave it untouched.
+	//The hit tests are templated on it, so neither pays for the other's checks.
+	enum class HitQuery
+	{
+		ClosestHit,
+		AnyHit
+	};
+
 	struct Triangle
 	{
 		Triangle() = default;
@@ -53,20 +118,243 @@ namespace dae
 		TriangleCullMode cullMode{};
 		unsigned char materialIndex{};
 	};
-	struct BVHNode
+	//Triangle as stored in the leaves of a mesh BVH: ready for Moller-Trumbore, no index lookups
+	struct BVHTriangle
+	{
+		Vector3 v0{};
+		Vector3 edge1{};
+		Vector3 edge2{};
+		Vector3 normal{};
+	};
+	//Leaf triangle for the affine kernel: the rows of the transform to the space where the triangle is (0, 0, 0), (1, 0, 0), (0, 1, 0).
+	//Its inverse has edge1, edge2 and the face normal as columns, so row2 is the normal scaled by 1 / |normal|^2 and keeps its sign.
+	//A ray then hits at the t where row2 is zero, with barycentrics u and v given by row0 and row1 at that point.
+	struct BVHTriangleAffine
+	{
+		Vector3 row0{};
+		float offset0{};
+		Vector3 row1{};
+		float offset1{};
+		Vector3 row2{};
+		float offset2{};
+	};
+	//Degenerate triangles keep all zero rows, which give every ray a NaN t that no range test accepts
+	inline BVHTriangleAffine GetTriangleAffine(const BVHTriangle& triangle)
+	{
+		const Vector3 normal = Vector3::Cross(triangle.edge1, triangle.edge2);
+		const float sqrNormal = normal.SqrMagnitude();
+		if (!(sqrNormal > 0.f))
+		{
+			return {};
+		}
+		const float invSqrNormal = 1.f / sqrNormal;
+
+		BVHTriangleAffine affine{};
+		affine.row0 = Vector3::Cross(triangle.edge2, normal) * invSqrNormal;
+		affine.row1 = Vector3::Cross(normal, triangle.edge1) * invSqrNormal;
+		affine.row2 = normal * invSqrNormal;
+		affine.offset0 = -Vector3::Dot(affine.row0, triangle.v0);
+		affine.offset1 = -Vector3::Dot(affine.row1, triangle.v0);
+		affine.offset2 = -Vector3::Dot(affine.row2, triangle.v0);
+		return affine;
+	}
+	//Width leaf triangles stored SoA for the SIMD leaf kernel, unused lanes keep a zero normal and never hit
+	template<int Width>
+	struct alignas(32) BVHTrianglePacket
+	{
+		static constexpr int width{ Width };
+
+		float v0X[Width]{};
+		float v0Y[Width]{};
+		float v0Z[Width]{};
+		float edge1X[Width]{};
+		float edge1Y[Width]{};
+		float edge1Z[Width]{};
+		float edge2X[Width]{};
+		float edge2Y[Width]{};
+		float edge2Z[Width]{};
+		float normalX[Width]{};
+		float normalY[Width]{};
+		float normalZ[Width]{};
+
+		void SetLane(int lane, const BVHTriangle& triangle)
+		{
+			v0X[lane] = triangle.v0.x;
+			v0Y[lane] = triangle.v0.y;
+			v0Z[lane] = triangle.v0.z;
+			edge1X[lane] = triangle.edge1.x;
+			edge1Y[lane] = triangle.edge1.y;
+			edge1Z[lane] = triangle.edge1.z;
+			edge2X[lane] = triangle.edge2.x;
+			edge2Y[lane] = triangle.edge2.y;
+			edge2Z[lane] = triangle.edge2.z;
+			normalX[lane] = triangle.normal.x;
+			normalY[lane] = triangle.normal.y;
+			normalZ[lane] = triangle.normal.z;
+		}
+	};
+	//Width leaf triangles for the SIMD affine kernel, unused lanes keep all zero rows and never hit
+	template<int Width>
+	struct alignas(32) BVHTriangleAffinePacket
+	{
+		static constexpr int width{ Width };
+
+		float row0X[Width]{};
+		float row0Y[Width]{};
+		float row0Z[Width]{};
+		float offset0[Width]{};
+		float row1X[Width]{};
+		float row1Y[Width]{};
+		float row1Z[Width]{};
+		float offset1[Width]{};
+		float row2X[Width]{};
+		float row2Y[Width]{};
+		float row2Z[Width]{};
+		float offset2[Width]{};
+		//Only read to finalize a hit
+		float normalX[Width]{};
+		float normalY[Width]{};
+		float normalZ[Width]{};
+
+		void SetLane(int lane, const BVHTriangle& triangle)
+		{
+			const BVHTriangleAffine affine = GetTriangleAffine(triangle);
+			row0X[lane] = affine.row0.x;
+			row0Y[lane] = affine.row0.y;
+			row0Z[lane] = affine.row0.z;
+			offset0[lane] = affine.offset0;
+			row1X[lane] = affine.row1.x;
+			row1Y[lane] = affine.row1.y;
+			row1Z[lane] = affine.row1.z;
+			offset1[lane] = affine.offset1;
+			row2X[lane] = affine.row2.x;
+			row2Y[lane] = affine.row2.y;
+			row2Z[lane] = affine.row2.z;
+			offset2[lane] = affine.offset2;
+			normalX[lane] = triangle.normal.x;
+			normalY[lane] = triangle.normal.y;
+			normalZ[lane] = triangle.normal.z;
+		}
+	};
+
+	//An inner node only uses leftChild and a leaf only firstIndice, sharing them keeps a node at 32 bytes
+	struct alignas(32) BVHNode
 	{
 		Vector3 aabbMin{};
+		union
+		{
+			uint32_t leftChild;
+			uint32_t firstIndice{};
+		};
 		Vector3 aabbMax{};
-		uint32_t leftChild{};
-		uint32_t firstIndice{};
 		uint32_t indicesCount{};
-		bool IsLeaf() { return indicesCount > 0; };
+		bool IsLeaf() const { return indicesCount > 0; };
+	};
+	static_assert(sizeof(BVHNode) == 32);
+
+	//Node pool aligned to a cache line: with the root at index 1, every child pair starts at an even index and shares one line
+	struct BVHNodePoolDeleter
+	{
+		void operator()(BVHNode* pNodes) const
+		{
+			::operator delete[](pNodes, std::align_val_t{ 64 });
+		}
+	};
+	using BVHNodePool = std::unique_ptr<BVHNode[], BVHNodePoolDeleter>;
+	inline BVHNodePool AllocateBVHNodes(uint32_t count)
+	{
+		BVHNode* pNodes = static_cast<BVHNode*>(::operator new[](count * sizeof(BVHNode), std::align_val_t{ 64 }));
+		std::uninitialized_value_construct_n(pNodes, count);
+		return BVHNodePool{ pNodes };
+	}
+
+	//Node of a 4- or 8-wide BVH collapsed from the binary tree.
+	//Child bounds are stored SoA so one SIMD slab test checks all children at once.
+	template<int Width>
+	struct alignas(64) WideBVHNode
+	{
+		static constexpr int width{ Width };
+
+		float minX[Width]{};
+		float minY[Width]{};
+		float minZ[Width]{};
+		float maxX[Width]{};
+		float maxY[Width]{};
+		float maxZ[Width]{};
+		//Inner child: index of its WideBVHNode, leaf child: index of its first BVHTriangle
+		uint32_t child[Width]{};
+		//0 for inner children
+		uint16_t triangleCount[Width]{};
+		uint8_t childCount{};
+	};
+
+	//4-wide node compressed into one cache line: child bounds are stored as 8-bit offsets on a per-axis
+	//power-of-two grid anchored at the node's own minimum, rounded outwards so they always enclose the child.
+	struct alignas(64) QuantizedBVHNode4
+	{
+		static constexpr int width{ 4 };
+
+		float originX{};
+		float originY{};
+		float originZ{};
+		int8_t exponentX{};
+		int8_t exponentY{};
+		int8_t exponentZ{};
+		uint8_t childCount{};
+		uint8_t minX[4]{};
+		uint8_t minY[4]{};
+		uint8_t minZ[4]{};
+		uint8_t maxX[4]{};
+		uint8_t maxY[4]{};
+		uint8_t maxZ[4]{};
+		uint32_t child[4]{};
+		uint16_t triangleCount[4]{};
+	};
+	static_assert(sizeof(QuantizedBVHNode4) == 64);
+	//2^exponent for a normal float exponent in [-126, 127]
+	inline float GetQuantizationScale(int exponent)
+	{
+		return std::bit_cast<float>(static_cast<uint32_t>(exponent + 127) << 23);
+	}
+
+	enum class BVHLayout
+	{
+		Binary,
+		Wide4,
+		Wide8,
+		Quantized4
+	};
+
+	enum class BVHBuilder
+	{
+		//Binned SAH object splits, the default
+		BinnedSAH,
+		//Binned SAH with spatial splits (SBVH), slower to build, for large and elongated triangles
+		SpatialSplits,
+		//Morton code order (LBVH), fastest to build, for meshes that change every frame
+		Linear
+	};
+
+	enum class LeafLayout
+	{
+		Scalar,
+		Packet4,
+		Packet8
+	};
+
+	enum class TriangleKernel
+	{
+		//Moller-Trumbore on the vertex and edges, the default. Not watertight: rays aimed at shared edges and vertices can miss every triangle.
+		MollerTrumbore,
+		//Precomputed world to triangle space transforms (Baldwin and Weber 2016), 12 more floats per triangle for fewer operations per test.
+		//Not watertight either, it only closes the gaps at shared edges and vertices up to GeometryUtils::affineBarycentricEpsilon.
+		Affine
 	};
 
 	struct AABB
 	{
 		Vector3 min{ Vector3::One * FLT_MAX };
-		Vector3 max{ Vector3::One * FLT_MIN };
+		Vector3 max{ Vector3::One * -FLT_MAX };
 		void Grow(const Vector3& point)
 		{
 			min = Vector3::Min(min, point);
@@ -77,82 +365,202 @@ namespace dae
 			min = Vector3::Min(min, bounds.min);
 			max = Vector3::Max(max, bounds.max);
 		}
-		float GetArea()
+		float GetArea() const
 		{
 			Vector3 boxSize{ max - min };
 			return boxSize.x * boxSize.y + boxSize.y * boxSize.z + boxSize.z * boxSize.x;
 		}
 	};
 
+	enum class PrimitiveType : uint8_t
+	{
+		Sphere,
+		Triangle,
+		TriangleMeshInstance,
+		//Spheres close together tested with one SIMD kernel, only in the top-level BVH, a HitRecord refers to the Sphere it hit
+		SpherePacket,
+		//Spheres added in bulk with their own BVH, a HitRecord refers to the set and keeps the sphere slot in elementIndex
+		SphereSet,
+		//Unbounded, so never in the top-level BVH, only used to tell which primitive a HitRecord hit
+		Plane
+	};
+
+	//Reference to a bounded scene object, index into the matching geometry vector of the scene
+	struct PrimitiveRef
+	{
+		uint32_t index{};
+		PrimitiveType type{};
+	};
+
+	struct TLASNode
+	{
+		Vector3 aabbMin{};
+		Vector3 aabbMax{};
+		uint32_t leftChild{};
+		uint32_t firstPrimitive{};
+		uint32_t primitiveCount{};
+		bool IsLeaf() const { return primitiveCount > 0; };
+	};
+
+	//Settings of the mesh BVH builders, costs are relative to intersecting one triangle
+	struct BVHBuildSettings
+	{
+		//Split planes tried per axis are nrBins - 1, at most TriangleMesh::maxBuildBins bins
+		uint32_t nrBins{ 8 };
+		//Cost of visiting a node, added to every split so small nodes stop splitting once it outweighs the triangles saved
+		float traversalCost{ 0.f };
+		//Nodes with more triangles are split even when the SAH prefers a leaf
+		uint32_t maxLeafTriangles{ 64 };
+	};
+	//Threads a BVH node at the given depth may use, the nodes of one level are built concurrently and each thread gets at least parallelBuildCount primitives
+	inline uint32_t GetBuildThreadCount(uint32_t depth, uint32_t count, uint32_t parallelBuildCount)
+	{
+		static const uint32_t hardwareThreads{ std::max(1u, std::thread::hardware_concurrency()) };
+		if (depth >= 32 || count < parallelBuildCount)
+		{
+			return 1;
+		}
+		return std::clamp(hardwareThreads >> depth, 1u, count / parallelBuildCount);
+	}
 	struct Bin
 	{
 		AABB bounds{};
 		int indicesCount{};
 	};
+	//Scratch data of a BVH build: partitioning only moves the 4-byte triangle references,
+	//the centroid and bounds of every triangle are computed once and looked up by triangle index.
+	struct BVHBuildReferences
+	{
+		std::vector<uint32_t> triangles{};
+		std::vector<Vector3> centroids{};
+		std::vector<AABB> bounds{};
+	};
+	//Triangle reference of a spatial split build, its bounds only cover the part of the triangle inside the node
+	struct SBVHReference
+	{
+		AABB bounds{};
+		uint32_t triangle{};
+	};
+	struct SpatialBin
+	{
+		AABB bounds{};
+		uint32_t entries{};
+		uint32_t exits{};
+	};
+	struct SBVHSplit
+	{
+		float cost{ FLT_MAX };
+		int axis{};
+		float position{};
+		AABB leftBounds{};
+		AABB rightBounds{};
+		uint32_t leftCount{};
+		uint32_t rightCount{};
+	};
+	//Shared by all subtrees of a spatial split build: leaves append their references to leafTriangles
+	struct SBVHBuildState
+	{
+		std::vector<uint32_t> leafTriangles{};
+		std::atomic<uint32_t> leafTrianglesUsed{};
+		std::atomic<uint32_t> duplicatesLeft{};
+		float rootArea{};
+	};
+	//Triangle geometry and its BVH, both in object space.
+	//A mesh is placed in the scene through one or more TriangleMeshInstances that share its BVH.
 	struct TriangleMesh
 	{
 		TriangleMesh() = default;
-		TriangleMesh(const std::vector<Vector3>& _positions, const std::vector<int>& _indices, TriangleCullMode _cullMode):
-		positions(_positions), indices(_indices), cullMode(_cullMode)
+		TriangleMesh(const std::vector<Vector3>& _positions, const std::vector<int>& _indices):
+		positions(_positions), indices(_indices)
 		{
 			//Calculate Normals
 			CalculateNormals();
 
-			//Update Transforms
-			UpdateTransforms();
+			//Build BVH
+			UpdateBVH();
 		}
 
-		TriangleMesh(const std::vector<Vector3>& _positions, const std::vector<int>& _indices, const std::vector<Vector3>& _normals, TriangleCullMode _cullMode) :
-			positions(_positions), indices(_indices), normals(_normals), cullMode(_cullMode)
+		TriangleMesh(const std::vector<Vector3>& _positions, const std::vector<int>& _indices, const std::vector<Vector3>& _normals) :
+			positions(_positions), indices(_indices), normals(_normals)
 		{
-			UpdateTransforms();
+			UpdateBVH();
 		}
 
-		~TriangleMesh()
-		{
-			delete[] pBvhNodes;
-		}
+		~TriangleMesh() = default;
+
+		TriangleMesh(const TriangleMesh&) = delete;
+		TriangleMesh(TriangleMesh&&) noexcept = default;
+		TriangleMesh& operator=(const TriangleMesh&) = delete;
+		TriangleMesh& operator=(TriangleMesh&&) noexcept = default;
 
 		std::vector<Vector3> positions{};
 		std::vector<Vector3> normals{};
 		std::vector<int> indices{};
-		unsigned char materialIndex{};
-
-		TriangleCullMode cullMode{TriangleCullMode::BackFaceCulling};
-
-		Matrix rotationTransform{};
-		Matrix translationTransform{};
-		Matrix scaleTransform{};
 
 		Vector3 minAABB;
 		Vector3 maxAABB;
 
-		Vector3 transformedMinAABB;
-		Vector3 transformedMaxAABB;
+		//Sized for the worst case of 2N - 1 nodes while building, shrunk to bvhNodesUsed + 1 afterwards.
+		//Index 0 is padding so the child pairs line up with cache lines.
+		BVHNodePool pBvhNodes{};
+		uint32_t bvhNodeCapacity{};
+		uint32_t startBvhNodeIndx{ 1 };
+		uint32_t bvhNodesUsed{};
 
-		std::vector<Vector3> transformedPositions{};
-		std::vector<Vector3> transformedNormals{};
+		//After a build the child pairs are laid out in treelets of bvhTreeletPairs pairs (see ReorderBVHNodes)
+		bool bvhTreeletLayout{ true };
+		uint32_t bvhTreeletPairs{ 16 };
+		float bvhBuildTimeMs{};
+		float bvhBuildSAHCost{};
+		float bvhRebuildCostRatio{ 1.5f };
 
-		BVHNode* pBvhNodes{};
-		uint32_t startBvhNodeIndx{};
-		uint32_t bvhNodesUsed{};
+		//Nodes with at least this many triangles bin in parallel chunks and build their two subtrees concurrently
+		static constexpr uint32_t parallelBuildTriangles{ 16384 };
+		BVHBuildSettings bvhBuildSettings{};
+		static constexpr int maxBuildBins{ 32 };
+		//Wide and quantized nodes store leaf sizes in 16 bits, every builder splits larger leaves even without a useful plane
+		static constexpr uint32_t maxLeafTriangleCount{ UINT16_MAX };
 
-		void Translate(const Vector3& translation)
-		{
-			translationTransform = Matrix::CreateTranslation(translation);
-		}
+		BVHBuilder bvhBuilder{ BVHBuilder::BinnedSAH };
 
-		void RotateY(float yaw)
-		{
-			rotationTransform = Matrix::CreateRotationY(yaw);
-		}
+		//Spatial splits (SBVH, Stich et al. 2009) clip the references that straddle a split plane into both children.
+		//It pays off for large and elongated triangles, which the object splits can only wrap in overlapping nodes.
+		//bvhSpatialSplitBudget caps the extra references as a fraction of the triangle count.
+		float bvhSpatialSplitBudget{ 0.3f };
+		//Spatial splits are only tried when the best object split overlaps more than this fraction of the root area
+		static constexpr float spatialSplitOverlap{ 1e-5f };
 
-		void Scale(const Vector3& scale)
-		{
-			scaleTransform = Matrix::CreateScale(scale);
-		}
+		//Linear builds (LBVH) sort the triangles along a Morton curve and split at the highest differing bit of the codes,
+		//bvhLinearTreelets then restructures every treelet of treeletLeaves nodes for the lowest SAH cost (Karras and Aila 2013)
+		bool bvhLinearTreelets{ true };
+		static constexpr int treeletLeaves{ 5 };
 
-		void AppendTriangle(const Triangle& triangle, bool ignoreTransformUpdate = false)
+		//One record per triangle in leaf order, a leaf covers bvhTriangles[firstIndice / 3, (firstIndice + indicesCount) / 3)
+		std::vector<BVHTriangle> bvhTriangles{};
+		//Leaf slot to triangle, only filled by spatial split builds since those can place a triangle in several leaves
+		std::vector<uint32_t> bvhTriangleRefs{};
+
+		//Wide layouts are collapsed from the binary tree after every build, only the one matching bvhLayout is filled
+		BVHLayout bvhLayout{ BVHLayout::Binary };
+		std::vector<WideBVHNode<4>> bvh4Nodes{};
+		std::vector<WideBVHNode<8>> bvh8Nodes{};
+		std::vector<QuantizedBVHNode4> bvhQuantizedNodes{};
+
+		//With a packet layout every leaf is padded to whole packets, bvhLeafFirstPacket holds the first packet of every leaf node.
+		//The SAH then also counts whole packets, so the build favours leaves that are a multiple of the packet width.
+		LeafLayout leafLayout{ LeafLayout::Scalar };
+		std::vector<uint32_t> bvhLeafFirstPacket{};
+		std::vector<BVHTrianglePacket<4>> bvhPackets4{};
+		std::vector<BVHTrianglePacket<8>> bvhPackets8{};
+
+		//The affine kernel replaces the scalar leaf triangles by bvhTriangleAffines and the packets by the affine packets,
+		//bvhTriangles is still filled since the packets are built from it and scalar leaves take their normals from it
+		TriangleKernel triangleKernel{ TriangleKernel::MollerTrumbore };
+		std::vector<BVHTriangleAffine> bvhTriangleAffines{};
+		std::vector<BVHTriangleAffinePacket<4>> bvhAffinePackets4{};
+		std::vector<BVHTriangleAffinePacket<8>> bvhAffinePackets8{};
+
+		void AppendTriangle(const Triangle& triangle, bool ignoreBVHUpdate = false)
 		{
 			int startIndex = static_cast<int>(positions.size());
 
@@ -166,11 +574,24 @@ namespace dae
 
 			normals.push_back(triangle.normal);
 
-			//Not ideal, but making sure all vertices are updated
-			if(!ignoreTransformUpdate)
-				UpdateTransforms();
+			if(!ignoreBVHUpdate)
+				UpdateBVH();
 		}
 
+		//Copies everything that shapes the BVH of the mesh, but neither its geometry nor the BVH itself
+		void CopyBVHSettings(const TriangleMesh& mesh)
+		{
+			bvhTreeletLayout = mesh.bvhTreeletLayout;
+			bvhTreeletPairs = mesh.bvhTreeletPairs;
+			bvhRebuildCostRatio = mesh.bvhRebuildCostRatio;
+			bvhBuildSettings = mesh.bvhBuildSettings;
+			bvhBuilder = mesh.bvhBuilder;
+			bvhLinearTreelets = mesh.bvhLinearTreelets;
+			bvhSpatialSplitBudget = mesh.bvhSpatialSplitBudget;
+			bvhLayout = mesh.bvhLayout;
+			leafLayout = mesh.leafLayout;
+			triangleKernel = mesh.triangleKernel;
+		}
 		void CalculateNormals()
 		{
 			normals.resize(indices.size() / 3);
@@ -179,242 +600,1741 @@ namespace dae
 				normals[i/3] = Vector3::Cross(positions[indices[i+1]] - positions[indices[i]], positions[indices[i+2]] - positions[indices[i]]).Normalized();
 			}
 		}
-		void UpdateTransforms()
+		inline void UpdateBVH()
 		{
-			const Matrix finalTransformation{ scaleTransform * rotationTransform * translationTransform };
+			const auto buildStart = std::chrono::high_resolution_clock::now();
+			const uint32_t triangleCount = static_cast<uint32_t>(indices.size() / 3);
+			const uint32_t maxReferences = bvhBuilder == BVHBuilder::SpatialSplits ? triangleCount + static_cast<uint32_t>(triangleCount * bvhSpatialSplitBudget) : triangleCount;
+			const uint32_t maxNodes = startBvhNodeIndx + (maxReferences > 0 ? 2 * maxReferences - 1 : 1);
+			if (bvhNodeCapacity < maxNodes)
+			{
+				pBvhNodes = AllocateBVHNodes(maxNodes);
+				bvhNodeCapacity = maxNodes;
+			}
+			BVHNode& startNode = pBvhNodes[startBvhNodeIndx];
+			startNode.firstIndice = 0;
+			startNode.indicesCount = static_cast<uint32_t>(indices.size());
 
-			transformedPositions.resize(positions.size());
-			transformedNormals.resize(normals.size());
+			BVHBuildReferences references{};
+			references.triangles.resize(triangleCount);
+			references.centroids.resize(triangleCount);
+			references.bounds.resize(triangleCount);
+			ForEachChunk(triangleCount, GetBuildThreadCount(0, triangleCount), [&](uint32_t, uint32_t first, uint32_t end)
+				{
+					for (uint32_t i = first; i < end; ++i)
+					{
+						const Vector3& v0 = positions[indices[3 * i]];
+						const Vector3& v1 = positions[indices[3 * i + 1]];
+						const Vector3& v2 = positions[indices[3 * i + 2]];
+						references.triangles[i] = i;
+						references.centroids[i] = (v0 + v1 + v2) / 3.f;
+						AABB& bounds = references.bounds[i];
+						bounds.Grow(v0);
+						bounds.Grow(v1);
+						bounds.Grow(v2);
+					}
+				});
 
-			for (int i = 0; i < positions.size(); i++)
+			//Subtrees are built concurrently, so nodes are allocated through an atomic counter
+			std::atomic<uint32_t> nodesUsed{ startBvhNodeIndx };
+			if (bvhBuilder == BVHBuilder::SpatialSplits)
 			{
-				transformedPositions[i] = finalTransformation.TransformPoint(positions[i]);
+				std::vector<SBVHReference> rootReferences(triangleCount);
+				for (uint32_t i = 0; i < triangleCount; ++i)
+				{
+					rootReferences[i] = { references.bounds[i], i };
+				}
+				references = {};
+
+				SBVHBuildState state{};
+				state.leafTriangles.resize(maxReferences);
+				state.duplicatesLeft = maxReferences - triangleCount;
+				SubdivideSpatial(startBvhNodeIndx, rootReferences, state, nodesUsed, 0);
+				state.leafTriangles.resize(state.leafTrianglesUsed);
+				bvhTriangleRefs.swap(state.leafTriangles);
 			}
-			for (int i = 0; i < normals.size(); i++)
+			else if (bvhBuilder == BVHBuilder::Linear)
 			{
-				transformedNormals[i] = finalTransformation.TransformVector(normals[i]).Normalized();
+				BuildLinearBVH(references, nodesUsed);
+				ReorderTriangles(references.triangles);
+				bvhTriangleRefs.clear();
 			}
-			UpdateTransformedAABB(finalTransformation);
-
-			UpdateBVH();
-		}
-		void UpdateAABB()
-		{
-			if (positions.size() > 0)
+			else
 			{
-				minAABB = positions[0];
-				maxAABB = positions[0];
-				for (auto& p : positions)
-				{
-					minAABB = Vector3::Min(p, minAABB);
-					maxAABB = Vector3::Max(p, maxAABB);
-				}
+				UpdateBVHNodeBounds(startBvhNodeIndx, references);
+				Subdivide(startBvhNodeIndx, references, nodesUsed, 0);
+				ReorderTriangles(references.triangles);
+				bvhTriangleRefs.clear();
 			}
-		}
-		void UpdateTransformedAABB(const Matrix& finalTransform)
-		{
-			// AABB Update: be careful -> transform the 8 vertices of the aabb
-			// and calculate the new min and max
-			Vector3 tMinAABB = finalTransform.TransformPoint(minAABB);
-			Vector3 tMaxAABB = tMinAABB;
-			// (xmax, ymin, zmin)
-			Vector3 tAABB = finalTransform.TransformPoint(maxAABB.x, minAABB.y, minAABB.z);
-			tMinAABB = Vector3::Min(tAABB, tMinAABB);
-			tMaxAABB = Vector3::Max(tAABB, tMaxAABB);
-			// (xmax, ymin, zmax)
-			tAABB = finalTransform.TransformPoint(maxAABB.x, minAABB.y, maxAABB.z);
-			tMinAABB = Vector3::Min(tAABB, tMinAABB);
-			tMaxAABB = Vector3::Max(tAABB, tMaxAABB);
-			// (xmin, ymin, zmax)
-			tAABB = finalTransform.TransformPoint(minAABB.x, minAABB.y, maxAABB.z);
-			tMinAABB = Vector3::Min(tAABB, tMinAABB);
-			tMaxAABB = Vector3::Max(tAABB, tMaxAABB);
-			// (minx, ymax, zmin)
-			tAABB = finalTransform.TransformPoint(minAABB.x, maxAABB.y, minAABB.z);
-			tMinAABB = Vector3::Min(tAABB, tMinAABB);
-			tMaxAABB = Vector3::Max(tAABB, tMaxAABB);
-			// (xmax, ymax, zmin)
-			tAABB = finalTransform.TransformPoint(maxAABB.x, maxAABB.y, minAABB.z);
-			tMinAABB = Vector3::Min(tAABB, tMinAABB);
-			tMaxAABB = Vector3::Max(tAABB, tMaxAABB);
-			// (xmax, ymax, zmax)
-			tAABB = finalTransform.TransformPoint(maxAABB);
-			tMinAABB = Vector3::Min(tAABB, tMinAABB);
-			tMaxAABB = Vector3::Max(tAABB, tMaxAABB);
-			// (xmin, ymax, zmax)
-			tAABB = finalTransform.TransformPoint(minAABB.x, maxAABB.y, maxAABB.z);
-			tMinAABB = Vector3::Min(tAABB, tMinAABB);
-			tMaxAABB = Vector3::Max(tAABB, tMaxAABB);
-
-			transformedMinAABB = tMinAABB;
-			transformedMaxAABB = tMaxAABB;
-		}
-		inline void UpdateBVH()
-		{
-			if (!pBvhNodes)
+			bvhNodesUsed = nodesUsed;
+			if (bvhTreeletLayout)
 			{
-				pBvhNodes = new BVHNode[indices.size()]{};
+				ReorderBVHNodes();
 			}
-			BVHNode& startNode = pBvhNodes[startBvhNodeIndx];
-			bvhNodesUsed = 0;
-			startNode.leftChild = 0;
-			startNode.firstIndice = 0;
-			startNode.indicesCount = indices.size();
+			else
+			{
+				ShrinkBVHNodes();
+			}
+
+			UpdateBVHLeafData();
+			bvhBuildSAHCost = CalculateSAHCost();
 
-			UpdateBVHNodeBounds(startBvhNodeIndx);
-			Subdivide(startBvhNodeIndx);
+			bvhBuildTimeMs = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - buildStart).count();
 		}
-		inline void UpdateBVHNodeBounds(int nodeIndx)
+		//Refits the BVH to moved vertices (same triangles, same indices) in linear time instead of rebuilding it.
+		//Tree rotations on the way up limit the quality loss, once the SAH cost still grows past
+		//bvhRebuildCostRatio times the cost after the last build the BVH is rebuilt. Returns true when it was rebuilt.
+		//Face normals are not touched, call CalculateNormals first when the triangles rotated.
+		inline bool RefitBVH()
 		{
-			BVHNode& node = pBvhNodes[nodeIndx];
-			node.aabbMin = Vector3::One * FLT_MAX;
-			node.aabbMax = Vector3::One * FLT_MIN;
+			if (!pBvhNodes)
+			{
+				UpdateBVH();
+				return true;
+			}
 
-			for (uint32_t i = node.firstIndice; i < node.firstIndice + node.indicesCount; i++)
+			RefitBVHNode(startBvhNodeIndx);
+			if (CalculateSAHCost() > bvhBuildSAHCost * bvhRebuildCostRatio)
 			{
-				Vector3& curVertex = transformedPositions[indices[i]];
-				node.aabbMin = Vector3::Min(node.aabbMin, curVertex);
-				node.aabbMax = Vector3::Max(node.aabbMax, curVertex);
+				UpdateBVH();
+				return true;
 			}
+			UpdateBVHLeafData();
+			return false;
 		}
-		inline void Subdivide(int nodeIndx)
+		inline void ShrinkBVHNodes()
 		{
-			BVHNode& node = pBvhNodes[nodeIndx];
-			if (node.indicesCount < 1)
+			const uint32_t nodeCount = bvhNodesUsed + 1;
+			if (nodeCount == bvhNodeCapacity)
 			{
 				return;
 			}
-			int axis;
-			float splitPos;
-			float cost = FindBestSplitPlane(node, axis, splitPos);
-			float noSplitCost = CalculateNodeCost(node);
-			if (cost >= noSplitCost)
+			BVHNodePool pNodes = AllocateBVHNodes(nodeCount);
+			std::copy(pBvhNodes.get(), pBvhNodes.get() + nodeCount, pNodes.get());
+			pBvhNodes = std::move(pNodes);
+			bvhNodeCapacity = nodeCount;
+		}
+		//Moves the child pairs from build order into treelets: starting at a treelet root, pairs are placed breadth-first
+		//until the treelet holds bvhTreeletPairs of them, every pair left over becomes the root of a later treelet.
+		//The first levels below any node are then a few consecutive cache lines instead of spread over the whole pool.
+		inline void ReorderBVHNodes()
+		{
+			struct PendingPair
 			{
-				return;
+				uint32_t oldPair;
+				uint32_t newParent;
+			};
+
+			const uint32_t nodeCount = bvhNodesUsed + 1;
+			BVHNodePool pNodes = AllocateBVHNodes(nodeCount);
+			pNodes[startBvhNodeIndx] = pBvhNodes[startBvhNodeIndx];
+			uint32_t nextPair = startBvhNodeIndx + 1;
+
+			std::vector<PendingPair> treeletRoots{};
+			std::vector<PendingPair> treelet{};
+			if (!pBvhNodes[startBvhNodeIndx].IsLeaf())
+			{
+				treeletRoots.push_back({ pBvhNodes[startBvhNodeIndx].leftChild, startBvhNodeIndx });
 			}
-			uint32_t i = node.firstIndice;
-			uint32_t j = i+node.indicesCount-1;
-			while (i <= j)
+			while (!treeletRoots.empty())
 			{
-				Vector3 centroid = (transformedPositions[indices[i]] + transformedPositions[indices[i + 1]] + transformedPositions[indices[i + 2]]) / 3.0f;
-				if (centroid[axis] < splitPos)
+				treelet.clear();
+				treelet.push_back(treeletRoots.back());
+				treeletRoots.pop_back();
+
+				size_t head{};
+				while (head < treelet.size() && head < bvhTreeletPairs)
 				{
-					i += 3;
+					const PendingPair pair = treelet[head++];
+					const uint32_t newPair = nextPair;
+					nextPair += 2;
+					pNodes[pair.newParent].leftChild = newPair;
+					for (uint32_t side = 0; side < 2; ++side)
+					{
+						const BVHNode& node = pBvhNodes[pair.oldPair + side];
+						pNodes[newPair + side] = node;
+						if (!node.IsLeaf())
+						{
+							treelet.push_back({ node.leftChild, newPair + side });
+						}
+					}
 				}
-				else
+				//Pushed in reverse, so the leftovers of this treelet are laid out next, nearest first
+				for (size_t i = treelet.size(); i > head; --i)
 				{
-					std::swap(indices[i], indices[j - 2]);
-					std::swap(indices[i + 1], indices[j - 1]);
-					std::swap(indices[i + 2], indices[j]);
-					std::swap(normals[i / 3], normals[(j - 2) / 3]);
-					std::swap(transformedNormals[i / 3], transformedNormals[(j - 2) / 3]);
-					j -= 3;
+					treeletRoots.push_back(treelet[i - 1]);
 				}
 			}
-			uint32_t leftCount = i - node.firstIndice;
-			if (leftCount == 0 || leftCount == node.indicesCount)
-			{
-				return;
-			}
-			uint32_t leftChildIndx = ++bvhNodesUsed;
-			uint32_t rightChildIndx = ++bvhNodesUsed;
-			node.leftChild = leftChildIndx;
-			pBvhNodes[leftChildIndx].firstIndice = node.firstIndice;
-			pBvhNodes[leftChildIndx].indicesCount = leftCount;
-			pBvhNodes[rightChildIndx].firstIndice = i;
-			pBvhNodes[rightChildIndx].indicesCount = node.indicesCount - leftCount;
-			node.indicesCount = 0;
-
-			UpdateBVHNodeBounds(leftChildIndx);
-			UpdateBVHNodeBounds(rightChildIndx);
+			assert(nextPair == nodeCount);
 
-			Subdivide(leftChildIndx);
-			Subdivide(rightChildIndx);
+			pBvhNodes = std::move(pNodes);
+			bvhNodeCapacity = nodeCount;
 		}
-		inline float FindBestSplitPlane(BVHNode& node, int& axis, float& splitPos) const
+		uint32_t GetBVHNodeCount() const
 		{
-			float bestCost = FLT_MAX;
-			for (int a = 0; a < 3; a++)
-			{
-				float boundsMin = FLT_MAX ;
-				float boundsMax = FLT_MIN ;
-				Vector3 v0, v1, v2, centroid;
+			return bvhNodesUsed + 1 - startBvhNodeIndx;
+		}
+		//Everything derived from the binary tree: mesh bounds, leaf triangles, packets and the wide layout
+		inline void UpdateBVHLeafData()
+		{
+			const BVHNode& startNode = pBvhNodes[startBvhNodeIndx];
+			minAABB = startNode.aabbMin;
+			maxAABB = startNode.aabbMax;
 
-				for (uint32_t i = 0; i < node.indicesCount; i+=3)
-				{
-					v0 = transformedPositions[indices[node.firstIndice + i]];
-					v1 = transformedPositions[indices[node.firstIndice + i + 1]];
-					v2 = transformedPositions[indices[node.firstIndice + i + 2]];
+			UpdateBVHTriangles();
 
-					centroid = (v0 + v1 + v2) / 3.f;
-					boundsMin = std::min(centroid[a], boundsMin);
-					boundsMax = std::max(centroid[a], boundsMax);
+			const bool isAffine = triangleKernel == TriangleKernel::Affine;
+			bvhTriangleAffines.clear();
+			bvhPackets4.clear();
+			bvhPackets8.clear();
+			bvhAffinePackets4.clear();
+			bvhAffinePackets8.clear();
+			bvhLeafFirstPacket.clear();
+			switch (leafLayout)
+			{
+			case LeafLayout::Packet4:
+				if (isAffine)
+				{
+					UpdateBVHPackets(bvhAffinePackets4);
 				}
-
-				if (abs(boundsMin - boundsMax) < FLT_EPSILON)
+				else
 				{
-					continue;
+					UpdateBVHPackets(bvhPackets4);
 				}
-
-				const int nrBins = 8 ;
-				Bin bins[nrBins];
-				float scale = nrBins / (boundsMax - boundsMin);
-
-				for (uint32_t i = 0; i < node.indicesCount; i += 3)
+				break;
+			case LeafLayout::Packet8:
+				if (isAffine)
 				{
-					v0 = transformedPositions[indices[node.firstIndice + i]] ;
-					v1 = transformedPositions[indices[node.firstIndice + i + 1]];
-					v2 = transformedPositions[indices[node.firstIndice + i + 2]];
-					centroid = (v0 + v1 + v2) / 3.0f;
-
-					int binIdx{ std::min(nrBins - 1, static_cast<int>((centroid[a] - boundsMin) * scale)) };
-					bins[binIdx].indicesCount += 3;
-					bins[binIdx].bounds.Grow(v0);
-					bins[binIdx].bounds.Grow(v1);
-					bins[binIdx].bounds.Grow(v2);
+					UpdateBVHPackets(bvhAffinePackets8);
 				}
+				else
+				{
+					UpdateBVHPackets(bvhPackets8);
+				}
+				break;
+			default:
+				if (isAffine)
+				{
+					bvhTriangleAffines.resize(bvhTriangles.size());
+					std::transform(bvhTriangles.begin(), bvhTriangles.end(), bvhTriangleAffines.begin(), GetTriangleAffine);
+				}
+				break;
+			}
 
-				float leftArea[nrBins - 1]{};
-				float rightArea[nrBins - 1]{};
-				float leftCount[nrBins - 1]{};
-				float rightCount[nrBins - 1]{};
-
-				AABB leftBox;
-				AABB rightBox;
-				float leftSum{};
-				float rightSum{};
-				for (uint32_t i = 0; i < nrBins - 1; ++i)
+			bvh4Nodes.clear();
+			bvh8Nodes.clear();
+			bvhQuantizedNodes.clear();
+			switch (bvhLayout)
+			{
+			case BVHLayout::Wide4:
+				BuildWideBVH(bvh4Nodes);
+				break;
+			case BVHLayout::Wide8:
+				BuildWideBVH(bvh8Nodes);
+				break;
+			case BVHLayout::Quantized4:
+				BuildQuantizedBVH();
+				break;
+			default:
+				break;
+			}
+		}
+		inline void RefitBVHNode(uint32_t nodeIndx)
+		{
+			BVHNode& node = pBvhNodes[nodeIndx];
+			if (node.IsLeaf())
+			{
+				//Spatial split leaves are refit to their whole triangles, the clipping is only redone by a rebuild
+				AABB bounds{};
+				const uint32_t triangleEnd = (node.firstIndice + node.indicesCount) / 3;
+				for (uint32_t i = node.firstIndice / 3; i < triangleEnd; ++i)
 				{
-					leftSum += bins[i].indicesCount;
-					leftCount[i] = leftSum;
-					leftBox.Grow(bins[i].bounds);
-					leftArea[i] = leftBox.GetArea();
+					const uint32_t triangle = GetLeafTriangle(i);
+					bounds.Grow(positions[indices[3 * triangle]]);
+					bounds.Grow(positions[indices[3 * triangle + 1]]);
+					bounds.Grow(positions[indices[3 * triangle + 2]]);
+				}
+				node.aabbMin = bounds.min;
+				node.aabbMax = bounds.max;
+				return;
+			}
 
-					rightSum += bins[nrBins - 1 - i].indicesCount;
-					rightCount[nrBins - 2 - i] = rightSum;
-					rightBox.Grow(bins[nrBins - 1 - i].bounds);
-					rightArea[nrBins - 2 - i] = rightBox.GetArea();
+			RefitBVHNode(node.leftChild);
+			RefitBVHNode(node.leftChild + 1);
+			RotateBVHNode(nodeIndx);
+			UpdateInnerNodeBounds(nodeIndx);
+		}
+		inline void UpdateInnerNodeBounds(uint32_t nodeIndx)
+		{
+			BVHNode& node = pBvhNodes[nodeIndx];
+			const BVHNode& leftChild = pBvhNodes[node.leftChild];
+			const BVHNode& rightChild = pBvhNodes[node.leftChild + 1];
+			node.aabbMin = Vector3::Min(leftChild.aabbMin, rightChild.aabbMin);
+			node.aabbMax = Vector3::Max(leftChild.aabbMax, rightChild.aabbMax);
+		}
+		//Tree rotation (Kensler 2008): swaps a child with one of its grandchildren on the other side
+		//when that shrinks the surface area of the child that receives it. The node's own bounds stay the same.
+		inline void RotateBVHNode(uint32_t nodeIndx)
+		{
+			const BVHNode& node = pBvhNodes[nodeIndx];
+			float bestGain{};
+			uint32_t bestChild{};
+			uint32_t bestGrandChild{};
+			uint32_t bestParent{};
+			for (uint32_t side = 0; side < 2; ++side)
+			{
+				const uint32_t child = node.leftChild + side;
+				const uint32_t sibling = node.leftChild + 1 - side;
+				const BVHNode& siblingNode = pBvhNodes[sibling];
+				if (siblingNode.IsLeaf())
+				{
+					continue;
 				}
-				scale = (boundsMax - boundsMin) / nrBins;
-				for (uint32_t i = 0; i < nrBins - 1; ++i)
+
+				const AABB childBounds{ pBvhNodes[child].aabbMin, pBvhNodes[child].aabbMax };
+				const float siblingArea = AABB{ siblingNode.aabbMin, siblingNode.aabbMax }.GetArea();
+				for (uint32_t grandSide = 0; grandSide < 2; ++grandSide)
 				{
-					const float planeCost{ leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i] };
+					//The child takes the place of this grandchild, next to the other grandchild
+					const BVHNode& otherGrandChild = pBvhNodes[siblingNode.leftChild + 1 - grandSide];
+					AABB rotatedBounds{ otherGrandChild.aabbMin, otherGrandChild.aabbMax };
+					rotatedBounds.Grow(childBounds);
 
-					if (planeCost < bestCost)
+					const float gain = siblingArea - rotatedBounds.GetArea();
+					if (gain > bestGain)
 					{
-						splitPos = boundsMin + scale * (i + 1);
-						axis = a;
-						bestCost = planeCost;
+						bestGain = gain;
+						bestChild = child;
+						bestGrandChild = siblingNode.leftChild + grandSide;
+						bestParent = sibling;
 					}
 				}
 			}
-			return bestCost;
+
+			if (bestGain > 0.f)
+			{
+				std::swap(pBvhNodes[bestChild], pBvhNodes[bestGrandChild]);
+				UpdateInnerNodeBounds(bestParent);
+			}
 		}
-		inline float CalculateNodeCost(const BVHNode& node) const
+		//SAH cost of the whole tree relative to its root: one unit per inner node visit, one per triangle test
+		inline float CalculateSAHCost() const
 		{
-			Vector3 boxSize = node.aabbMax - node.aabbMin;
+			const BVHNode& startNode = pBvhNodes[startBvhNodeIndx];
+			const float rootArea = AABB{ startNode.aabbMin, startNode.aabbMax }.GetArea();
+			if (rootArea <= 0.f)
+			{
+				return 0.f;
+			}
+
+			float cost{};
+			for (uint32_t nodeIndx = startBvhNodeIndx; nodeIndx <= bvhNodesUsed; ++nodeIndx)
+			{
+				const BVHNode& node = pBvhNodes[nodeIndx];
+				const float area = AABB{ node.aabbMin, node.aabbMax }.GetArea();
+				cost += node.IsLeaf() ? area * (node.indicesCount / 3) : area;
+			}
+			return cost / rootArea;
+		}
+		template<int Width>
+		inline void BuildWideBVH(std::vector<WideBVHNode<Width>>& wideNodes) const
+		{
+			wideNodes.clear();
+			wideNodes.reserve(bvhNodesUsed + 1);
+			wideNodes.emplace_back();
+			CollapseBVHNode(wideNodes, 0, startBvhNodeIndx);
+			wideNodes.shrink_to_fit();
+		}
+		template<int Width>
+		inline void CollapseBVHNode(std::vector<WideBVHNode<Width>>& wideNodes, uint32_t wideNodeIndx, uint32_t nodeIndx) const
+		{
+			//Pull grandchildren up into this node, always opening the inner child with the largest surface area
+			uint32_t children[Width]{};
+			int childCount{};
+			const BVHNode& node = pBvhNodes[nodeIndx];
+			if (node.IsLeaf())
+			{
+				children[childCount++] = nodeIndx;
+			}
+			else
+			{
+				children[childCount++] = node.leftChild;
+				children[childCount++] = node.leftChild + 1;
+			}
+
+			while (childCount < Width)
+			{
+				int bestChild{ -1 };
+				float bestArea{ -1.f };
+				for (int c = 0; c < childCount; ++c)
+				{
+					const BVHNode& child = pBvhNodes[children[c]];
+					if (child.IsLeaf())
+					{
+						continue;
+					}
+					const Vector3 boxSize = child.aabbMax - child.aabbMin;
+					const float area = boxSize.x * boxSize.y + boxSize.y * boxSize.z + boxSize.z * boxSize.x;
+					if (area > bestArea)
+					{
+						bestChild = c;
+						bestArea = area;
+					}
+				}
+				if (bestChild < 0)
+				{
+					break;
+				}
+				const uint32_t openedLeftChild = pBvhNodes[children[bestChild]].leftChild;
+				children[bestChild] = openedLeftChild;
+				children[childCount++] = openedLeftChild + 1;
+			}
+
+			//wideNodes grows while collapsing, so it is indexed again instead of holding a reference
+			uint32_t innerChildren[Width]{};
+			int innerChildCount{};
+			wideNodes[wideNodeIndx].childCount = static_cast<uint8_t>(childCount);
+			for (int c = 0; c < childCount; ++c)
+			{
+				const BVHNode& child = pBvhNodes[children[c]];
+				WideBVHNode<Width>& wideNode = wideNodes[wideNodeIndx];
+				wideNode.minX[c] = child.aabbMin.x;
+				wideNode.minY[c] = child.aabbMin.y;
+				wideNode.minZ[c] = child.aabbMin.z;
+				wideNode.maxX[c] = child.aabbMax.x;
+				wideNode.maxY[c] = child.aabbMax.y;
+				wideNode.maxZ[c] = child.aabbMax.z;
+				if (child.IsLeaf())
+				{
+					assert(child.indicesCount / 3 <= maxLeafTriangleCount);
+					wideNode.child[c] = leafLayout == LeafLayout::Scalar ? child.firstIndice / 3 : bvhLeafFirstPacket[children[c]];
+					wideNode.triangleCount[c] = static_cast<uint16_t>(child.indicesCount / 3);
+				}
+				else
+				{
+					wideNode.child[c] = static_cast<uint32_t>(wideNodes.size());
+					wideNode.triangleCount[c] = 0;
+					wideNodes.emplace_back();
+					innerChildren[innerChildCount++] = c;
+				}
+			}
+			for (int i = 0; i < innerChildCount; ++i)
+			{
+				const int c = innerChildren[i];
+				CollapseBVHNode(wideNodes, wideNodes[wideNodeIndx].child[c], children[c]);
+			}
+		}
+		//Collapses into a 4-wide tree first and then quantizes every node, the node order stays the same
+		inline void BuildQuantizedBVH()
+		{
+			std::vector<WideBVHNode<4>> wideNodes{};
+			BuildWideBVH(wideNodes);
+
+			bvhQuantizedNodes.resize(wideNodes.size());
+			for (size_t i = 0; i < wideNodes.size(); ++i)
+			{
+				const WideBVHNode<4>& wideNode = wideNodes[i];
+				QuantizedBVHNode4& node = bvhQuantizedNodes[i];
+				node.childCount = wideNode.childCount;
+				for (int c = 0; c < 4; ++c)
+				{
+					node.child[c] = wideNode.child[c];
+					node.triangleCount[c] = wideNode.triangleCount[c];
+				}
+				QuantizeAxis(wideNode.childCount, wideNode.minX, wideNode.maxX, node.originX, node.exponentX, node.minX, node.maxX);
+				QuantizeAxis(wideNode.childCount, wideNode.minY, wideNode.maxY, node.originY, node.exponentY, node.minY, node.maxY);
+				QuantizeAxis(wideNode.childCount, wideNode.minZ, wideNode.maxZ, node.originZ, node.exponentZ, node.minZ, node.maxZ);
+			}
+		}
+		//Every rounding check uses origin + q * scale, the exact expression traversal decodes with, so the decoded box never shrinks
+		static void QuantizeAxis(int childCount, const float* pMin, const float* pMax, float& origin, int8_t& exponent, uint8_t* pQuantizedMin, uint8_t* pQuantizedMax)
+		{
+			float axisMin{ FLT_MAX };
+			float axisMax{ -FLT_MAX };
+			for (int c = 0; c < childCount; ++c)
+			{
+				axisMin = std::min(axisMin, pMin[c]);
+				axisMax = std::max(axisMax, pMax[c]);
+			}
+
+			origin = axisMin;
+			const float extent = axisMax - axisMin;
+			int axisExponent = extent > 0.f ? static_cast<int>(std::ceil(std::log2(extent / 255.f))) : -126;
+			axisExponent = std::clamp(axisExponent, -126, 127);
+			while (axisExponent < 127 && origin + 255.f * GetQuantizationScale(axisExponent) < axisMax)
+			{
+				++axisExponent;
+			}
+			exponent = static_cast<int8_t>(axisExponent);
+			const float scale = GetQuantizationScale(axisExponent);
+
+			for (int c = 0; c < 4; ++c)
+			{
+				if (c >= childCount)
+				{
+					pQuantizedMin[c] = 0;
+					pQuantizedMax[c] = 0;
+					continue;
+				}
+				int quantizedMin = std::clamp(static_cast<int>(std::floor((pMin[c] - origin) / scale)), 0, 255);
+				while (quantizedMin > 0 && origin + quantizedMin * scale > pMin[c])
+				{
+					--quantizedMin;
+				}
+				int quantizedMax = std::clamp(static_cast<int>(std::ceil((pMax[c] - origin) / scale)), 0, 255);
+				while (quantizedMax < 255 && origin + quantizedMax * scale < pMax[c])
+				{
+					++quantizedMax;
+				}
+				pQuantizedMin[c] = static_cast<uint8_t>(quantizedMin);
+				pQuantizedMax[c] = static_cast<uint8_t>(quantizedMax);
+			}
+		}
+		uint32_t GetLeafTriangle(uint32_t slot) const
+		{
+			return bvhTriangleRefs.empty() ? slot : bvhTriangleRefs[slot];
+		}
+		inline void UpdateBVHTriangles()
+		{
+			bvhTriangles.resize(bvhTriangleRefs.empty() ? indices.size() / 3 : bvhTriangleRefs.size());
+			for (uint32_t i = 0; i < bvhTriangles.size(); ++i)
+			{
+				const uint32_t t = GetLeafTriangle(i);
+				BVHTriangle& triangle = bvhTriangles[i];
+				triangle.v0 = positions[indices[3 * t]];
+				triangle.edge1 = positions[indices[3 * t + 1]] - triangle.v0;
+				triangle.edge2 = positions[indices[3 * t + 2]] - triangle.v0;
+				triangle.normal = normals[t];
+			}
+		}
+		template<typename Packet>
+		inline void UpdateBVHPackets(std::vector<Packet>& packets)
+		{
+			constexpr int Width{ Packet::width };
+			packets.clear();
+			bvhLeafFirstPacket.assign(bvhNodesUsed + 1, 0);
+			for (uint32_t nodeIndx = startBvhNodeIndx; nodeIndx <= bvhNodesUsed; ++nodeIndx)
+			{
+				const BVHNode& node = pBvhNodes[nodeIndx];
+				if (!node.IsLeaf())
+				{
+					continue;
+				}
+				const uint32_t firstPacket = static_cast<uint32_t>(packets.size());
+				bvhLeafFirstPacket[nodeIndx] = firstPacket;
+
+				const uint32_t firstTriangle = node.firstIndice / 3;
+				const uint32_t triangleCount = node.indicesCount / 3;
+				packets.resize(packets.size() + (triangleCount + Width - 1) / Width);
+				for (uint32_t i = 0; i < triangleCount; ++i)
+				{
+					packets[firstPacket + i / Width].SetLane(i % Width, bvhTriangles[firstTriangle + i]);
+				}
+			}
+			packets.shrink_to_fit();
+		}
+		uint32_t GetLeafPacketWidth() const
+		{
+			switch (leafLayout)
+			{
+			case LeafLayout::Packet4:
+				return 4;
+			case LeafLayout::Packet8:
+				return 8;
+			default:
+				return 1;
+			}
+		}
+		//Cost of intersecting a leaf, in the same unit as indicesCount: a partly filled packet costs as much as a full one
+		float GetLeafCost(float indicesCount) const
+		{
+			const float packetIndices = 3.f * GetLeafPacketWidth();
+			return std::ceil(indicesCount / packetIndices) * packetIndices;
+		}
+		size_t GetGeometryMemory() const
+		{
+			return positions.size() * sizeof(Vector3) + normals.size() * sizeof(Vector3) + indices.size() * sizeof(int);
+		}
+		size_t GetBVHNodeMemory() const
+		{
+			return bvhNodeCapacity * sizeof(BVHNode) + bvhLeafFirstPacket.size() * sizeof(uint32_t)
+				+ bvh4Nodes.size() * sizeof(WideBVHNode<4>) + bvh8Nodes.size() * sizeof(WideBVHNode<8>) + bvhQuantizedNodes.size() * sizeof(QuantizedBVHNode4);
+		}
+		size_t GetBVHTriangleMemory() const
+		{
+			return bvhTriangles.size() * sizeof(BVHTriangle) + bvhTriangleRefs.size() * sizeof(uint32_t) + bvhPackets4.size() * sizeof(BVHTrianglePacket<4>) + bvhPackets8.size() * sizeof(BVHTrianglePacket<8>)
+				+ bvhTriangleAffines.size() * sizeof(BVHTriangleAffine) + bvhAffinePackets4.size() * sizeof(BVHTriangleAffinePacket<4>) + bvhAffinePackets8.size() * sizeof(BVHTriangleAffinePacket<8>);
+		}
+		inline void UpdateBVHNodeBounds(int nodeIndx, const BVHBuildReferences& references)
+		{
+			BVHNode& node = pBvhNodes[nodeIndx];
+			AABB nodeBounds{};
+			const uint32_t triangleEnd = (node.firstIndice + node.indicesCount) / 3;
+			for (uint32_t i = node.firstIndice / 3; i < triangleEnd; ++i)
+			{
+				nodeBounds.Grow(references.bounds[references.triangles[i]]);
+			}
+			node.aabbMin = nodeBounds.min;
+			node.aabbMax = nodeBounds.max;
+		}
+		//Moves indices and normals into the leaf order the build left in triangleOrder, once per build
+		inline void ReorderTriangles(const std::vector<uint32_t>& triangleOrder)
+		{
+			std::vector<int> orderedIndices(indices.size());
+			std::vector<Vector3> orderedNormals(normals.size());
+			const uint32_t triangleCount = static_cast<uint32_t>(triangleOrder.size());
+			ForEachChunk(triangleCount, GetBuildThreadCount(0, triangleCount), [&](uint32_t, uint32_t first, uint32_t end)
+				{
+					for (uint32_t i = first; i < end; ++i)
+					{
+						const uint32_t triangle = triangleOrder[i];
+						orderedIndices[3 * i] = indices[3 * triangle];
+						orderedIndices[3 * i + 1] = indices[3 * triangle + 1];
+						orderedIndices[3 * i + 2] = indices[3 * triangle + 2];
+						orderedNormals[i] = normals[triangle];
+					}
+				});
+			indices.swap(orderedIndices);
+			normals.swap(orderedNormals);
+		}
+		static uint32_t GetBuildThreadCount(uint32_t depth, uint32_t triangleCount)
+		{
+			return dae::GetBuildThreadCount(depth, triangleCount, parallelBuildTriangles);
+		}
+		//Runs chunkFunc(chunk, firstTriangle, triangleEnd) for nrChunks equal slices of [0, triangleCount), the first on the calling thread
+		template<typename ChunkFunc>
+		static void ForEachChunk(uint32_t triangleCount, uint32_t nrChunks, const ChunkFunc& chunkFunc)
+		{
+			std::vector<std::future<void>> tasks{};
+			tasks.reserve(nrChunks - 1);
+			for (uint32_t chunk = 1; chunk < nrChunks; ++chunk)
+			{
+				tasks.push_back(std::async(std::launch::async, chunkFunc, chunk, uint32_t(uint64_t(triangleCount) * chunk / nrChunks), uint32_t(uint64_t(triangleCount) * (chunk + 1) / nrChunks)));
+			}
+			chunkFunc(0u, 0u, triangleCount / nrChunks);
+			for (std::future<void>& task : tasks)
+			{
+				task.get();
+			}
+		}
+		inline void Subdivide(int nodeIndx, BVHBuildReferences& references, std::atomic<uint32_t>& nodesUsed, uint32_t depth)
+		{
+			BVHNode& node = pBvhNodes[nodeIndx];
+			if (node.indicesCount < 1)
+			{
+				return;
+			}
+			int axis;
+			float splitPos;
+			float cost = FindBestSplitPlane(node, references, axis, splitPos, GetBuildThreadCount(depth, node.indicesCount / 3));
+			const bool isOversized = node.indicesCount / 3 > maxLeafTriangleCount;
+			if (cost >= GetSplitThreshold(node) && !isOversized)
+			{
+				return;
+			}
+			uint32_t i = node.firstIndice / 3;
+			uint32_t j = i + node.indicesCount / 3;
+			//No plane was found when all centroids coincide, axis and splitPos are unset then
+			while (cost < FLT_MAX && i < j)
+			{
+				if (references.centroids[references.triangles[i]][axis] < splitPos)
+				{
+					++i;
+				}
+				else
+				{
+					std::swap(references.triangles[i], references.triangles[--j]);
+				}
+			}
+			i *= 3;
+			uint32_t leftCount = i - node.firstIndice;
+			if (leftCount == 0 || leftCount == node.indicesCount)
+			{
+				if (!isOversized)
+				{
+					return;
+				}
+				//Halve an oversized node in reference order instead
+				leftCount = node.indicesCount / 6 * 3;
+				i = node.firstIndice + leftCount;
+			}
+			uint32_t leftChildIndx = nodesUsed.fetch_add(2) + 1;
+			uint32_t rightChildIndx = leftChildIndx + 1;
+			pBvhNodes[leftChildIndx].firstIndice = node.firstIndice;
+			pBvhNodes[leftChildIndx].indicesCount = leftCount;
+			pBvhNodes[rightChildIndx].firstIndice = i;
+			pBvhNodes[rightChildIndx].indicesCount = node.indicesCount - leftCount;
+			//leftChild overwrites firstIndice, so it is only set once the children took over the range
+			node.leftChild = leftChildIndx;
+			node.indicesCount = 0;
+
+			UpdateBVHNodeBounds(leftChildIndx, references);
+			UpdateBVHNodeBounds(rightChildIndx, references);
+
+			//Both halves own a disjoint range of references.triangles, so large ones are built on their own thread
+			if (GetBuildThreadCount(depth, leftCount / 3) > 1)
+			{
+				std::future<void> leftTask = std::async(std::launch::async, [&]() { Subdivide(leftChildIndx, references, nodesUsed, depth + 1); });
+				Subdivide(rightChildIndx, references, nodesUsed, depth + 1);
+				leftTask.get();
+				return;
+			}
+			Subdivide(leftChildIndx, references, nodesUsed, depth + 1);
+			Subdivide(rightChildIndx, references, nodesUsed, depth + 1);
+		}
+		inline float FindBestSplitPlane(const BVHNode& node, const BVHBuildReferences& references, int& axis, float& splitPos, uint32_t nrChunks) const
+		{
+			const int nrBins = GetBuildBinCount();
+			const uint32_t triangleCount = node.indicesCount / 3;
+			const uint32_t* pTriangles = &references.triangles[node.firstIndice / 3];
+
+			//Every chunk accumulates into its own bounds and bins, only parallel nodes need them on the heap
+			AABB localBounds{};
+			Bin localBins[3 * maxBuildBins]{};
+			std::vector<AABB> chunkBounds{};
+			std::vector<Bin> chunkBins{};
+			AABB* pChunkBounds = &localBounds;
+			Bin* pChunkBins = localBins;
+			if (nrChunks > 1)
+			{
+				chunkBounds.resize(nrChunks);
+				chunkBins.resize(nrChunks * 3 * nrBins);
+				pChunkBounds = chunkBounds.data();
+				pChunkBins = chunkBins.data();
+			}
+
+			//First pass: centroid bounds on all three axes at once
+			ForEachChunk(triangleCount, nrChunks, [&](uint32_t chunk, uint32_t first, uint32_t end)
+				{
+					for (uint32_t i = first; i < end; ++i)
+					{
+						pChunkBounds[chunk].Grow(references.centroids[pTriangles[i]]);
+					}
+				});
+			AABB centroidBounds{};
+			for (uint32_t chunk = 0; chunk < nrChunks; ++chunk)
+			{
+				centroidBounds.Grow(pChunkBounds[chunk]);
+			}
+
+			float scale[3]{};
+			for (int a = 0; a < 3; ++a)
+			{
+				const float extent = centroidBounds.max[a] - centroidBounds.min[a];
+				scale[a] = abs(extent) < FLT_EPSILON ? 0.f : nrBins / extent;
+			}
+
+			//Second pass: every triangle is binned on all three axes
+			ForEachChunk(triangleCount, nrChunks, [&](uint32_t chunk, uint32_t first, uint32_t end)
+				{
+					Bin* pBins = &pChunkBins[chunk * 3 * nrBins];
+					for (uint32_t i = first; i < end; ++i)
+					{
+						const uint32_t triangle = pTriangles[i];
+						const Vector3& centroid = references.centroids[triangle];
+
+						for (int a = 0; a < 3; ++a)
+						{
+							if (scale[a] == 0.f)
+							{
+								continue;
+							}
+							Bin& bin = pBins[a * nrBins + std::min(nrBins - 1, static_cast<int>((centroid[a] - centroidBounds.min[a]) * scale[a]))];
+							bin.indicesCount += 3;
+							bin.bounds.Grow(references.bounds[triangle]);
+						}
+					}
+				});
+
+			float bestCost = FLT_MAX;
+			for (int a = 0; a < 3; a++)
+			{
+				if (scale[a] == 0.f)
+				{
+					continue;
+				}
+
+				Bin bins[maxBuildBins];
+				for (uint32_t chunk = 0; chunk < nrChunks; ++chunk)
+				{
+					for (int b = 0; b < nrBins; ++b)
+					{
+						const Bin& chunkBin = pChunkBins[(chunk * 3 + a) * nrBins + b];
+						bins[b].indicesCount += chunkBin.indicesCount;
+						bins[b].bounds.Grow(chunkBin.bounds);
+					}
+				}
+
+				float leftArea[maxBuildBins - 1]{};
+				float rightArea[maxBuildBins - 1]{};
+				float leftCount[maxBuildBins - 1]{};
+				float rightCount[maxBuildBins - 1]{};
+
+				AABB leftBox;
+				AABB rightBox;
+				float leftSum{};
+				float rightSum{};
+				for (int i = 0; i < nrBins - 1; ++i)
+				{
+					leftSum += bins[i].indicesCount;
+					leftCount[i] = leftSum;
+					leftBox.Grow(bins[i].bounds);
+					leftArea[i] = leftBox.GetArea();
+
+					rightSum += bins[nrBins - 1 - i].indicesCount;
+					rightCount[nrBins - 2 - i] = rightSum;
+					rightBox.Grow(bins[nrBins - 1 - i].bounds);
+					rightArea[nrBins - 2 - i] = rightBox.GetArea();
+				}
+				const float binWidth = (centroidBounds.max[a] - centroidBounds.min[a]) / nrBins;
+				for (int i = 0; i < nrBins - 1; ++i)
+				{
+					const float planeCost{ GetLeafCost(leftCount[i]) * leftArea[i] + GetLeafCost(rightCount[i]) * rightArea[i] };
+
+					if (planeCost < bestCost)
+					{
+						splitPos = centroidBounds.min[a] + binWidth * (i + 1);
+						axis = a;
+						bestCost = planeCost;
+					}
+				}
+			}
+			return bestCost;
+		}
+		inline float CalculateNodeCost(const BVHNode& node) const
+		{
+			Vector3 boxSize = node.aabbMax - node.aabbMin;
 			float parentArea = boxSize.x * boxSize.y + boxSize.y * boxSize.z + boxSize.z * boxSize.x;
-			return node.indicesCount * parentArea;
+			return GetLeafCost(static_cast<float>(node.indicesCount)) * parentArea;
+		}
+		//A split is only worth it when the child cost from the binning stays below this: the leaf cost minus the traversal of the node itself.
+		//Nodes above maxLeafTriangles, clamped to maxLeafTriangleCount, are always split.
+		inline float GetSplitThreshold(const BVHNode& node) const
+		{
+			if (node.indicesCount / 3 > std::min(bvhBuildSettings.maxLeafTriangles, maxLeafTriangleCount))
+			{
+				return FLT_MAX;
+			}
+			const float parentArea = AABB{ node.aabbMin, node.aabbMax }.GetArea();
+			return CalculateNodeCost(node) - 3.f * bvhBuildSettings.traversalCost * parentArea;
+		}
+		int GetBuildBinCount() const
+		{
+			return std::clamp(static_cast<int>(bvhBuildSettings.nrBins), 2, maxBuildBins);
+		}
+		//Spatial split build: every node owns its references, a split moves them into two new lists.
+		//The best object split is tried first, a spatial split only when the object split children overlap.
+		inline void SubdivideSpatial(uint32_t nodeIndx, std::vector<SBVHReference>& references, SBVHBuildState& state, std::atomic<uint32_t>& nodesUsed, uint32_t depth)
+		{
+			BVHNode& node = pBvhNodes[nodeIndx];
+			AABB nodeBounds{};
+			for (const SBVHReference& reference : references)
+			{
+				nodeBounds.Grow(reference.bounds);
+			}
+			node.aabbMin = nodeBounds.min;
+			node.aabbMax = nodeBounds.max;
+			if (nodeIndx == startBvhNodeIndx)
+			{
+				state.rootArea = nodeBounds.GetArea();
+			}
+
+			const uint32_t referenceCount = static_cast<uint32_t>(references.size());
+			node.indicesCount = 3 * referenceCount;
+			const float splitThreshold = GetSplitThreshold(node);
+
+			std::vector<SBVHReference> leftReferences{};
+			std::vector<SBVHReference> rightReferences{};
+			const SBVHSplit objectSplit = FindObjectSplit(references);
+			AABB overlap{ Vector3::Max(objectSplit.leftBounds.min, objectSplit.rightBounds.min), Vector3::Min(objectSplit.leftBounds.max, objectSplit.rightBounds.max) };
+			const bool isOverlapping = objectSplit.cost == FLT_MAX ||
+				(overlap.min.x < overlap.max.x && overlap.min.y < overlap.max.y && overlap.min.z < overlap.max.z && overlap.GetArea() > spatialSplitOverlap * state.rootArea);
+			if (isOverlapping && referenceCount > GetLeafPacketWidth() && state.duplicatesLeft > 0)
+			{
+				const SBVHSplit spatialSplit = FindSpatialSplit(references, nodeBounds);
+				if (spatialSplit.cost < objectSplit.cost && spatialSplit.cost < splitThreshold)
+				{
+					SplitReferences(references, spatialSplit, state, leftReferences, rightReferences);
+				}
+			}
+			if ((leftReferences.empty() || rightReferences.empty()) && objectSplit.cost < splitThreshold)
+			{
+				leftReferences.clear();
+				rightReferences.clear();
+				for (const SBVHReference& reference : references)
+				{
+					const float center = (reference.bounds.min[objectSplit.axis] + reference.bounds.max[objectSplit.axis]) * 0.5f;
+					(center < objectSplit.position ? leftReferences : rightReferences).push_back(reference);
+				}
+			}
+			if ((leftReferences.empty() || rightReferences.empty()) && referenceCount > maxLeafTriangleCount)
+			{
+				//Halve an oversized node in reference order instead
+				leftReferences.assign(references.begin(), references.begin() + referenceCount / 2);
+				rightReferences.assign(references.begin() + referenceCount / 2, references.end());
+			}
+
+			if (leftReferences.empty() || rightReferences.empty())
+			{
+				const uint32_t firstSlot = state.leafTrianglesUsed.fetch_add(referenceCount);
+				for (uint32_t i = 0; i < referenceCount; ++i)
+				{
+					state.leafTriangles[firstSlot + i] = references[i].triangle;
+				}
+				node.firstIndice = 3 * firstSlot;
+				node.indicesCount = 3 * referenceCount;
+				return;
+			}
+			references = {};
+
+			const uint32_t leftChildIndx = nodesUsed.fetch_add(2) + 1;
+			const uint32_t rightChildIndx = leftChildIndx + 1;
+			node.leftChild = leftChildIndx;
+			node.indicesCount = 0;
+
+			if (GetBuildThreadCount(depth, static_cast<uint32_t>(leftReferences.size())) > 1)
+			{
+				std::future<void> leftTask = std::async(std::launch::async, [&]() { SubdivideSpatial(leftChildIndx, leftReferences, state, nodesUsed, depth + 1); });
+				SubdivideSpatial(rightChildIndx, rightReferences, state, nodesUsed, depth + 1);
+				leftTask.get();
+				return;
+			}
+			SubdivideSpatial(leftChildIndx, leftReferences, state, nodesUsed, depth + 1);
+			SubdivideSpatial(rightChildIndx, rightReferences, state, nodesUsed, depth + 1);
+		}
+		//Binned object split over the centers of the reference bounds, like FindBestSplitPlane
+		inline SBVHSplit FindObjectSplit(const std::vector<SBVHReference>& references) const
+		{
+			const int nrBins = GetBuildBinCount();
+			AABB centerBounds{};
+			for (const SBVHReference& reference : references)
+			{
+				centerBounds.Grow((reference.bounds.min + reference.bounds.max) * 0.5f);
+			}
+
+			SBVHSplit bestSplit{};
+			for (int a = 0; a < 3; ++a)
+			{
+				const float extent = centerBounds.max[a] - centerBounds.min[a];
+				if (abs(extent) < FLT_EPSILON)
+				{
+					continue;
+				}
+				const float scale = nrBins / extent;
+
+				Bin bins[maxBuildBins]{};
+				for (const SBVHReference& reference : references)
+				{
+					const float center = (reference.bounds.min[a] + reference.bounds.max[a]) * 0.5f;
+					Bin& bin = bins[std::min(nrBins - 1, static_cast<int>((center - centerBounds.min[a]) * scale))];
+					bin.indicesCount += 3;
+					bin.bounds.Grow(reference.bounds);
+				}
+
+				AABB rightBounds[maxBuildBins - 1]{};
+				uint32_t rightCount[maxBuildBins - 1]{};
+				AABB rightBox{};
+				uint32_t rightSum{};
+				for (int i = nrBins - 1; i > 0; --i)
+				{
+					rightSum += bins[i].indicesCount;
+					rightBox.Grow(bins[i].bounds);
+					rightCount[i - 1] = rightSum;
+					rightBounds[i - 1] = rightBox;
+				}
+
+				AABB leftBox{};
+				uint32_t leftSum{};
+				for (int i = 0; i < nrBins - 1; ++i)
+				{
+					leftSum += bins[i].indicesCount;
+					leftBox.Grow(bins[i].bounds);
+					const float planeCost{ GetLeafCost(static_cast<float>(leftSum)) * leftBox.GetArea() + GetLeafCost(static_cast<float>(rightCount[i])) * rightBounds[i].GetArea() };
+					if (leftSum > 0 && rightCount[i] > 0 && planeCost < bestSplit.cost)
+					{
+						bestSplit = { planeCost, a, centerBounds.min[a] + (i + 1) / scale, leftBox, rightBounds[i], leftSum / 3, rightCount[i] / 3 };
+					}
+				}
+			}
+			return bestSplit;
+		}
+		//Binned spatial split: the planes are spread over the node bounds and every reference is clipped into each bin it spans
+		inline SBVHSplit FindSpatialSplit(const std::vector<SBVHReference>& references, const AABB& nodeBounds) const
+		{
+			const int nrBins = GetBuildBinCount();
+			SBVHSplit bestSplit{};
+			for (int a = 0; a < 3; ++a)
+			{
+				const float extent = nodeBounds.max[a] - nodeBounds.min[a];
+				if (abs(extent) < FLT_EPSILON)
+				{
+					continue;
+				}
+				const float binWidth = extent / nrBins;
+				const float scale = nrBins / extent;
+
+				SpatialBin bins[maxBuildBins]{};
+				for (const SBVHReference& reference : references)
+				{
+					const int firstBin = std::clamp(static_cast<int>((reference.bounds.min[a] - nodeBounds.min[a]) * scale), 0, nrBins - 1);
+					const int lastBin = std::clamp(static_cast<int>((reference.bounds.max[a] - nodeBounds.min[a]) * scale), firstBin, nrBins - 1);
+					++bins[firstBin].entries;
+					++bins[lastBin].exits;
+					for (int b = firstBin; b <= lastBin; ++b)
+					{
+						const float binMin = b == firstBin ? -FLT_MAX : nodeBounds.min[a] + binWidth * b;
+						const float binMax = b == lastBin ? FLT_MAX : nodeBounds.min[a] + binWidth * (b + 1);
+						bins[b].bounds.Grow(ClipReferenceBounds(reference, a, binMin, binMax));
+					}
+				}
+
+				AABB rightBounds[maxBuildBins - 1]{};
+				uint32_t rightCount[maxBuildBins - 1]{};
+				AABB rightBox{};
+				uint32_t rightSum{};
+				for (int i = nrBins - 1; i > 0; --i)
+				{
+					rightSum += bins[i].exits;
+					rightBox.Grow(bins[i].bounds);
+					rightCount[i - 1] = rightSum;
+					rightBounds[i - 1] = rightBox;
+				}
+
+				AABB leftBox{};
+				uint32_t leftSum{};
+				for (int i = 0; i < nrBins - 1; ++i)
+				{
+					leftSum += bins[i].entries;
+					leftBox.Grow(bins[i].bounds);
+					const float planeCost{ GetLeafCost(3.f * leftSum) * leftBox.GetArea() + GetLeafCost(3.f * rightCount[i]) * rightBounds[i].GetArea() };
+					if (leftSum > 0 && rightCount[i] > 0 && planeCost < bestSplit.cost)
+					{
+						bestSplit = { planeCost, a, nodeBounds.min[a] + binWidth * (i + 1), leftBox, rightBounds[i], leftSum, rightCount[i] };
+					}
+				}
+			}
+			return bestSplit;
+		}
+		//Distributes the references over both sides of a spatial split plane. A straddling reference is clipped into both,
+		//unless moving it whole to one side is cheaper (reference unsplitting) or the duplication budget ran out.
+		inline void SplitReferences(const std::vector<SBVHReference>& references, const SBVHSplit& split, SBVHBuildState& state,
+			std::vector<SBVHReference>& leftReferences, std::vector<SBVHReference>& rightReferences) const
+		{
+			//Reserve the duplicates the binning predicts up front, the unused part is handed back afterwards
+			const uint32_t predictedDuplicates = split.leftCount + split.rightCount - static_cast<uint32_t>(references.size());
+			uint32_t duplicatesLeft = state.duplicatesLeft.load();
+			uint32_t reserved{};
+			do
+			{
+				reserved = std::min(duplicatesLeft, predictedDuplicates);
+			} while (!state.duplicatesLeft.compare_exchange_weak(duplicatesLeft, duplicatesLeft - reserved));
+
+			AABB leftBounds = split.leftBounds;
+			AABB rightBounds = split.rightBounds;
+			float leftCount = static_cast<float>(split.leftCount);
+			float rightCount = static_cast<float>(split.rightCount);
+			uint32_t duplicates{};
+			leftReferences.reserve(split.leftCount);
+			rightReferences.reserve(split.rightCount);
+			for (const SBVHReference& reference : references)
+			{
+				if (reference.bounds.max[split.axis] <= split.position)
+				{
+					leftReferences.push_back(reference);
+					continue;
+				}
+				if (reference.bounds.min[split.axis] >= split.position)
+				{
+					rightReferences.push_back(reference);
+					continue;
+				}
+
+				const SBVHReference leftPart{ ClipReferenceBounds(reference, split.axis, -FLT_MAX, split.position), reference.triangle };
+				const SBVHReference rightPart{ ClipReferenceBounds(reference, split.axis, split.position, FLT_MAX), reference.triangle };
+				AABB leftUnsplit = leftBounds;
+				leftUnsplit.Grow(reference.bounds);
+				AABB rightUnsplit = rightBounds;
+				rightUnsplit.Grow(reference.bounds);
+				const float splitCost = leftBounds.GetArea() * leftCount + rightBounds.GetArea() * rightCount;
+				const float leftCost = leftUnsplit.GetArea() * leftCount + rightBounds.GetArea() * (rightCount - 1.f);
+				const float rightCost = leftBounds.GetArea() * (leftCount - 1.f) + rightUnsplit.GetArea() * rightCount;
+				const bool canSplit = duplicates < reserved && leftPart.bounds.min.x <= leftPart.bounds.max.x && rightPart.bounds.min.x <= rightPart.bounds.max.x;
+				if (leftCost < rightCost && (leftCost < splitCost || !canSplit))
+				{
+					leftReferences.push_back(reference);
+					leftBounds = leftUnsplit;
+					rightCount -= 1.f;
+				}
+				else if (rightCost < splitCost || !canSplit)
+				{
+					rightReferences.push_back(reference);
+					rightBounds = rightUnsplit;
+					leftCount -= 1.f;
+				}
+				else
+				{
+					leftReferences.push_back(leftPart);
+					rightReferences.push_back(rightPart);
+					++duplicates;
+				}
+			}
+			state.duplicatesLeft += reserved - duplicates;
+		}
+		//Bounds of the part of a reference's triangle between the planes min and max on the axis, within the reference bounds
+		inline AABB ClipReferenceBounds(const SBVHReference& reference, int axis, float min, float max) const
+		{
+			const Vector3 vertices[3]{ positions[indices[3 * reference.triangle]], positions[indices[3 * reference.triangle + 1]], positions[indices[3 * reference.triangle + 2]] };
+			AABB bounds{};
+			for (int v = 0; v < 3; ++v)
+			{
+				const Vector3& start = vertices[v];
+				const Vector3& end = vertices[(v + 1) % 3];
+				if (start[axis] >= min && start[axis] <= max)
+				{
+					bounds.Grow(start);
+				}
+				for (const float plane : { min, max })
+				{
+					if ((start[axis] < plane && end[axis] > plane) || (start[axis] > plane && end[axis] < plane))
+					{
+						Vector3 crossing = start + (end - start) * ((plane - start[axis]) / (end[axis] - start[axis]));
+						crossing[axis] = plane;
+						bounds.Grow(crossing);
+					}
+				}
+			}
+
+			AABB clippedBounds{ Vector3::Max(bounds.min, reference.bounds.min), Vector3::Min(bounds.max, reference.bounds.max) };
+			if (clippedBounds.min.x > clippedBounds.max.x || clippedBounds.min.y > clippedBounds.max.y || clippedBounds.min.z > clippedBounds.max.z)
+			{
+				return AABB{};
+			}
+			return clippedBounds;
+		}
+		//Linear build: Morton codes of the centroids, a parallel radix sort and one top-down pass over the sorted codes
+		inline void BuildLinearBVH(BVHBuildReferences& references, std::atomic<uint32_t>& nodesUsed)
+		{
+			const uint32_t triangleCount = static_cast<uint32_t>(references.triangles.size());
+			const uint32_t nrChunks = GetBuildThreadCount(0, triangleCount);
+
+			std::vector<AABB> chunkBounds(nrChunks);
+			ForEachChunk(triangleCount, nrChunks, [&](uint32_t chunk, uint32_t first, uint32_t end)
+				{
+					for (uint32_t i = first; i < end; ++i)
+					{
+						chunkBounds[chunk].Grow(references.centroids[i]);
+					}
+				});
+			AABB centroidBounds{};
+			for (const AABB& bounds : chunkBounds)
+			{
+				centroidBounds.Grow(bounds);
+			}
+
+			//10 bits per axis, scaled per axis so flat meshes still use all of them
+			Vector3 scale{};
+			for (int a = 0; a < 3; ++a)
+			{
+				const float extent = centroidBounds.max[a] - centroidBounds.min[a];
+				scale[a] = extent > FLT_EPSILON ? 1023.f / extent : 0.f;
+			}
+			std::vector<uint32_t> codes(triangleCount);
+			ForEachChunk(triangleCount, nrChunks, [&](uint32_t, uint32_t first, uint32_t end)
+				{
+					for (uint32_t i = first; i < end; ++i)
+					{
+						const Vector3& centroid = references.centroids[i];
+						codes[i] = (ExpandMortonBits(static_cast<uint32_t>((centroid.x - centroidBounds.min.x) * scale.x)) << 2)
+							| (ExpandMortonBits(static_cast<uint32_t>((centroid.y - centroidBounds.min.y) * scale.y)) << 1)
+							| ExpandMortonBits(static_cast<uint32_t>((centroid.z - centroidBounds.min.z) * scale.z));
+					}
+				});
+			SortMortonCodes(codes, references.triangles, nrChunks);
+
+			SubdivideLinear(startBvhNodeIndx, codes, references, nodesUsed, 0);
+			if (bvhLinearTreelets)
+			{
+				std::vector<float> subtreeCosts(bvhNodeCapacity);
+				OptimizeTreelet(startBvhNodeIndx, subtreeCosts, 0);
+			}
+		}
+		//Spreads the low 10 bits of value to every third bit
+		static uint32_t ExpandMortonBits(uint32_t value)
+		{
+			value = std::min(value, 1023u);
+			value = (value | (value << 16)) & 0x030000FF;
+			value = (value | (value << 8)) & 0x0300F00F;
+			value = (value | (value << 4)) & 0x030C30C3;
+			value = (value | (value << 2)) & 0x09249249;
+			return value;
+		}
+		//LSD radix sort of the 30-bit codes in 8-bit digits, the triangles are moved along.
+		//Every chunk counts its digits, the prefix sums over chunks give each chunk its own output range so the scatter is stable.
+		static void SortMortonCodes(std::vector<uint32_t>& codes, std::vector<uint32_t>& triangles, uint32_t nrChunks)
+		{
+			constexpr uint32_t nrDigits{ 256 };
+			const uint32_t count = static_cast<uint32_t>(codes.size());
+			std::vector<uint32_t> sortedCodes(count);
+			std::vector<uint32_t> sortedTriangles(count);
+			std::vector<uint32_t> offsets(nrChunks * nrDigits);
+			for (uint32_t shift = 0; shift < 32; shift += 8)
+			{
+				std::fill(offsets.begin(), offsets.end(), 0);
+				ForEachChunk(count, nrChunks, [&](uint32_t chunk, uint32_t first, uint32_t end)
+					{
+						uint32_t* pCounts = &offsets[chunk * nrDigits];
+						for (uint32_t i = first; i < end; ++i)
+						{
+							++pCounts[(codes[i] >> shift) & (nrDigits - 1)];
+						}
+					});
+
+				uint32_t offset{};
+				for (uint32_t digit = 0; digit < nrDigits; ++digit)
+				{
+					for (uint32_t chunk = 0; chunk < nrChunks; ++chunk)
+					{
+						const uint32_t digitCount = offsets[chunk * nrDigits + digit];
+						offsets[chunk * nrDigits + digit] = offset;
+						offset += digitCount;
+					}
+				}
+
+				ForEachChunk(count, nrChunks, [&](uint32_t chunk, uint32_t first, uint32_t end)
+					{
+						uint32_t* pOffsets = &offsets[chunk * nrDigits];
+						for (uint32_t i = first; i < end; ++i)
+						{
+							const uint32_t target = pOffsets[(codes[i] >> shift) & (nrDigits - 1)]++;
+							sortedCodes[target] = codes[i];
+							sortedTriangles[target] = triangles[i];
+						}
+					});
+				codes.swap(sortedCodes);
+				triangles.swap(sortedTriangles);
+			}
+		}
+		//Splits the sorted range of a node where its codes first differ, a leaf once it fits the leaf packets
+		inline void SubdivideLinear(uint32_t nodeIndx, const std::vector<uint32_t>& codes, const BVHBuildReferences& references, std::atomic<uint32_t>& nodesUsed, uint32_t depth)
+		{
+			BVHNode& node = pBvhNodes[nodeIndx];
+			const uint32_t first = node.firstIndice / 3;
+			const uint32_t count = node.indicesCount / 3;
+			if (count <= std::max(4u, GetLeafPacketWidth()))
+			{
+				UpdateBVHNodeBounds(nodeIndx, references);
+				return;
+			}
+
+			//Last index that still shares more leading bits with the first code than the last code does,
+			//identical codes are split in the middle
+			uint32_t split = first + count / 2;
+			const uint32_t firstCode = codes[first];
+			const uint32_t lastCode = codes[first + count - 1];
+			if (firstCode != lastCode)
+			{
+				const int commonPrefix = std::countl_zero(firstCode ^ lastCode);
+				split = first;
+				uint32_t step = count - 1;
+				do
+				{
+					step = (step + 1) / 2;
+					const uint32_t candidate = split + step;
+					if (candidate < first + count && std::countl_zero(firstCode ^ codes[candidate]) > commonPrefix)
+					{
+						split = candidate;
+					}
+				} while (step > 1);
+				++split;
+			}
+
+			const uint32_t leftChildIndx = nodesUsed.fetch_add(2) + 1;
+			const uint32_t rightChildIndx = leftChildIndx + 1;
+			pBvhNodes[leftChildIndx].firstIndice = 3 * first;
+			pBvhNodes[leftChildIndx].indicesCount = 3 * (split - first);
+			pBvhNodes[rightChildIndx].firstIndice = 3 * split;
+			pBvhNodes[rightChildIndx].indicesCount = 3 * (first + count - split);
+			node.leftChild = leftChildIndx;
+			node.indicesCount = 0;
+
+			if (GetBuildThreadCount(depth, split - first) > 1)
+			{
+				std::future<void> leftTask = std::async(std::launch::async, [&]() { SubdivideLinear(leftChildIndx, codes, references, nodesUsed, depth + 1); });
+				SubdivideLinear(rightChildIndx, codes, references, nodesUsed, depth + 1);
+				leftTask.get();
+			}
+			else
+			{
+				SubdivideLinear(leftChildIndx, codes, references, nodesUsed, depth + 1);
+				SubdivideLinear(rightChildIndx, codes, references, nodesUsed, depth + 1);
+			}
+			UpdateInnerNodeBounds(nodeIndx);
+		}
+		//Bottom-up treelet restructuring: the treelet below a node grows by opening its largest inner node until it has treeletLeaves nodes,
+		//then a dynamic program over all subsets of those finds the topology with the lowest SAH cost and rewires the treelet in place.
+		//Costs are those of CalculateSAHCost. Returns the cost of the subtree.
+		inline float OptimizeTreelet(uint32_t nodeIndx, std::vector<float>& subtreeCosts, uint32_t depth)
+		{
+			const BVHNode& node = pBvhNodes[nodeIndx];
+			const float area = AABB{ node.aabbMin, node.aabbMax }.GetArea();
+			if (node.IsLeaf())
+			{
+				subtreeCosts[nodeIndx] = area * (node.indicesCount / 3);
+				return subtreeCosts[nodeIndx];
+			}
+
+			const uint32_t leftChildIndx = node.leftChild;
+			//Counting the triangles of a subtree walks it, so only where the depth still allows more threads
+			if (GetBuildThreadCount(depth, UINT32_MAX) > 1 && GetBuildThreadCount(depth, GetSubtreeTriangleCount(leftChildIndx)) > 1)
+			{
+				std::future<float> leftTask = std::async(std::launch::async, [&]() { return OptimizeTreelet(leftChildIndx, subtreeCosts, depth + 1); });
+				OptimizeTreelet(leftChildIndx + 1, subtreeCosts, depth + 1);
+				leftTask.get();
+			}
+			else
+			{
+				OptimizeTreelet(leftChildIndx, subtreeCosts, depth + 1);
+				OptimizeTreelet(leftChildIndx + 1, subtreeCosts, depth + 1);
+			}
+
+			//Form the treelet, its inner nodes give up their child pairs for the new topology
+			uint32_t treeletNodes[treeletLeaves]{ leftChildIndx, leftChildIndx + 1 };
+			uint32_t childPairs[treeletLeaves - 1]{ leftChildIndx };
+			int nrTreeletNodes{ 2 };
+			int nrChildPairs{ 1 };
+			while (nrTreeletNodes < treeletLeaves)
+			{
+				int largest{ -1 };
+				float largestArea{ -1.f };
+				for (int i = 0; i < nrTreeletNodes; ++i)
+				{
+					const BVHNode& treeletNode = pBvhNodes[treeletNodes[i]];
+					const float treeletNodeArea = AABB{ treeletNode.aabbMin, treeletNode.aabbMax }.GetArea();
+					if (!treeletNode.IsLeaf() && treeletNodeArea > largestArea)
+					{
+						largest = i;
+						largestArea = treeletNodeArea;
+					}
+				}
+				if (largest < 0)
+				{
+					break;
+				}
+				const uint32_t openedPair = pBvhNodes[treeletNodes[largest]].leftChild;
+				childPairs[nrChildPairs++] = openedPair;
+				treeletNodes[largest] = openedPair;
+				treeletNodes[nrTreeletNodes++] = openedPair + 1;
+			}
+
+			//Subsets of the treelet nodes as bit masks: their bounds, then the cheapest way to split each of them
+			constexpr uint32_t nrSubsets{ 1u << treeletLeaves };
+			const uint32_t fullSet = (1u << nrTreeletNodes) - 1;
+			AABB subsetBounds[nrSubsets]{};
+			float subsetCosts[nrSubsets]{};
+			uint32_t subsetSplits[nrSubsets]{};
+			BVHNode leaves[treeletLeaves]{};
+			for (int i = 0; i < nrTreeletNodes; ++i)
+			{
+				leaves[i] = pBvhNodes[treeletNodes[i]];
+				subsetBounds[1u << i] = AABB{ leaves[i].aabbMin, leaves[i].aabbMax };
+				subsetCosts[1u << i] = subtreeCosts[treeletNodes[i]];
+			}
+			for (uint32_t subset = 1; subset <= fullSet; ++subset)
+			{
+				if (std::has_single_bit(subset))
+				{
+					continue;
+				}
+				const uint32_t lowestBit = subset & (0u - subset);
+				subsetBounds[subset] = subsetBounds[lowestBit];
+				subsetBounds[subset].Grow(subsetBounds[subset ^ lowestBit]);
+
+				//Every partition once: the part holding the lowest bit is the left one
+				float bestCost{ FLT_MAX };
+				for (uint32_t left = (subset - 1) & subset; left != 0; left = (left - 1) & subset)
+				{
+					if ((left & lowestBit) == 0)
+					{
+						continue;
+					}
+					const float cost = subsetCosts[left] + subsetCosts[subset ^ left];
+					if (cost < bestCost)
+					{
+						bestCost = cost;
+						subsetSplits[subset] = left;
+					}
+				}
+				subsetCosts[subset] = subsetBounds[subset].GetArea() + bestCost;
+			}
+
+			int nextPair{};
+			WriteTreelet(nodeIndx, fullSet, subsetBounds, subsetSplits, leaves, childPairs, nextPair, subtreeCosts, subsetCosts);
+			return subtreeCosts[nodeIndx];
+		}
+		inline void WriteTreelet(uint32_t nodeIndx, uint32_t subset, const AABB* pSubsetBounds, const uint32_t* pSubsetSplits, const BVHNode* pLeaves,
+			const uint32_t* pChildPairs, int& nextPair, std::vector<float>& subtreeCosts, const float* pSubsetCosts)
+		{
+			if (std::has_single_bit(subset))
+			{
+				pBvhNodes[nodeIndx] = pLeaves[std::countr_zero(subset)];
+				subtreeCosts[nodeIndx] = pSubsetCosts[subset];
+				return;
+			}
+
+			const uint32_t childPair = pChildPairs[nextPair++];
+			BVHNode& node = pBvhNodes[nodeIndx];
+			node.aabbMin = pSubsetBounds[subset].min;
+			node.aabbMax = pSubsetBounds[subset].max;
+			node.leftChild = childPair;
+			node.indicesCount = 0;
+			subtreeCosts[nodeIndx] = pSubsetCosts[subset];
+
+			const uint32_t left = pSubsetSplits[subset];
+			WriteTreelet(childPair, left, pSubsetBounds, pSubsetSplits, pLeaves, pChildPairs, nextPair, subtreeCosts, pSubsetCosts);
+			WriteTreelet(childPair + 1, subset ^ left, pSubsetBounds, pSubsetSplits, pLeaves, pChildPairs, nextPair, subtreeCosts, pSubsetCosts);
+		}
+		uint32_t GetSubtreeTriangleCount(uint32_t nodeIndx) const
+		{
+			const BVHNode& node = pBvhNodes[nodeIndx];
+			if (node.IsLeaf())
+			{
+				return node.indicesCount / 3;
+			}
+			return GetSubtreeTriangleCount(node.leftChild) + GetSubtreeTriangleCount(node.leftChild + 1);
+		}
+	};
+
+	//Places a TriangleMesh in the world. Rays are moved into object space with the inverse transform,
+	//so moving an instance never touches the vertices or the BVH of its mesh.
+	struct TriangleMeshInstance
+	{
+		uint32_t meshIndex{};
+		unsigned char materialIndex{};
+
+		TriangleCullMode cullMode{ TriangleCullMode::BackFaceCulling };
+
+		Matrix rotationTransform{};
+		Matrix translationTransform{};
+		Matrix scaleTransform{};
+
+		Matrix worldTransform{};
+		Matrix inverseTransform{};
+		Matrix normalTransform{};
+
+		void Translate(const Vector3& translation)
+		{
+			translationTransform = Matrix::CreateTranslation(translation);
+		}
+
+		void RotateY(float yaw)
+		{
+			rotationTransform = Matrix::CreateRotationY(yaw);
+		}
+
+		void Scale(const Vector3& scale)
+		{
+			scaleTransform = Matrix::CreateScale(scale);
+		}
+
+		void UpdateTransforms()
+		{
+			worldTransform = scaleTransform * rotationTransform * translationTransform;
+			inverseTransform = Matrix::Inverse(worldTransform);
+			normalTransform = Matrix::Transpose(inverseTransform);
+		}
+
+		AABB GetTransformedAABB(const Vector3& minAABB, const Vector3& maxAABB) const
+		{
+			// AABB Update: be careful -> transform the 8 vertices of the aabb
+			// and calculate the new min and max
+			AABB transformedAABB{};
+			for (int corner = 0; corner < 8; ++corner)
+			{
+				transformedAABB.Grow(worldTransform.TransformPoint(
+					(corner & 1) ? maxAABB.x : minAABB.x,
+					(corner & 2) ? maxAABB.y : minAABB.y,
+					(corner & 4) ? maxAABB.z : minAABB.z));
+			}
+			return transformedAABB;
+		}
+	};
+
+	//Spheres added in bulk, e.g. particles, with a BVH of their own so the top-level BVH holds one primitive for the whole set.
+	//The records are stored in leaf order and sphereIndices maps every slot back to the sphere's position in the buffer the set was built from.
+	//Moving the spheres only refits the BVH, call Build again once they moved far enough from where it was built for the tree to degrade.
+	struct SphereSet
+	{
+		SphereSet() = default;
+		~SphereSet() = default;
+
+		SphereSet(const SphereSet&) = delete;
+		SphereSet(SphereSet&&) noexcept = default;
+		SphereSet& operator=(const SphereSet&) = delete;
+		SphereSet& operator=(SphereSet&&) noexcept = default;
+
+		//A leaf is tested with one 8-wide SIMD kernel (two 4-wide ones without AVX), so up to this many spheres cost about as much as one
+		static constexpr uint32_t maxLeafSpheres{ 8 };
+		static constexpr int nrBuildBins{ 8 };
+		//Nodes with fewer spheres are not worth a thread of their own while building
+		static constexpr uint32_t parallelBuildSpheres{ 65536 };
+
+		//Slot order, padded with maxLeafSpheres - 1 empty records so every leaf can load maxLeafSpheres of them
+		std::vector<SphereRecord> spheres{};
+		std::vector<uint32_t> sphereIndices{};
+		uint32_t sphereCount{};
+		unsigned char materialIndex{};
+
+		Vector3 minAABB{};
+		Vector3 maxAABB{};
+
+		//Same node pool as the mesh BVH: the root is at index 1, a leaf covers spheres[firstIndice, firstIndice + indicesCount)
+		static constexpr uint32_t rootBvhNodeIndx{ 1 };
+		BVHNodePool pBvhNodes{};
+		uint32_t bvhNodesUsed{};
+		float bvhBuildTimeMs{};
+
+		//Copies count spheres into the set and builds its BVH, binned SAH over the sphere centers
+		void Build(const SphereRecord* pSpheres, uint32_t count)
+		{
+			const auto buildStart = std::chrono::high_resolution_clock::now();
+
+			sphereCount = count;
+			spheres.assign(pSpheres, pSpheres + count);
+			spheres.resize(count + maxLeafSpheres - 1);
+			sphereIndices.resize(count);
+			for (uint32_t i = 0; i < count; ++i)
+			{
+				sphereIndices[i] = i;
+			}
+
+			bvhNodesUsed = 0;
+			pBvhNodes.reset();
+			if (count == 0)
+			{
+				minAABB = maxAABB = Vector3{};
+				return;
+			}
+
+			//A binary tree over count leaves of at least one sphere has at most 2 * count - 1 nodes, shrunk once built
+			pBvhNodes = AllocateBVHNodes(2 * count);
+			pBvhNodes[0] = {};
+			BVHNode& root = pBvhNodes[rootBvhNodeIndx];
+			root = {};
+			root.firstIndice = 0;
+			root.indicesCount = count;
+
+			AABB centerBounds{};
+			UpdateNodeBounds(root, centerBounds);
+			std::atomic<uint32_t> nodesUsed{ 1 };
+			Subdivide(rootBvhNodeIndx, centerBounds, nodesUsed, 0);
+			bvhNodesUsed = nodesUsed;
+
+			BVHNodePool pNodes = AllocateBVHNodes(bvhNodesUsed + 1);
+			std::copy(pBvhNodes.get(), pBvhNodes.get() + bvhNodesUsed + 1, pNodes.get());
+			pBvhNodes = std::move(pNodes);
+			minAABB = pBvhNodes[rootBvhNodeIndx].aabbMin;
+			maxAABB = pBvhNodes[rootBvhNodeIndx].aabbMax;
+
+			bvhBuildTimeMs = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - buildStart).count();
+		}
+		//Moves every sphere to its record in pSpheres, which holds sphereCount spheres in the order the set was built from, and refits the BVH
+		void Update(const SphereRecord* pSpheres)
+		{
+			for (uint32_t slot = 0; slot < sphereCount; ++slot)
+			{
+				spheres[slot] = pSpheres[sphereIndices[slot]];
+			}
+			Refit();
+		}
+		void Refit()
+		{
+			if (bvhNodesUsed == 0)
+			{
+				return;
+			}
+			for (uint32_t nodeIndx = bvhNodesUsed; nodeIndx >= rootBvhNodeIndx; --nodeIndx)
+			{
+				BVHNode& node = pBvhNodes[nodeIndx];
+				if (node.IsLeaf())
+				{
+					AABB centerBounds{};
+					UpdateNodeBounds(node, centerBounds);
+					continue;
+				}
+				const BVHNode& leftChild = pBvhNodes[node.leftChild];
+				const BVHNode& rightChild = pBvhNodes[node.leftChild + 1];
+				node.aabbMin = Vector3::Min(leftChild.aabbMin, rightChild.aabbMin);
+				node.aabbMax = Vector3::Max(leftChild.aabbMax, rightChild.aabbMax);
+			}
+			minAABB = pBvhNodes[rootBvhNodeIndx].aabbMin;
+			maxAABB = pBvhNodes[rootBvhNodeIndx].aabbMax;
+		}
+
+		size_t GetSphereMemory() const
+		{
+			return spheres.size() * sizeof(SphereRecord) + sphereIndices.size() * sizeof(uint32_t);
+		}
+		size_t GetBVHNodeMemory() const
+		{
+			return bvhNodesUsed > 0 ? (bvhNodesUsed + 1) * sizeof(BVHNode) : 0;
+		}
+
+		//Also keeps the bounds of the centers, so both bounds of the children come from the bins without another pass over their spheres
+		struct BuildBin
+		{
+			AABB bounds{};
+			AABB centerBounds{};
+			uint32_t count{};
+		};
+
+		//Children are allocated after their parent, which Refit relies on
+		void Subdivide(uint32_t nodeIndx, const AABB& centerBounds, std::atomic<uint32_t>& nodesUsed, uint32_t depth)
+		{
+			BVHNode& node = pBvhNodes[nodeIndx];
+			if (node.indicesCount <= maxLeafSpheres)
+			{
+				return;
+			}
+
+			const uint32_t leftChildIndx = nodesUsed.fetch_add(2) + 1;
+			const uint32_t rightChildIndx = leftChildIndx + 1;
+			AABB leftCenterBounds{};
+			AABB rightCenterBounds{};
+			Split(node, centerBounds, pBvhNodes[leftChildIndx], leftCenterBounds, pBvhNodes[rightChildIndx], rightCenterBounds);
+			node.leftChild = leftChildIndx;
+			node.indicesCount = 0;
+
+			if (GetBuildThreadCount(depth, pBvhNodes[leftChildIndx].indicesCount, parallelBuildSpheres) > 1)
+			{
+				std::future<void> leftTask = std::async(std::launch::async, [&]() { Subdivide(leftChildIndx, leftCenterBounds, nodesUsed, depth + 1); });
+				Subdivide(rightChildIndx, rightCenterBounds, nodesUsed, depth + 1);
+				leftTask.get();
+				return;
+			}
+			Subdivide(leftChildIndx, leftCenterBounds, nodesUsed, depth + 1);
+			Subdivide(rightChildIndx, rightCenterBounds, nodesUsed, depth + 1);
+		}
+		//Bounds of the spheres of the node, centerBounds receives the bounds of their centers
+		void UpdateNodeBounds(BVHNode& node, AABB& centerBounds) const
+		{
+			AABB bounds{};
+			for (uint32_t i = node.firstIndice; i < node.firstIndice + node.indicesCount; ++i)
+			{
+				const SphereRecord& sphere = spheres[i];
+				bounds.Grow(sphere.origin - Vector3::One * sphere.radius);
+				bounds.Grow(sphere.origin + Vector3::One * sphere.radius);
+				centerBounds.Grow(sphere.origin);
+			}
+			node.aabbMin = bounds.min;
+			node.aabbMax = bounds.max;
+		}
+		//Bins the centers along the longest axis of their bounds and partitions the spheres of node at the cheapest bin boundary
+		//into left and right, or in the middle when the centers cannot be told apart. Binning one axis instead of all three
+		//loses little for spheres, which have no elongated bounds to pull a split towards another axis, and keeps builds of millions short.
+		void Split(const BVHNode& node, const AABB& centerBounds, BVHNode& left, AABB& leftCenterBounds, BVHNode& right, AABB& rightCenterBounds)
+		{
+			const uint32_t first = node.firstIndice;
+			const uint32_t end = node.firstIndice + node.indicesCount;
+			const Vector3 extent = centerBounds.max - centerBounds.min;
+			const int axis = extent.x > extent.y && extent.x > extent.z ? 0 : (extent.y > extent.z ? 1 : 2);
+			const float centerMin = centerBounds.min[axis];
+			const float scale = extent[axis] > FLT_EPSILON ? nrBuildBins / extent[axis] : 0.f;
+
+			BuildBin bins[nrBuildBins];
+			if (scale > 0.f)
+			{
+				for (uint32_t i = first; i < end; ++i)
+				{
+					const SphereRecord& sphere = spheres[i];
+					BuildBin& bin = bins[GetBinIndex(sphere.origin[axis], centerMin, scale)];
+					++bin.count;
+					bin.bounds.Grow(sphere.origin - Vector3::One * sphere.radius);
+					bin.bounds.Grow(sphere.origin + Vector3::One * sphere.radius);
+					bin.centerBounds.Grow(sphere.origin);
+				}
+			}
+
+			float bestCost = FLT_MAX;
+			int bestBin{};
+			if (scale > 0.f)
+			{
+				float rightCost[nrBuildBins]{};
+				AABB rightBox{};
+				uint32_t rightSum{};
+				for (int bin = nrBuildBins - 1; bin > 0; --bin)
+				{
+					rightSum += bins[bin].count;
+					rightBox.Grow(bins[bin].bounds);
+					rightCost[bin] = rightSum > 0 ? rightSum * rightBox.GetArea() : FLT_MAX;
+				}
+				AABB leftBox{};
+				uint32_t leftSum{};
+				for (int bin = 1; bin < nrBuildBins; ++bin)
+				{
+					leftSum += bins[bin - 1].count;
+					leftBox.Grow(bins[bin - 1].bounds);
+					if (leftSum == 0 || rightCost[bin] == FLT_MAX)
+					{
+						continue;
+					}
+					const float cost = leftSum * leftBox.GetArea() + rightCost[bin];
+					if (cost < bestCost)
+					{
+						bestCost = cost;
+						bestBin = bin;
+					}
+				}
+			}
+
+			left = {};
+			right = {};
+			left.firstIndice = first;
+			if (bestCost == FLT_MAX)
+			{
+				left.indicesCount = node.indicesCount / 2;
+				right.firstIndice = first + left.indicesCount;
+				right.indicesCount = node.indicesCount - left.indicesCount;
+				UpdateNodeBounds(left, leftCenterBounds);
+				UpdateNodeBounds(right, rightCenterBounds);
+				return;
+			}
+
+			//Partitions by the bin index, so every sphere ends up on the side it was counted on
+			uint32_t i = first;
+			uint32_t j = end;
+			while (i < j)
+			{
+				if (GetBinIndex(spheres[i].origin[axis], centerMin, scale) < bestBin)
+				{
+					++i;
+				}
+				else
+				{
+					--j;
+					std::swap(spheres[i], spheres[j]);
+					std::swap(sphereIndices[i], sphereIndices[j]);
+				}
+			}
+			left.indicesCount = i - first;
+			right.firstIndice = i;
+			right.indicesCount = end - i;
+
+			AABB leftBounds{};
+			AABB rightBounds{};
+			for (int bin = 0; bin < nrBuildBins; ++bin)
+			{
+				const BuildBin& buildBin = bins[bin];
+				(bin < bestBin ? leftBounds : rightBounds).Grow(buildBin.bounds);
+				(bin < bestBin ? leftCenterBounds : rightCenterBounds).Grow(buildBin.centerBounds);
+			}
+			left.aabbMin = leftBounds.min;
+			left.aabbMax = leftBounds.max;
+			right.aabbMin = rightBounds.min;
+			right.aabbMax = rightBounds.max;
+		}
+		static int GetBinIndex(float center, float centerMin, float scale)
+		{
+			return std::min(nrBuildBins - 1, static_cast<int>((center - centerMin) * scale));
 		}
 	};
 #pragma endregion
@@ -436,6 +2356,43 @@ namespace dae
 	};
 #pragma endregion
 #pragma region MISC
+	//Stack of a BVH traversal. The first InlineCapacity entries live in the traversal's own frame, which covers the trees the builders make,
+	//but nothing bounds the depth of a tree after forced splits, spatial splits or refit rotations, so deeper entries spill to the heap.
+	template<typename T, uint32_t InlineCapacity>
+	class TraversalStack
+	{
+	public:
+		bool IsEmpty() const { return m_Size == 0; }
+		void Push(const T& entry)
+		{
+			if (m_Size < InlineCapacity)
+			{
+				m_InlineEntries[m_Size] = entry;
+			}
+			else
+			{
+				m_SpilledEntries.push_back(entry);
+			}
+			++m_Size;
+		}
+		T Pop()
+		{
+			--m_Size;
+			if (m_Size < InlineCapacity)
+			{
+				return m_InlineEntries[m_Size];
+			}
+			const T entry = m_SpilledEntries.back();
+			m_SpilledEntries.pop_back();
+			return entry;
+		}
+
+	private:
+		T m_InlineEntries[InlineCapacity];
+		uint32_t m_Size{};
+		std::vector<T> m_SpilledEntries{};
+	};
+
 	struct Ray
 	{
 		Vector3 origin{};
@@ -454,6 +2411,12 @@ namespace dae
 
 		bool didHit{ false };
 		unsigned char materialIndex{ 0 };
+
+		//While tracing, the hit tests only move t and, for meshes and sphere sets, elementIndex to a closer hit: the leaf triangle
+		//(see GetLeafTriangleNormal) or the sphere slot that was hit. The caller records the primitive.
+		//origin, normal and materialIndex are derived once for the closest hit by the FinalizeHit functions.
+		PrimitiveRef primitive{};
+		uint32_t elementIndex{};
 	};
 #pragma endregion
 }
\ No newline at end of file
@@ -0,0 +1,68 @@
+#include "MappedFile.h"
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace dae;
+
+MappedFile::MappedFile(const std::string& path)
+{
+#if defined(_WIN32)
+	const HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return;
+	}
+	LARGE_INTEGER size{};
+	if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+	{
+		//The view keeps the mapping alive, so both handles can be closed right away
+		const HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping)
+		{
+			m_pData = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+			m_Size = m_pData ? static_cast<size_t>(size.QuadPart) : 0;
+			CloseHandle(mapping);
+		}
+	}
+	CloseHandle(file);
+#else
+	const int file = open(path.c_str(), O_RDONLY);
+	if (file < 0)
+	{
+		return;
+	}
+	struct stat status{};
+	if (fstat(file, &status) == 0 && status.st_size > 0)
+	{
+		void* pData = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+		if (pData != MAP_FAILED)
+		{
+			m_pData = static_cast<const uint8_t*>(pData);
+			m_Size = static_cast<size_t>(status.st_size);
+		}
+	}
+	close(file);
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+	if (!m_pData)
+	{
+		return;
+	}
+#if defined(_WIN32)
+	UnmapViewOfFile(m_pData);
+#else
+	munmap(const_cast<uint8_t*>(m_pData), m_Size);
+#endif
+}
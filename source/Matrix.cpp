@@ -82,6 +82,59 @@ namespace dae {
 		return out;
 	}
 
+	const Matrix& Matrix::Inverse()
+	{
+		const Matrix result{ Inverse(*this) };
+
+		data[0] = result[0];
+		data[1] = result[1];
+		data[2] = result[2];
+		data[3] = result[3];
+
+		return *this;
+	}
+
+	Matrix Matrix::Inverse(const Matrix& m)
+	{
+		//Inverse through the cross products of the columns (Foundations of Game Engine Development, Vol. 1)
+		const Vector3 a{ m[0].x, m[1].x, m[2].x };
+		const Vector3 b{ m[0].y, m[1].y, m[2].y };
+		const Vector3 c{ m[0].z, m[1].z, m[2].z };
+		const Vector3 d{ m[0].w, m[1].w, m[2].w };
+
+		const float x = m[3].x;
+		const float y = m[3].y;
+		const float z = m[3].z;
+		const float w = m[3].w;
+
+		Vector3 s = Vector3::Cross(a, b);
+		Vector3 t = Vector3::Cross(c, d);
+		Vector3 u = a * y - b * x;
+		Vector3 v = c * w - d * z;
+
+		const float det = Vector3::Dot(s, v) + Vector3::Dot(t, u);
+		assert(abs(det) > 0.f);
+
+		const float invDet = 1.f / det;
+		s *= invDet;
+		t *= invDet;
+		u *= invDet;
+		v *= invDet;
+
+		const Vector3 r0 = Vector3::Cross(b, v) + t * y;
+		const Vector3 r1 = Vector3::Cross(v, a) - t * x;
+		const Vector3 r2 = Vector3::Cross(d, u) + s * w;
+		const Vector3 r3 = Vector3::Cross(u, c) - s * z;
+
+		return Matrix
+		{
+			{ r0.x, r0.y, r0.z, -Vector3::Dot(b, t) },
+			{ r1.x, r1.y, r1.z, Vector3::Dot(a, t) },
+			{ r2.x, r2.y, r2.z, -Vector3::Dot(d, s) },
+			{ r3.x, r3.y, r3.z, Vector3::Dot(c, s) }
+		};
+	}
+
 	Vector3 Matrix::GetAxisX() const
 	{
 		return data[0];
@@ -0,0 +1,263 @@
+#include "MeshCache.h"
+#include "MappedFile.h"
+
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <type_traits>
+
+using namespace dae;
+
+namespace
+{
+	enum Section : uint32_t
+	{
+		Positions,
+		Normals,
+		Indices,
+		BVHNodes,
+		TriangleRefs,
+		Triangles,
+		LeafFirstPacket,
+		Packets4,
+		Packets8,
+		Wide4Nodes,
+		Wide8Nodes,
+		QuantizedNodes,
+		TriangleAffines,
+		AffinePackets4,
+		AffinePackets8,
+		SectionCount
+	};
+	constexpr uint32_t sectionStrides[SectionCount]{
+		sizeof(Vector3), sizeof(Vector3), sizeof(int), sizeof(BVHNode), sizeof(uint32_t), sizeof(BVHTriangle), sizeof(uint32_t),
+		sizeof(BVHTrianglePacket<4>), sizeof(BVHTrianglePacket<8>), sizeof(WideBVHNode<4>), sizeof(WideBVHNode<8>), sizeof(QuantizedBVHNode4),
+		sizeof(BVHTriangleAffine), sizeof(BVHTriangleAffinePacket<4>), sizeof(BVHTriangleAffinePacket<8>) };
+	//Every section starts on a cache line, the mapping itself is page aligned
+	constexpr uint64_t sectionAlignment{ 64 };
+
+	struct SectionEntry
+	{
+		uint64_t offset;
+		uint64_t count;
+	};
+
+	struct FileHeader
+	{
+		char magic[4];
+		uint32_t version;
+		//A cache written by a build where any of the stored structs has another size is rejected
+		uint32_t sectionStrides[SectionCount];
+
+		BVHLayout bvhLayout;
+		LeafLayout leafLayout;
+		TriangleKernel triangleKernel;
+		BVHBuilder bvhBuilder;
+		BVHBuildSettings bvhBuildSettings;
+		float bvhSpatialSplitBudget;
+		uint32_t bvhTreeletLayout;
+		uint32_t bvhTreeletPairs;
+		uint32_t bvhLinearTreelets;
+
+		Vector3 minAABB;
+		Vector3 maxAABB;
+		uint32_t startBvhNodeIndx;
+		uint32_t bvhNodesUsed;
+		float bvhBuildSAHCost;
+
+		SectionEntry sections[SectionCount];
+	};
+	static_assert(std::is_trivially_copyable_v<FileHeader>);
+	constexpr char fileMagic[4]{ 'R', 'T', 'M', 'C' };
+
+	uint64_t AlignOffset(uint64_t offset)
+	{
+		return (offset + sectionAlignment - 1) / sectionAlignment * sectionAlignment;
+	}
+
+	template<typename T>
+	void ReadSection(const MappedFile& file, const SectionEntry& entry, std::vector<T>& data)
+	{
+		static_assert(std::is_trivially_copyable_v<T>);
+		const T* pFirst = reinterpret_cast<const T*>(file.GetData() + entry.offset);
+		data.assign(pFirst, pFirst + entry.count);
+	}
+
+	template<typename T>
+	std::pair<const void*, uint64_t> GetSection(const std::vector<T>& data)
+	{
+		static_assert(std::is_trivially_copyable_v<T>);
+		return { data.data(), data.size() };
+	}
+}
+
+std::string MeshCache::GetCachePath(const std::string& sourcePath)
+{
+	return sourcePath + ".rtmesh";
+}
+
+bool MeshCache::Load(const std::string& sourcePath, TriangleMesh& mesh)
+{
+	const auto loadStart = std::chrono::high_resolution_clock::now();
+	const std::string cachePath = GetCachePath(sourcePath);
+
+	//An out of date cache is ignored, the caller then rebuilds the mesh and saves it again.
+	//Without the source the cache is all there is, so it is used as is.
+	std::error_code error{};
+	const std::filesystem::file_time_type cacheTime = std::filesystem::last_write_time(cachePath, error);
+	if (error)
+	{
+		return false;
+	}
+	const std::filesystem::file_time_type sourceTime = std::filesystem::last_write_time(sourcePath, error);
+	if (!error && sourceTime > cacheTime)
+	{
+		return false;
+	}
+
+	const MappedFile file{ cachePath };
+	FileHeader header{};
+	if (file.GetSize() < sizeof(header))
+	{
+		return false;
+	}
+	std::memcpy(&header, file.GetData(), sizeof(header));
+	if (std::memcmp(header.magic, fileMagic, sizeof(fileMagic)) != 0 || header.version != version
+		|| std::memcmp(header.sectionStrides, sectionStrides, sizeof(sectionStrides)) != 0)
+	{
+		return false;
+	}
+	if (header.bvhLayout != mesh.bvhLayout || header.leafLayout != mesh.leafLayout || header.triangleKernel != mesh.triangleKernel)
+	{
+		return false;
+	}
+	//A tree built another way would silently replace the builder the caller asked for
+	if (header.bvhBuilder != mesh.bvhBuilder || header.bvhSpatialSplitBudget != mesh.bvhSpatialSplitBudget
+		|| (header.bvhTreeletLayout != 0) != mesh.bvhTreeletLayout || header.bvhTreeletPairs != mesh.bvhTreeletPairs
+		|| (header.bvhLinearTreelets != 0) != mesh.bvhLinearTreelets)
+	{
+		return false;
+	}
+	for (uint32_t section = 0; section < SectionCount; ++section)
+	{
+		const SectionEntry& entry = header.sections[section];
+		if (entry.offset % sectionAlignment != 0 || entry.offset > file.GetSize()
+			|| entry.count > (file.GetSize() - entry.offset) / sectionStrides[section])
+		{
+			return false;
+		}
+	}
+	const uint64_t nodeCount = header.sections[BVHNodes].count;
+	if (nodeCount != uint64_t{ header.bvhNodesUsed } + 1 || header.startBvhNodeIndx >= nodeCount)
+	{
+		return false;
+	}
+
+	ReadSection(file, header.sections[Positions], mesh.positions);
+	ReadSection(file, header.sections[Normals], mesh.normals);
+	ReadSection(file, header.sections[Indices], mesh.indices);
+	ReadSection(file, header.sections[TriangleRefs], mesh.bvhTriangleRefs);
+	ReadSection(file, header.sections[Triangles], mesh.bvhTriangles);
+	ReadSection(file, header.sections[LeafFirstPacket], mesh.bvhLeafFirstPacket);
+	ReadSection(file, header.sections[Packets4], mesh.bvhPackets4);
+	ReadSection(file, header.sections[Packets8], mesh.bvhPackets8);
+	ReadSection(file, header.sections[Wide4Nodes], mesh.bvh4Nodes);
+	ReadSection(file, header.sections[Wide8Nodes], mesh.bvh8Nodes);
+	ReadSection(file, header.sections[QuantizedNodes], mesh.bvhQuantizedNodes);
+	ReadSection(file, header.sections[TriangleAffines], mesh.bvhTriangleAffines);
+	ReadSection(file, header.sections[AffinePackets4], mesh.bvhAffinePackets4);
+	ReadSection(file, header.sections[AffinePackets8], mesh.bvhAffinePackets8);
+
+	mesh.pBvhNodes = AllocateBVHNodes(static_cast<uint32_t>(nodeCount));
+	std::memcpy(mesh.pBvhNodes.get(), file.GetData() + header.sections[BVHNodes].offset, nodeCount * sizeof(BVHNode));
+	mesh.bvhNodeCapacity = static_cast<uint32_t>(nodeCount);
+	mesh.startBvhNodeIndx = header.startBvhNodeIndx;
+	mesh.bvhNodesUsed = header.bvhNodesUsed;
+
+	mesh.bvhBuildSettings = header.bvhBuildSettings;
+	mesh.minAABB = header.minAABB;
+	mesh.maxAABB = header.maxAABB;
+	mesh.bvhBuildSAHCost = header.bvhBuildSAHCost;
+	//Reported as the build time, so the mesh statistics show what the cache saved
+	mesh.bvhBuildTimeMs = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - loadStart).count();
+	return true;
+}
+
+bool MeshCache::Save(const std::string& sourcePath, const TriangleMesh& mesh)
+{
+	if (!mesh.pBvhNodes || mesh.bvhNodesUsed == 0)
+	{
+		return false;
+	}
+
+	std::pair<const void*, uint64_t> sections[SectionCount]{};
+	sections[Positions] = GetSection(mesh.positions);
+	sections[Normals] = GetSection(mesh.normals);
+	sections[Indices] = GetSection(mesh.indices);
+	sections[BVHNodes] = { mesh.pBvhNodes.get(), uint64_t{ mesh.bvhNodesUsed } + 1 };
+	sections[TriangleRefs] = GetSection(mesh.bvhTriangleRefs);
+	sections[Triangles] = GetSection(mesh.bvhTriangles);
+	sections[LeafFirstPacket] = GetSection(mesh.bvhLeafFirstPacket);
+	sections[Packets4] = GetSection(mesh.bvhPackets4);
+	sections[Packets8] = GetSection(mesh.bvhPackets8);
+	sections[Wide4Nodes] = GetSection(mesh.bvh4Nodes);
+	sections[Wide8Nodes] = GetSection(mesh.bvh8Nodes);
+	sections[QuantizedNodes] = GetSection(mesh.bvhQuantizedNodes);
+	sections[TriangleAffines] = GetSection(mesh.bvhTriangleAffines);
+	sections[AffinePackets4] = GetSection(mesh.bvhAffinePackets4);
+	sections[AffinePackets8] = GetSection(mesh.bvhAffinePackets8);
+
+	FileHeader header{};
+	std::memcpy(header.magic, fileMagic, sizeof(fileMagic));
+	header.version = version;
+	std::memcpy(header.sectionStrides, sectionStrides, sizeof(sectionStrides));
+	header.bvhLayout = mesh.bvhLayout;
+	header.leafLayout = mesh.leafLayout;
+	header.triangleKernel = mesh.triangleKernel;
+	header.bvhBuilder = mesh.bvhBuilder;
+	header.bvhBuildSettings = mesh.bvhBuildSettings;
+	header.bvhSpatialSplitBudget = mesh.bvhSpatialSplitBudget;
+	header.bvhTreeletLayout = mesh.bvhTreeletLayout ? 1 : 0;
+	header.bvhTreeletPairs = mesh.bvhTreeletPairs;
+	header.bvhLinearTreelets = mesh.bvhLinearTreelets ? 1 : 0;
+	header.minAABB = mesh.minAABB;
+	header.maxAABB = mesh.maxAABB;
+	header.startBvhNodeIndx = mesh.startBvhNodeIndx;
+	header.bvhNodesUsed = mesh.bvhNodesUsed;
+	header.bvhBuildSAHCost = mesh.bvhBuildSAHCost;
+
+	uint64_t offset = AlignOffset(sizeof(header));
+	for (uint32_t section = 0; section < SectionCount; ++section)
+	{
+		header.sections[section] = { offset, sections[section].second };
+		offset = AlignOffset(offset + sections[section].second * sectionStrides[section]);
+	}
+
+	const std::string cachePath = GetCachePath(sourcePath);
+	std::ofstream file(cachePath, std::ios::binary | std::ios::trunc);
+	if (!file)
+	{
+		return false;
+	}
+	const char padding[sectionAlignment]{};
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	uint64_t written = sizeof(header);
+	for (uint32_t section = 0; section < SectionCount; ++section)
+	{
+		file.write(padding, static_cast<std::streamsize>(header.sections[section].offset - written));
+		const uint64_t size = sections[section].second * sectionStrides[section];
+		file.write(static_cast<const char*>(sections[section].first), static_cast<std::streamsize>(size));
+		written = header.sections[section].offset + size;
+	}
+	file.close();
+
+	//A partly written cache would only be rejected on the next load, remove it right away
+	if (!file)
+	{
+		std::error_code error{};
+		std::filesystem::remove(cachePath, error);
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <string>
+#include "DataTypes.h"
+
+namespace dae
+{
+	//Binary cache of a parsed mesh together with its built BVH, stored next to the source OBJ as <obj>.rtmesh.
+	//Every array is written in its final in-memory layout, so loading maps the file and copies the sections
+	//straight into the mesh without parsing or rebuilding anything.
+	namespace MeshCache
+	{
+		//Bump whenever the file layout or any of the stored node and triangle structs change
+		constexpr uint32_t version{ 2 };
+
+		std::string GetCachePath(const std::string& sourcePath);
+
+		//Fills mesh from the cache of sourcePath. Fails when there is no cache, when it is older than the source,
+		//was written by another version or with another layout, kernel or builder option than the ones already set on mesh:
+		//bvhLayout, leafLayout, triangleKernel, bvhBuilder, bvhSpatialSplitBudget, bvhTreeletLayout, bvhTreeletPairs or bvhLinearTreelets.
+		//Only bvhBuildSettings is taken from the cache.
+		bool Load(const std::string& sourcePath, TriangleMesh& mesh);
+		//Writes mesh, which must have a built BVH, to the cache of sourcePath
+		bool Save(const std::string& sourcePath, const TriangleMesh& mesh);
+	}
+}
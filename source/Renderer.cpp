@@ -10,11 +10,7 @@
 #include "Scene.h"
 #include "Utils.h"
 
-#include <future>
-#include <ppl.h>
-
-//#define ASYNC
-#define PARALLEL_FOR
+#include <iostream>
 
 using namespace dae;
 
@@ -28,7 +24,7 @@ Renderer::Renderer(SDL_Window * pWindow) :
 	//SDL_SetRelativeMouseMode(SDL_TRUE);
 }
 
-void Renderer::Render(Scene* pScene) const
+void Renderer::Render(Scene* pScene)
 {
 	Camera& camera = pScene->GetCamera();
 	auto& materials = pScene->GetMaterials();
@@ -39,55 +35,35 @@ void Renderer::Render(Scene* pScene) const
 
 	camera.cameraToWorld = camera.CalculateCameraToWorld();
 
-	const uint32_t numbPixel = m_Width * m_Height;
-
-#if defined(ASYNC)
-	const uint32_t numCores = std::thread::hardware_concurrency();
-	std::vector<std::future<void>> async_futures{};
-	const uint32_t numbPixelsPerTask = numbPixel / numCores;
-	uint32_t numUnassignedPixels = numbPixel % numCores;
-	uint32_t currentPixelIndex{};
+	const uint32_t numWorkers = m_ParallelMode == ParallelMode::ThreadPool ? m_ThreadPool.GetNumThreads() : 1;
+	m_TileScheduler.BeginFrame(m_Width, m_Height, numWorkers);
 
-	for (uint32_t coreId = 0; coreId < numCores; ++coreId)
-	{
-		uint32_t taskSize = numbPixelsPerTask;
-		if (numUnassignedPixels > 0)
+	m_ThreadPool.ParallelFor(numWorkers, [&](uint32_t workerId)
 		{
-			++taskSize;
-			--numUnassignedPixels;
-		}
-		async_futures.push_back(std::async(std::launch::async, [=,this]
-			{
-				const uint32_t pixelIndexEnd = currentPixelIndex + taskSize;
-				for (uint32_t pixelIndex = currentPixelIndex; pixelIndex < pixelIndexEnd; ++pixelIndex)
+			m_TileScheduler.RunWorker(workerId, [&](const Tile& tile)
 				{
-					RenderPixel(pScene, pixelIndex, fov, aspectRatio, camera, lights, materials);
-				}
-			}));
-		currentPixelIndex += taskSize;
-	}
-	for (const std::future<void>& f : async_futures)
-	{
-		f.wait();
-	}
-
-#elif defined(PARALLEL_FOR)
-	concurrency::parallel_for(0u, numbPixel, [=, this](int i) {
-		RenderPixel(pScene, i, fov, aspectRatio, camera, lights, materials);
+					RenderTile(pScene, tile, fov, aspectRatio, camera, lights, materials);
+				});
 		});
-#else
-	for (uint32_t i = 0; i < numbPixel; i++)
-	{
-		RenderPixel(pScene, i, fov, aspectRatio, camera, lights, materials);
-	}
-#endif
 
+	m_TileScheduler.EndFrame();
 
 	//@END
 	//Update SDL Surface
 	SDL_UpdateWindowSurface(m_pWindow);
 }
 
+void Renderer::RenderTile(Scene* pScene, const Tile& tile, float fov, float aspectRatio, const Camera& camera, const std::vector<Light>& lights, const std::vector<Material*>& materials) const
+{
+	for (uint32_t py = tile.y; py < tile.y + tile.height; ++py)
+	{
+		for (uint32_t px = tile.x; px < tile.x + tile.width; ++px)
+		{
+			RenderPixel(pScene, px + (py * m_Width), fov, aspectRatio, camera, lights, materials);
+		}
+	}
+}
+
 void Renderer::RenderPixel(Scene* pScene, uint32_t pixelIndex, float fov, float aspectRatio, const Camera& camera, const std::vector<Light>& lights, const std::vector<Material*>& materials) const
 {
 	const int px = pixelIndex % m_Width;
@@ -181,6 +157,26 @@ void Renderer::CycleLightingMode()
 	}
 }
 
+void Renderer::CycleTileSize()
+{
+	constexpr uint32_t tileSizes[][2]{ { 16, 16 }, { 32, 8 }, { 8, 8 }, { 32, 32 } };
+	constexpr int numTileSizes{ sizeof(tileSizes) / sizeof(tileSizes[0]) };
+
+	m_CurrentTileSize = (m_CurrentTileSize + 1) % numTileSizes;
+	m_TileScheduler.SetTileSize(tileSizes[m_CurrentTileSize][0], tileSizes[m_CurrentTileSize][1]);
+	std::cout << "Tile size: " << m_TileScheduler.GetTileWidth() << "x" << m_TileScheduler.GetTileHeight() << std::endl;
+}
+
+void Renderer::CycleParallelMode()
+{
+	m_ParallelMode = (ParallelMode)((int)m_ParallelMode + 1);
+	if ((int)m_ParallelMode > 1)
+	{
+		m_ParallelMode = (ParallelMode)0;
+	}
+	std::cout << "Parallel mode: " << (m_ParallelMode == ParallelMode::ThreadPool ? "ThreadPool" : "Sequential") << std::endl;
+}
+
 bool Renderer::SaveBufferToImage() const
 {
 	return SDL_SaveBMP(m_pBuffer, "RayTracing_Buffer.bmp");
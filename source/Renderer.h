@@ -4,6 +4,8 @@
 #include "Camera.h"
 #include <vector>
 #include "Scene.h"
+#include "ThreadPool.h"
+#include "TileScheduler.h"
 
 struct SDL_Window;
 struct SDL_Surface;
@@ -23,10 +25,14 @@ namespace dae
 		Renderer& operator=(const Renderer&) = delete;
 		Renderer& operator=(Renderer&&) noexcept = delete;
 
-		void Render(Scene* pScene) const;
+		void Render(Scene* pScene);
+		void RenderTile(Scene* pScene, const Tile& tile, float fov, float aspectRatio, const Camera& camera, const std::vector<Light>& lights, const std::vector<Material*>& materials) const;
 		void RenderPixel(Scene* pScene, uint32_t pixelIndex, float fov, float aspectRatio, const Camera& camera, const std::vector<Light>& lights, const std::vector<Material*>& materials) const;
 		void ToggleShadows() { m_ShadowsEnabled = !m_ShadowsEnabled; }
 		void CycleLightingMode();
+		void CycleTileSize();
+		void CycleParallelMode();
+		const TileFrameStats& GetTileFrameStats() const { return m_TileScheduler.GetFrameStats(); }
 		bool SaveBufferToImage() const;
 
 	private:
@@ -45,6 +51,17 @@ namespace dae
 		bool m_ShadowsEnabled{ true };
 		LightingMode m_CurrentLightingMode{ LightingMode::Combined };
 
+		enum class ParallelMode
+		{
+			Sequential,
+			ThreadPool
+		};
+		ParallelMode m_ParallelMode{ ParallelMode::ThreadPool };
+
+		ThreadPool m_ThreadPool{};
+		TileScheduler m_TileScheduler{};
+		int m_CurrentTileSize{};
+
 		int m_Width{};
 		int m_Height{};
 	};
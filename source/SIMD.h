@@ -0,0 +1,127 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <immintrin.h>
+
+namespace dae
+{
+#if defined(__AVX__)
+	constexpr int SIMD_MAX_LANES{ 8 };
+#else
+	constexpr int SIMD_MAX_LANES{ 4 };
+#endif
+
+	//Thin wrappers over the SSE and AVX float intrinsics, so a kernel can be written once as a template on the lane count.
+	//SIMDFloat<8> only exists when AVX is enabled, kernels split 8 lanes into two SIMDFloat<4> halves otherwise.
+	template<int Lanes>
+	struct SIMDFloat;
+
+	template<>
+	struct SIMDFloat<4>
+	{
+		using Reg = __m128;
+
+		static Reg Load(const float* pData) { return _mm_load_ps(pData); }
+		static void Store(float* pData, Reg a) { _mm_storeu_ps(pData, a); }
+		static Reg Set(float value) { return _mm_set1_ps(value); }
+		//Transposes four consecutive 16-byte aligned groups of four floats, a receives the first float of every group, d the last
+		static void LoadTransposed(const float* pData, Reg& a, Reg& b, Reg& c, Reg& d)
+		{
+			a = _mm_load_ps(pData);
+			b = _mm_load_ps(pData + 4);
+			c = _mm_load_ps(pData + 8);
+			d = _mm_load_ps(pData + 12);
+			_MM_TRANSPOSE4_PS(a, b, c, d);
+		}
+		//Four unsigned bytes widened to floats (SSE4.1)
+		static Reg LoadBytes(const uint8_t* pData)
+		{
+			int32_t bytes;
+			std::memcpy(&bytes, pData, sizeof(bytes));
+			return _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes)));
+		}
+
+		static Reg Add(Reg a, Reg b) { return _mm_add_ps(a, b); }
+		static Reg Sub(Reg a, Reg b) { return _mm_sub_ps(a, b); }
+		static Reg Mul(Reg a, Reg b) { return _mm_mul_ps(a, b); }
+		static Reg Div(Reg a, Reg b) { return _mm_div_ps(a, b); }
+		static Reg Sqrt(Reg a) { return _mm_sqrt_ps(a); }
+		static Reg Min(Reg a, Reg b) { return _mm_min_ps(a, b); }
+		static Reg Max(Reg a, Reg b) { return _mm_max_ps(a, b); }
+		static Reg Abs(Reg a) { return _mm_andnot_ps(_mm_set1_ps(-0.f), a); }
+
+		static Reg Less(Reg a, Reg b) { return _mm_cmplt_ps(a, b); }
+		static Reg LessEqual(Reg a, Reg b) { return _mm_cmple_ps(a, b); }
+		static Reg Greater(Reg a, Reg b) { return _mm_cmpgt_ps(a, b); }
+		static Reg GreaterEqual(Reg a, Reg b) { return _mm_cmpge_ps(a, b); }
+		static Reg Equal(Reg a, Reg b) { return _mm_cmpeq_ps(a, b); }
+
+		static Reg And(Reg a, Reg b) { return _mm_and_ps(a, b); }
+		static Reg AndNot(Reg a, Reg b) { return _mm_andnot_ps(a, b); }
+		static Reg Or(Reg a, Reg b) { return _mm_or_ps(a, b); }
+		//Picks b where the mask is set, a elsewhere
+		static Reg Select(Reg a, Reg b, Reg mask) { return _mm_or_ps(_mm_andnot_ps(mask, a), _mm_and_ps(mask, b)); }
+		static uint32_t MoveMask(Reg a) { return static_cast<uint32_t>(_mm_movemask_ps(a)); }
+
+		static float HorizontalMin(Reg a)
+		{
+			a = _mm_min_ps(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1)));
+			a = _mm_min_ps(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(1, 0, 3, 2)));
+			return _mm_cvtss_f32(a);
+		}
+	};
+
+#if defined(__AVX__)
+	template<>
+	struct SIMDFloat<8>
+	{
+		using Reg = __m256;
+
+		static Reg Load(const float* pData) { return _mm256_load_ps(pData); }
+		static void Store(float* pData, Reg a) { _mm256_storeu_ps(pData, a); }
+		static Reg Set(float value) { return _mm256_set1_ps(value); }
+		//Transposes eight consecutive groups of four floats like SIMDFloat<4>::LoadTransposed, on groups 0-3 and 4-7 in the two halves
+		static void LoadTransposed(const float* pData, Reg& a, Reg& b, Reg& c, Reg& d)
+		{
+			const Reg group04 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_load_ps(pData)), _mm_load_ps(pData + 16), 1);
+			const Reg group15 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_load_ps(pData + 4)), _mm_load_ps(pData + 20), 1);
+			const Reg group26 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_load_ps(pData + 8)), _mm_load_ps(pData + 24), 1);
+			const Reg group37 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_load_ps(pData + 12)), _mm_load_ps(pData + 28), 1);
+			const Reg low01 = _mm256_unpacklo_ps(group04, group15);
+			const Reg low23 = _mm256_unpacklo_ps(group26, group37);
+			const Reg high01 = _mm256_unpackhi_ps(group04, group15);
+			const Reg high23 = _mm256_unpackhi_ps(group26, group37);
+			a = _mm256_shuffle_ps(low01, low23, _MM_SHUFFLE(1, 0, 1, 0));
+			b = _mm256_shuffle_ps(low01, low23, _MM_SHUFFLE(3, 2, 3, 2));
+			c = _mm256_shuffle_ps(high01, high23, _MM_SHUFFLE(1, 0, 1, 0));
+			d = _mm256_shuffle_ps(high01, high23, _MM_SHUFFLE(3, 2, 3, 2));
+		}
+
+		static Reg Add(Reg a, Reg b) { return _mm256_add_ps(a, b); }
+		static Reg Sub(Reg a, Reg b) { return _mm256_sub_ps(a, b); }
+		static Reg Mul(Reg a, Reg b) { return _mm256_mul_ps(a, b); }
+		static Reg Div(Reg a, Reg b) { return _mm256_div_ps(a, b); }
+		static Reg Sqrt(Reg a) { return _mm256_sqrt_ps(a); }
+		static Reg Min(Reg a, Reg b) { return _mm256_min_ps(a, b); }
+		static Reg Max(Reg a, Reg b) { return _mm256_max_ps(a, b); }
+		static Reg Abs(Reg a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.f), a); }
+
+		static Reg Less(Reg a, Reg b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+		static Reg LessEqual(Reg a, Reg b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+		static Reg Greater(Reg a, Reg b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+		static Reg GreaterEqual(Reg a, Reg b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+		static Reg Equal(Reg a, Reg b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+
+		static Reg And(Reg a, Reg b) { return _mm256_and_ps(a, b); }
+		static Reg AndNot(Reg a, Reg b) { return _mm256_andnot_ps(a, b); }
+		static Reg Or(Reg a, Reg b) { return _mm256_or_ps(a, b); }
+		static Reg Select(Reg a, Reg b, Reg mask) { return _mm256_blendv_ps(a, b, mask); }
+		static uint32_t MoveMask(Reg a) { return static_cast<uint32_t>(_mm256_movemask_ps(a)); }
+
+		static float HorizontalMin(Reg a)
+		{
+			return SIMDFloat<4>::HorizontalMin(_mm_min_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1)));
+		}
+	};
+#endif
+}
@@ -1,7 +1,12 @@
 #include "Scene.h"
 #include "Utils.h"
+#include "MeshCache.h"
 #include "Material.h"
 
+#include <algorithm>
+#include <iostream>
+#include <numeric>
+
 namespace dae {
 
 #pragma region Base Scene
@@ -12,6 +17,8 @@ namespace dae {
 		m_SphereGeometries.reserve(32);
 		m_PlaneGeometries.reserve(32);
 		m_TriangleMeshGeometries.reserve(32);
+		m_TriangleMeshInstances.reserve(32);
+		m_SphereSets.reserve(32);
 		m_Lights.reserve(32);
 	}
 
@@ -28,56 +35,582 @@ namespace dae {
 
 	void dae::Scene::GetClosestHit(const Ray& ray, HitRecord& closestHit) const
 	{
-		for (int i = 0; i < m_SphereGeometries.size(); i++)
+		for (uint32_t i = 0; i < m_PlanePackets.size(); ++i)
 		{
-			GeometryUtils::HitTest_Sphere(m_SphereGeometries[i], ray, closestHit);
+			int lane{};
+			float t{};
+			if (GeometryUtils::HitTest_PlanePacket<HitQuery::ClosestHit>(m_PlanePackets[i], ray, lane, t) && closestHit.t > t)
+			{
+				closestHit.didHit = true;
+				closestHit.t = t;
+				closestHit.primitive = { i * primitivePacketWidth + lane, PrimitiveType::Plane };
+			}
 		}
-		for (int i = 0; i < m_PlaneGeometries.size(); i++)
+
+		if (m_TopLevelBVHNodesUsed == 0)
 		{
-			GeometryUtils::HitTest_Plane(m_PlaneGeometries[i], ray, closestHit);
+			FinalizeHit(ray, closestHit);
+			return;
+		}
+
+		GeometryUtils::TraverseBVH(m_TopLevelBVHNodes.data(), 0, ray,
+			[&]() { return closestHit.t; },
+			[&](uint32_t, const TLASNode& node)
+			{
+				for (uint32_t i = node.firstPrimitive; i < node.firstPrimitive + node.primitiveCount; ++i)
+				{
+					HitTest_Primitive(m_TopLevelPrimitives[i], ray, closestHit);
+				}
+				return false;
+			});
+		FinalizeHit(ray, closestHit);
+	}
+
+	bool Scene::DoesHit(const Ray& ray) const
+	{
+		for (const PlanePacket<primitivePacketWidth>& packet : m_PlanePackets)
+		{
+			int lane{};
+			float t{};
+			if (GeometryUtils::HitTest_PlanePacket<HitQuery::AnyHit>(packet, ray, lane, t))
+			{
+				return true;
+			}
 		}
-		for (int i = 0; i < m_Triangles.size(); i++)
+
+		if (m_TopLevelBVHNodesUsed == 0)
 		{
-			GeometryUtils::HitTest_Triangle(m_Triangles[i], ray, closestHit);
+			return false;
 		}
-		for (int i = 0; i < m_TriangleMeshGeometries.size(); i++)
+
+		TraversalStack<uint32_t, 64> stack{};
+		stack.Push(0);
+		while (!stack.IsEmpty())
 		{
-			GeometryUtils::HitTest_TriangleMesh(m_TriangleMeshGeometries[i], ray, closestHit);
+			const TLASNode& node = m_TopLevelBVHNodes[stack.Pop()];
+			if (GeometryUtils::SlabTest_AABB(ray, node.aabbMin, node.aabbMax) == FLT_MAX)
+			{
+				continue;
+			}
+
+			if (node.IsLeaf())
+			{
+				for (uint32_t i = node.firstPrimitive; i < node.firstPrimitive + node.primitiveCount; ++i)
+				{
+					if (HitTest_Primitive(m_TopLevelPrimitives[i], ray))
+					{
+						return true;
+					}
+				}
+				continue;
+			}
+			stack.Push(node.leftChild + 1);
+			stack.Push(node.leftChild);
 		}
+		return false;
 	}
 
-	bool Scene::DoesHit(const Ray& ray) const
+	//Returns true and records the primitive when it is hit closer than hitRecord.t
+	bool Scene::HitTest_Primitive(const PrimitiveRef& primitive, const Ray& ray, HitRecord& hitRecord) const
 	{
-		for (int i = 0; i < m_SphereGeometries.size(); i++)
+		bool isCloser{};
+		switch (primitive.type)
+		{
+		case PrimitiveType::SpherePacket:
 		{
-			if (GeometryUtils::HitTest_Sphere(m_SphereGeometries[i], ray))
+			//Records the sphere of the lane rather than the packet
+			int lane{};
+			float t{};
+			if (!GeometryUtils::HitTest_SpherePacket<HitQuery::ClosestHit>(m_SpherePackets[primitive.index], ray, lane, t) || hitRecord.t <= t)
 			{
-				return true;
+				return false;
 			}
+			hitRecord.didHit = true;
+			hitRecord.t = t;
+			hitRecord.primitive = { m_SpherePacketSpheres[primitive.index * primitivePacketWidth + lane], PrimitiveType::Sphere };
+			return true;
 		}
-		for (int i = 0; i < m_PlaneGeometries.size(); i++)
+		case PrimitiveType::Triangle:
+			isCloser = GeometryUtils::HitTest_Triangle(m_Triangles[primitive.index], ray, hitRecord);
+			break;
+		case PrimitiveType::TriangleMeshInstance:
 		{
-			if (GeometryUtils::HitTest_Plane(m_PlaneGeometries[i], ray))
+			const TriangleMeshInstance& instance = m_TriangleMeshInstances[primitive.index];
+			isCloser = GeometryUtils::HitTest_TriangleMesh(m_TriangleMeshGeometries[instance.meshIndex], instance, ray, hitRecord);
+			break;
+		}
+		case PrimitiveType::SphereSet:
+			isCloser = GeometryUtils::HitTest_SphereSet(m_SphereSets[primitive.index], ray, hitRecord);
+			break;
+		default:
+			break;
+		}
+		if (isCloser)
+		{
+			hitRecord.primitive = primitive;
+		}
+		return isCloser;
+	}
+
+	bool Scene::HitTest_Primitive(const PrimitiveRef& primitive, const Ray& ray) const
+	{
+		switch (primitive.type)
+		{
+		case PrimitiveType::SpherePacket:
+		{
+			int lane{};
+			float t{};
+			return GeometryUtils::HitTest_SpherePacket<HitQuery::AnyHit>(m_SpherePackets[primitive.index], ray, lane, t);
+		}
+		case PrimitiveType::Triangle:
+			return GeometryUtils::HitTest_Triangle(m_Triangles[primitive.index], ray);
+		case PrimitiveType::TriangleMeshInstance:
+		{
+			const TriangleMeshInstance& instance = m_TriangleMeshInstances[primitive.index];
+			return GeometryUtils::HitTest_TriangleMesh(m_TriangleMeshGeometries[instance.meshIndex], instance, ray);
+		}
+		case PrimitiveType::SphereSet:
+			return GeometryUtils::HitTest_SphereSet(m_SphereSets[primitive.index], ray);
+		default:
+			return false;
+		}
+	}
+
+	//Fills in origin, normal and material for the closest hit only, traversal just kept its t and primitive
+	void Scene::FinalizeHit(const Ray& ray, HitRecord& hitRecord) const
+	{
+		if (!hitRecord.didHit)
+		{
+			return;
+		}
+
+		const uint32_t index = hitRecord.primitive.index;
+		switch (hitRecord.primitive.type)
+		{
+		case PrimitiveType::Sphere:
+			GeometryUtils::FinalizeHit_Sphere(m_SphereGeometries[index], ray, hitRecord);
+			break;
+		case PrimitiveType::Triangle:
+			GeometryUtils::FinalizeHit_Triangle(m_Triangles[index], ray, hitRecord);
+			break;
+		case PrimitiveType::TriangleMeshInstance:
+		{
+			const TriangleMeshInstance& instance = m_TriangleMeshInstances[index];
+			GeometryUtils::FinalizeHit_TriangleMesh(m_TriangleMeshGeometries[instance.meshIndex], instance, ray, hitRecord);
+			break;
+		}
+		case PrimitiveType::SphereSet:
+			GeometryUtils::FinalizeHit_SphereSet(m_SphereSets[index], ray, hitRecord);
+			break;
+		case PrimitiveType::Plane:
+			GeometryUtils::FinalizeHit_Plane(m_PlaneGeometries[index], ray, hitRecord);
+			break;
+		case PrimitiveType::SpherePacket:
+			//Packet hits record the sphere of the lane, so a packet never reaches the closest hit
+			assert(false);
+			break;
+		}
+	}
+
+#pragma region Top-Level BVH
+	void Scene::UpdateTopLevelBVH()
+	{
+		SwapRebuiltMeshes();
+		UpdatePlanePackets();
+		if (GetNumBoundedPrimitives() != m_TopLevelPrimitives.size() || m_SpherePacketSpheres.size() != m_SphereGeometries.size() || m_TopLevelBVHNodesUsed == 0)
+		{
+			BuildTopLevelBVH();
+		}
+		else
+		{
+			RefitTopLevelBVH();
+		}
+	}
+
+	void Scene::SwapRebuiltMeshes()
+	{
+		for (uint32_t meshIndex = 0; meshIndex < m_MeshRebuilds.size(); ++meshIndex)
+		{
+			MeshRebuild* pRebuild = m_MeshRebuilds[meshIndex].get();
+			if (!pRebuild || !pRebuild->buildTask.valid() || pRebuild->buildTask.wait_for(std::chrono::seconds{ 0 }) != std::future_status::ready)
 			{
-				return true;
+				continue;
 			}
+			pRebuild->buildTask.get();
+
+			//The previous front mesh becomes the back buffer of the next rebuild and keeps its allocations
+			std::swap(m_TriangleMeshGeometries[meshIndex], pRebuild->mesh);
 		}
-		for (int i = 0; i < m_Triangles.size(); i++)
+	}
+
+	//Splits the spheres at the median of their longest axis until every group fits one packet, so a packet covers spheres close together
+	void Scene::BuildSpherePackets()
+	{
+		struct SphereRange
 		{
-			if (GeometryUtils::HitTest_Triangle(m_Triangles[i], ray))
+			uint32_t first;
+			uint32_t count;
+		};
+
+		const uint32_t nrSpheres = static_cast<uint32_t>(m_SphereGeometries.size());
+		m_SpherePacketSpheres.resize(nrSpheres);
+		std::iota(m_SpherePacketSpheres.begin(), m_SpherePacketSpheres.end(), 0u);
+
+		std::vector<SphereRange> ranges{ { 0, nrSpheres } };
+		while (!ranges.empty())
+		{
+			const SphereRange range = ranges.back();
+			ranges.pop_back();
+			if (range.count <= primitivePacketWidth)
 			{
-				return true;
+				continue;
 			}
+
+			AABB centerBounds{};
+			for (uint32_t i = range.first; i < range.first + range.count; ++i)
+			{
+				centerBounds.Grow(m_SphereGeometries[m_SpherePacketSpheres[i]].origin);
+			}
+			const Vector3 extent = centerBounds.max - centerBounds.min;
+			const int axis = extent.x > extent.y && extent.x > extent.z ? 0 : (extent.y > extent.z ? 1 : 2);
+
+			//The left part is rounded to whole packets, so only the very last packet can be partly filled
+			const uint32_t leftCount = (range.count / primitivePacketWidth + 1) / 2 * primitivePacketWidth;
+			const auto first = m_SpherePacketSpheres.begin() + range.first;
+			std::nth_element(first, first + leftCount, first + range.count, [this, axis](uint32_t a, uint32_t b)
+				{
+					return m_SphereGeometries[a].origin[axis] < m_SphereGeometries[b].origin[axis];
+				});
+			ranges.push_back({ range.first, leftCount });
+			ranges.push_back({ range.first + leftCount, range.count - leftCount });
 		}
-		for (int i = 0; i < m_TriangleMeshGeometries.size(); i++)
+
+		m_SpherePackets.assign((nrSpheres + primitivePacketWidth - 1) / primitivePacketWidth, {});
+		UpdateSpherePackets();
+	}
+
+	//Keeps the packing, only copies moved or resized spheres into their lanes
+	void Scene::UpdateSpherePackets()
+	{
+		for (uint32_t i = 0; i < m_SpherePacketSpheres.size(); ++i)
+		{
+			m_SpherePackets[i / primitivePacketWidth].SetLane(i % primitivePacketWidth, m_SphereGeometries[m_SpherePacketSpheres[i]]);
+		}
+	}
+
+	void Scene::UpdatePlanePackets()
+	{
+		m_PlanePackets.assign((m_PlaneGeometries.size() + primitivePacketWidth - 1) / primitivePacketWidth, {});
+		for (uint32_t i = 0; i < m_PlaneGeometries.size(); ++i)
 		{
-			if (GeometryUtils::HitTest_TriangleMesh(m_TriangleMeshGeometries[i], ray))
+			m_PlanePackets[i / primitivePacketWidth].SetLane(i % primitivePacketWidth, m_PlaneGeometries[i]);
+		}
+	}
+
+	uint32_t Scene::GetNumBoundedPrimitives() const
+	{
+		uint32_t numPrimitives = static_cast<uint32_t>((m_SphereGeometries.size() + primitivePacketWidth - 1) / primitivePacketWidth + m_Triangles.size());
+		for (const TriangleMeshInstance& instance : m_TriangleMeshInstances)
+		{
+			if (!m_TriangleMeshGeometries[instance.meshIndex].indices.empty())
 			{
-				return true;
+				++numPrimitives;
 			}
 		}
-		
-		return false;
+		for (const SphereSet& sphereSet : m_SphereSets)
+		{
+			if (sphereSet.sphereCount > 0)
+			{
+				++numPrimitives;
+			}
+		}
+		return numPrimitives;
+	}
+
+	AABB Scene::GetPrimitiveBounds(const PrimitiveRef& primitive) const
+	{
+		AABB bounds{};
+		switch (primitive.type)
+		{
+		case PrimitiveType::SpherePacket:
+		{
+			const uint32_t firstSlot = primitive.index * primitivePacketWidth;
+			const uint32_t slotEnd = std::min(firstSlot + primitivePacketWidth, static_cast<uint32_t>(m_SpherePacketSpheres.size()));
+			for (uint32_t slot = firstSlot; slot < slotEnd; ++slot)
+			{
+				const Sphere& sphere = m_SphereGeometries[m_SpherePacketSpheres[slot]];
+				bounds.Grow(sphere.origin - Vector3::One * sphere.radius);
+				bounds.Grow(sphere.origin + Vector3::One * sphere.radius);
+			}
+			break;
+		}
+		case PrimitiveType::Triangle:
+		{
+			const Triangle& triangle = m_Triangles[primitive.index];
+			bounds.Grow(triangle.v0);
+			bounds.Grow(triangle.v1);
+			bounds.Grow(triangle.v2);
+			break;
+		}
+		case PrimitiveType::TriangleMeshInstance:
+		{
+			const TriangleMeshInstance& instance = m_TriangleMeshInstances[primitive.index];
+			const TriangleMesh& mesh = m_TriangleMeshGeometries[instance.meshIndex];
+			bounds = instance.GetTransformedAABB(mesh.minAABB, mesh.maxAABB);
+			break;
+		}
+		case PrimitiveType::SphereSet:
+			bounds = { m_SphereSets[primitive.index].minAABB, m_SphereSets[primitive.index].maxAABB };
+			break;
+		default:
+			break;
+		}
+		return bounds;
+	}
+
+	void Scene::BuildTopLevelBVH()
+	{
+		m_TopLevelPrimitives.clear();
+		BuildSpherePackets();
+		for (uint32_t i = 0; i < m_SpherePackets.size(); ++i)
+		{
+			m_TopLevelPrimitives.push_back({ i, PrimitiveType::SpherePacket });
+		}
+		for (uint32_t i = 0; i < m_Triangles.size(); ++i)
+		{
+			m_TopLevelPrimitives.push_back({ i, PrimitiveType::Triangle });
+		}
+		for (uint32_t i = 0; i < m_TriangleMeshInstances.size(); ++i)
+		{
+			if (!m_TriangleMeshGeometries[m_TriangleMeshInstances[i].meshIndex].indices.empty())
+			{
+				m_TopLevelPrimitives.push_back({ i, PrimitiveType::TriangleMeshInstance });
+			}
+		}
+		for (uint32_t i = 0; i < m_SphereSets.size(); ++i)
+		{
+			if (m_SphereSets[i].sphereCount > 0)
+			{
+				m_TopLevelPrimitives.push_back({ i, PrimitiveType::SphereSet });
+			}
+		}
+
+		const uint32_t numPrimitives = static_cast<uint32_t>(m_TopLevelPrimitives.size());
+		m_TopLevelBVHNodesUsed = 0;
+		if (numPrimitives == 0)
+		{
+			return;
+		}
+
+		m_TopLevelPrimitiveBounds.resize(numPrimitives);
+		for (uint32_t i = 0; i < numPrimitives; ++i)
+		{
+			m_TopLevelPrimitiveBounds[i] = GetPrimitiveBounds(m_TopLevelPrimitives[i]);
+		}
+
+		m_TopLevelBVHNodes.resize(2 * numPrimitives - 1);
+		TLASNode& root = m_TopLevelBVHNodes[0];
+		root.leftChild = 0;
+		root.firstPrimitive = 0;
+		root.primitiveCount = numPrimitives;
+		m_TopLevelBVHNodesUsed = 1;
+
+		UpdateTopLevelNodeBounds(0);
+		SubdivideTopLevelNode(0);
+	}
+
+	void Scene::RefitTopLevelBVH()
+	{
+		UpdateSpherePackets();
+		for (uint32_t i = 0; i < m_TopLevelPrimitives.size(); ++i)
+		{
+			m_TopLevelPrimitiveBounds[i] = GetPrimitiveBounds(m_TopLevelPrimitives[i]);
+		}
+
+		//Children are always allocated after their parent, so walking backwards visits them first
+		for (int nodeIndx = static_cast<int>(m_TopLevelBVHNodesUsed) - 1; nodeIndx >= 0; --nodeIndx)
+		{
+			TLASNode& node = m_TopLevelBVHNodes[nodeIndx];
+			if (node.IsLeaf())
+			{
+				UpdateTopLevelNodeBounds(nodeIndx);
+				continue;
+			}
+			const TLASNode& leftChild = m_TopLevelBVHNodes[node.leftChild];
+			const TLASNode& rightChild = m_TopLevelBVHNodes[node.leftChild + 1];
+			node.aabbMin = Vector3::Min(leftChild.aabbMin, rightChild.aabbMin);
+			node.aabbMax = Vector3::Max(leftChild.aabbMax, rightChild.aabbMax);
+		}
+	}
+
+	void Scene::UpdateTopLevelNodeBounds(uint32_t nodeIndx)
+	{
+		TLASNode& node = m_TopLevelBVHNodes[nodeIndx];
+		AABB bounds{};
+		for (uint32_t i = node.firstPrimitive; i < node.firstPrimitive + node.primitiveCount; ++i)
+		{
+			bounds.Grow(m_TopLevelPrimitiveBounds[i]);
+		}
+		node.aabbMin = bounds.min;
+		node.aabbMax = bounds.max;
+	}
+
+	void Scene::SubdivideTopLevelNode(uint32_t nodeIndx)
+	{
+		TLASNode& node = m_TopLevelBVHNodes[nodeIndx];
+		if (node.primitiveCount <= 1)
+		{
+			return;
+		}
+
+		int axis{};
+		float splitPos{};
+		const float cost = FindBestTopLevelSplitPlane(node, axis, splitPos);
+		const Vector3 boxSize = node.aabbMax - node.aabbMin;
+		const float noSplitCost = node.primitiveCount * (boxSize.x * boxSize.y + boxSize.y * boxSize.z + boxSize.z * boxSize.x);
+		if (cost >= noSplitCost)
+		{
+			return;
+		}
+
+		uint32_t i = node.firstPrimitive;
+		uint32_t j = i + node.primitiveCount;
+		while (i < j)
+		{
+			const AABB& bounds = m_TopLevelPrimitiveBounds[i];
+			if ((bounds.min[axis] + bounds.max[axis]) * 0.5f < splitPos)
+			{
+				++i;
+			}
+			else
+			{
+				--j;
+				std::swap(m_TopLevelPrimitives[i], m_TopLevelPrimitives[j]);
+				std::swap(m_TopLevelPrimitiveBounds[i], m_TopLevelPrimitiveBounds[j]);
+			}
+		}
+
+		const uint32_t leftCount = i - node.firstPrimitive;
+		if (leftCount == 0 || leftCount == node.primitiveCount)
+		{
+			return;
+		}
+
+		const uint32_t leftChildIndx = m_TopLevelBVHNodesUsed++;
+		const uint32_t rightChildIndx = m_TopLevelBVHNodesUsed++;
+		m_TopLevelBVHNodes[leftChildIndx].firstPrimitive = node.firstPrimitive;
+		m_TopLevelBVHNodes[leftChildIndx].primitiveCount = leftCount;
+		m_TopLevelBVHNodes[rightChildIndx].firstPrimitive = i;
+		m_TopLevelBVHNodes[rightChildIndx].primitiveCount = node.primitiveCount - leftCount;
+		node.leftChild = leftChildIndx;
+		node.primitiveCount = 0;
+
+		UpdateTopLevelNodeBounds(leftChildIndx);
+		UpdateTopLevelNodeBounds(rightChildIndx);
+
+		SubdivideTopLevelNode(leftChildIndx);
+		SubdivideTopLevelNode(rightChildIndx);
+	}
+
+	float Scene::FindBestTopLevelSplitPlane(const TLASNode& node, int& axis, float& splitPos) const
+	{
+		constexpr int nrBins = 8;
+
+		float bestCost = FLT_MAX;
+		for (int a = 0; a < 3; a++)
+		{
+			float boundsMin = FLT_MAX;
+			float boundsMax = -FLT_MAX;
+			for (uint32_t i = node.firstPrimitive; i < node.firstPrimitive + node.primitiveCount; ++i)
+			{
+				const AABB& bounds = m_TopLevelPrimitiveBounds[i];
+				const float centroid = (bounds.min[a] + bounds.max[a]) * 0.5f;
+				boundsMin = std::min(centroid, boundsMin);
+				boundsMax = std::max(centroid, boundsMax);
+			}
+			if (boundsMax - boundsMin < FLT_EPSILON)
+			{
+				continue;
+			}
+
+			Bin bins[nrBins];
+			const float scale = nrBins / (boundsMax - boundsMin);
+			for (uint32_t i = node.firstPrimitive; i < node.firstPrimitive + node.primitiveCount; ++i)
+			{
+				const AABB& bounds = m_TopLevelPrimitiveBounds[i];
+				const float centroid = (bounds.min[a] + bounds.max[a]) * 0.5f;
+				const int binIdx{ std::min(nrBins - 1, static_cast<int>((centroid - boundsMin) * scale)) };
+				++bins[binIdx].indicesCount;
+				bins[binIdx].bounds.Grow(bounds);
+			}
+
+			float leftArea[nrBins - 1]{};
+			float rightArea[nrBins - 1]{};
+			int leftCount[nrBins - 1]{};
+			int rightCount[nrBins - 1]{};
+			AABB leftBox{};
+			AABB rightBox{};
+			int leftSum{};
+			int rightSum{};
+			for (int i = 0; i < nrBins - 1; ++i)
+			{
+				leftSum += bins[i].indicesCount;
+				leftCount[i] = leftSum;
+				leftBox.Grow(bins[i].bounds);
+				leftArea[i] = leftBox.GetArea();
+
+				rightSum += bins[nrBins - 1 - i].indicesCount;
+				rightCount[nrBins - 2 - i] = rightSum;
+				rightBox.Grow(bins[nrBins - 1 - i].bounds);
+				rightArea[nrBins - 2 - i] = rightBox.GetArea();
+			}
+
+			const float binWidth = (boundsMax - boundsMin) / nrBins;
+			for (int i = 0; i < nrBins - 1; ++i)
+			{
+				if (leftCount[i] == 0 || rightCount[i] == 0)
+				{
+					continue;
+				}
+				const float planeCost{ leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i] };
+				if (planeCost < bestCost)
+				{
+					splitPos = boundsMin + binWidth * (i + 1);
+					axis = a;
+					bestCost = planeCost;
+				}
+			}
+		}
+		return bestCost;
+	}
+#pragma endregion
+
+	void Scene::ToggleBackgroundMeshBuilds()
+	{
+		m_UseBackgroundMeshBuilds = !m_UseBackgroundMeshBuilds;
+		std::cout << "Background mesh builds: " << (m_UseBackgroundMeshBuilds ? "on" : "off") << std::endl;
+	}
+
+	void Scene::PrintMeshStatistics() const
+	{
+		for (size_t i = 0; i < m_TriangleMeshGeometries.size(); ++i)
+		{
+			const TriangleMesh& mesh = m_TriangleMeshGeometries[i];
+			std::cout << "Mesh " << i << ": " << mesh.indices.size() / 3 << " triangles"
+				<< " | geometry: " << mesh.GetGeometryMemory() / 1024.f << " KB"
+				<< " | BVH nodes: " << mesh.GetBVHNodeMemory() / 1024.f << " KB (" << mesh.GetBVHNodeCount() << " used)"
+				<< " | leaf triangles: " << mesh.GetBVHTriangleMemory() / 1024.f << " KB"
+				<< " | BVH: " << (mesh.GetBVHNodeMemory() + mesh.GetBVHTriangleMemory()) / std::max<size_t>(1, mesh.indices.size() / 3) << " bytes/triangle"
+				<< " | BVH build: " << mesh.bvhBuildTimeMs << " ms" << std::endl;
+		}
+		for (size_t i = 0; i < m_SphereSets.size(); ++i)
+		{
+			const SphereSet& sphereSet = m_SphereSets[i];
+			std::cout << "Sphere set " << i << ": " << sphereSet.sphereCount << " spheres"
+				<< " | spheres: " << sphereSet.GetSphereMemory() / 1024.f << " KB"
+				<< " | BVH nodes: " << sphereSet.GetBVHNodeMemory() / 1024.f << " KB (" << sphereSet.bvhNodesUsed << " used)"
+				<< " | BVH build: " << sphereSet.bvhBuildTimeMs << " ms" << std::endl;
+		}
 	}
 
 #pragma region Scene Helpers
@@ -103,16 +636,79 @@ namespace dae {
 		return &m_PlaneGeometries.back();
 	}
 
-	TriangleMesh* Scene::AddTriangleMesh(TriangleCullMode cullMode, unsigned char materialIndex)
+	TriangleMesh* Scene::AddTriangleMesh()
 	{
-		TriangleMesh m{};
-		m.cullMode = cullMode;
-		m.materialIndex = materialIndex;
-
-		m_TriangleMeshGeometries.emplace_back(m);
+		m_TriangleMeshGeometries.emplace_back();
 		return &m_TriangleMeshGeometries.back();
 	}
 
+	TriangleMeshInstance* Scene::AddTriangleMeshInstance(const TriangleMesh* pMesh, TriangleCullMode cullMode, unsigned char materialIndex)
+	{
+		TriangleMeshInstance i;
+		i.meshIndex = static_cast<uint32_t>(pMesh - m_TriangleMeshGeometries.data());
+		i.cullMode = cullMode;
+		i.materialIndex = materialIndex;
+
+		m_TriangleMeshInstances.emplace_back(i);
+		return &m_TriangleMeshInstances.back();
+	}
+
+	bool Scene::UpdateTriangleMesh(uint32_t meshIndex, std::vector<Vector3>&& positions)
+	{
+		if (m_MeshRebuilds.size() <= meshIndex)
+		{
+			m_MeshRebuilds.resize(meshIndex + 1);
+		}
+		std::unique_ptr<MeshRebuild>& pRebuild = m_MeshRebuilds[meshIndex];
+		if (pRebuild && pRebuild->buildTask.valid())
+		{
+			if (m_UseBackgroundMeshBuilds)
+			{
+				return false;
+			}
+			//An older shape that is still building must not be swapped in over this one
+			pRebuild->buildTask.get();
+		}
+
+		TriangleMesh& mesh = m_TriangleMeshGeometries[meshIndex];
+		if (!m_UseBackgroundMeshBuilds)
+		{
+			mesh.positions = std::move(positions);
+			mesh.CalculateNormals();
+			mesh.UpdateBVH();
+			return true;
+		}
+
+		if (!pRebuild)
+		{
+			pRebuild = std::make_unique<MeshRebuild>();
+		}
+		TriangleMesh& backMesh = pRebuild->mesh;
+		backMesh.CopyBVHSettings(mesh);
+		backMesh.positions = std::move(positions);
+		backMesh.indices = mesh.indices;
+		backMesh.normals.resize(mesh.normals.size());
+		pRebuild->buildTask = std::async(std::launch::async, [&backMesh]()
+			{
+				backMesh.CalculateNormals();
+				backMesh.UpdateBVH();
+			});
+		return true;
+	}
+
+	SphereSet* Scene::AddSphereSet(const SphereRecord* pSpheres, uint32_t count, unsigned char materialIndex)
+	{
+		SphereSet& sphereSet = m_SphereSets.emplace_back();
+		sphereSet.materialIndex = materialIndex;
+		sphereSet.Build(pSpheres, count);
+		return &sphereSet;
+	}
+
+	void Scene::UpdateSphereSet(uint32_t setIndex, const SphereRecord* pSpheres)
+	{
+		m_SphereSets[setIndex].Update(pSpheres);
+	}
+
 	Light* Scene::AddPointLight(const Vector3& origin, float intensity, const ColorRGB& color)
 	{
 		Light l;
@@ -261,11 +857,21 @@ namespace dae {
 		AddPlane(Vector3{ 5.f, 0.f, 0.f }, Vector3{ -1.f, 0.f, 0.f }, matLambert_GrayBlue);; //Right
 		AddPlane(Vector3{ -5.f, 0.f, 0.f }, Vector3{ 1.f, 0.f, 0.f }, matLambert_GrayBlue);; //Left
 
-		m_pMesh = AddTriangleMesh(TriangleCullMode::BackFaceCulling, matLambert_White);
-		Utils::ParseOBJ("Resources/lowpoly_bunny2.obj", m_pMesh->positions, m_pMesh->normals, m_pMesh->indices);
-		m_pMesh->Scale({ 2.f,2.f,2.f });
-		m_pMesh->UpdateTransforms();
-		m_pMesh->UpdateAABB();
+		const std::string meshPath{ "Resources/lowpoly_bunny2.obj" };
+		TriangleMesh* pMesh = AddTriangleMesh();
+		pMesh->bvhLayout = BVHLayout::Wide8;
+		pMesh->leafLayout = LeafLayout::Packet8;
+		if (!MeshCache::Load(meshPath, *pMesh))
+		{
+			Utils::ParseOBJ(meshPath, pMesh->positions, pMesh->normals, pMesh->indices);
+			GeometryUtils::AutoTuneBVH(*pMesh);
+			MeshCache::Save(meshPath, *pMesh);
+		}
+		m_RestPositions = pMesh->positions;
+
+		m_pMeshInstance = AddTriangleMeshInstance(pMesh, TriangleCullMode::BackFaceCulling, matLambert_White);
+		m_pMeshInstance->Scale({ 2.f,2.f,2.f });
+		m_pMeshInstance->UpdateTransforms();
 
 		//Light
 		AddPointLight(Vector3{ 0.f, 5.f, 5.f }, 50.f, ColorRGB{ 1.f, 0.61f, .45f });//backLight
@@ -275,8 +881,29 @@ namespace dae {
 	void Scene_W4::Update(dae::Timer* pTimer)
 	{
 		Scene::Update(pTimer);
-		m_pMesh->RotateY(PI_DIV_2 * pTimer->GetTotal());
-		m_pMesh->UpdateTransforms();
+		m_pMeshInstance->RotateY(PI_DIV_2 * pTimer->GetTotal());
+		m_pMeshInstance->UpdateTransforms();
+
+		//Keeps sending shapes until the rest shape went through after the deformation was switched off
+		if (m_IsShapeDirty)
+		{
+			const float amplitude = m_IsDeforming ? 0.05f : 0.f;
+			std::vector<Vector3> positions{ m_RestPositions };
+			for (Vector3& position : positions)
+			{
+				position.y += amplitude * sinf(6.f * position.x + 4.f * pTimer->GetTotal());
+			}
+			if (UpdateTriangleMesh(m_pMeshInstance->meshIndex, std::move(positions)))
+			{
+				m_IsShapeDirty = m_IsDeforming;
+			}
+		}
+	}
+	void Scene_W4::ToggleMeshDeformation()
+	{
+		m_IsDeforming = !m_IsDeforming;
+		m_IsShapeDirty = true;
+		std::cout << "Mesh deformation: " << (m_IsDeforming ? "on" : "off") << std::endl;
 	}
 	void Scene_W4_Ref::Initialize()
 	{
@@ -311,24 +938,21 @@ namespace dae {
 
 		const Triangle baseTriangle = { Vector3(-0.75f, 1.5f, 0.0f), Vector3(0.75f, 0.0f, 0.0f), Vector3(-0.75f, 0.0f, 0.0f) };
 
-		m_pMeshes[0] = AddTriangleMesh(TriangleCullMode::BackFaceCulling, matLambert_White);
-		m_pMeshes[0]->AppendTriangle(baseTriangle, true);
+		//One mesh shared by three instances, each with its own cull mode
+		TriangleMesh* pTriangleMesh = AddTriangleMesh();
+		pTriangleMesh->AppendTriangle(baseTriangle);
 
-		m_pMeshes[0]->Translate({ -1.75f, 4.5f, 0.0f });
-		m_pMeshes[0]->UpdateAABB();
-		m_pMeshes[0]->UpdateTransforms();
+		m_pMeshInstances[0] = AddTriangleMeshInstance(pTriangleMesh, TriangleCullMode::BackFaceCulling, matLambert_White);
+		m_pMeshInstances[0]->Translate({ -1.75f, 4.5f, 0.0f });
+		m_pMeshInstances[0]->UpdateTransforms();
 
-		m_pMeshes[1] = AddTriangleMesh(TriangleCullMode::FrontFaceCulling, matLambert_White);
-		m_pMeshes[1]->AppendTriangle(baseTriangle, true);
-		m_pMeshes[1]->Translate({ 0.0f, 4.5f, 0.0f });
-		m_pMeshes[1]->UpdateAABB();
-		m_pMeshes[1]->UpdateTransforms();
+		m_pMeshInstances[1] = AddTriangleMeshInstance(pTriangleMesh, TriangleCullMode::FrontFaceCulling, matLambert_White);
+		m_pMeshInstances[1]->Translate({ 0.0f, 4.5f, 0.0f });
+		m_pMeshInstances[1]->UpdateTransforms();
 
-		m_pMeshes[2] = AddTriangleMesh(TriangleCullMode::NoCulling, matLambert_White);
-		m_pMeshes[2]->AppendTriangle(baseTriangle, true);
-		m_pMeshes[2]->Translate({ 1.75f, 4.5f, 0.0f });
-		m_pMeshes[2]->UpdateAABB();
-		m_pMeshes[2]->UpdateTransforms();
+		m_pMeshInstances[2] = AddTriangleMeshInstance(pTriangleMesh, TriangleCullMode::NoCulling, matLambert_White);
+		m_pMeshInstances[2]->Translate({ 1.75f, 4.5f, 0.0f });
+		m_pMeshInstances[2]->UpdateTransforms();
 
 		//Light
 		AddPointLight(Vector3{ 0.0f, 5.0f, 5.0f }, 50.f, ColorRGB{ 1.0f, 0.61f, 0.45f }); // Backlight
@@ -338,10 +962,10 @@ namespace dae {
 	void Scene_W4_Ref::Update(dae::Timer* pTimer)
 	{
 		Scene::Update(pTimer);
-		for (TriangleMesh* pMesh : m_pMeshes)
+		for (TriangleMeshInstance* pMeshInstance : m_pMeshInstances)
 		{
-			pMesh->RotateY(PI_DIV_2 * pTimer->GetTotal());
-			pMesh->UpdateTransforms();
+			pMeshInstance->RotateY(PI_DIV_2 * pTimer->GetTotal());
+			pMeshInstance->UpdateTransforms();
 		}
 	}
 #pragma endregion
@@ -1,4 +1,6 @@
 #pragma once
+#include <future>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -37,6 +39,11 @@ namespace dae
 		void GetClosestHit(const Ray& ray, HitRecord& closestHit) const;
 		bool DoesHit(const Ray& ray) const;
 
+		//Swaps in meshes rebuilt in the background, then rebuilds the top-level BVH when objects were added or removed, refits it otherwise
+		void UpdateTopLevelBVH();
+		void PrintMeshStatistics() const;
+		void ToggleBackgroundMeshBuilds();
+
 		const std::vector<Plane>& GetPlaneGeometries() const { return m_PlaneGeometries; }
 		const std::vector<Sphere>& GetSphereGeometries() const { return m_SphereGeometries; }
 		const std::vector<Light>& GetLights() const { return m_Lights; }
@@ -49,18 +56,71 @@ namespace dae
 		std::vector<Sphere> m_SphereGeometries{};
 		std::vector<Triangle> m_Triangles{};
 		std::vector<TriangleMesh> m_TriangleMeshGeometries{};
+		std::vector<TriangleMeshInstance> m_TriangleMeshInstances{};
+		std::vector<SphereSet> m_SphereSets{};
 		std::vector<Light> m_Lights{};
 		std::vector<Material*> m_Materials{};
 
 		Camera m_Camera{};
 
+		//Spheres and planes are tested primitivePacketWidth at a time. The sphere packets group spheres close together
+		//and are the top-level BVH primitives, m_SpherePacketSpheres holds the sphere of every lane, packet * primitivePacketWidth + lane.
+		//Both are refreshed from m_SphereGeometries and m_PlaneGeometries by UpdateTopLevelBVH.
+		static constexpr int primitivePacketWidth{ 8 };
+		std::vector<SpherePacket<primitivePacketWidth>> m_SpherePackets{};
+		std::vector<uint32_t> m_SpherePacketSpheres{};
+		std::vector<PlanePacket<primitivePacketWidth>> m_PlanePackets{};
+
+		//Top-level BVH over all bounded objects, planes are infinite and tested separately
+		std::vector<PrimitiveRef> m_TopLevelPrimitives{};
+		std::vector<AABB> m_TopLevelPrimitiveBounds{};
+		std::vector<TLASNode> m_TopLevelBVHNodes{};
+		uint32_t m_TopLevelBVHNodesUsed{};
+
 		Sphere* AddSphere(const Vector3& origin, float radius, unsigned char materialIndex = 0);
 		Plane* AddPlane(const Vector3& origin, const Vector3& normal, unsigned char materialIndex = 0);
-		TriangleMesh* AddTriangleMesh(TriangleCullMode cullMode, unsigned char materialIndex = 0);
+		TriangleMesh* AddTriangleMesh();
+		TriangleMeshInstance* AddTriangleMeshInstance(const TriangleMesh* pMesh, TriangleCullMode cullMode, unsigned char materialIndex = 0);
+		//Gives a deforming mesh new vertex positions and rebuilds its normals and BVH. With background builds (the default)
+		//the rebuild runs on its own thread into a second copy of the mesh while frames keep rendering the current one,
+		//UpdateTopLevelBVH swaps it in at the first frame boundary after it finished.
+		//Returns false, without using the positions, while the previous rebuild of the mesh is still running.
+		bool UpdateTriangleMesh(uint32_t meshIndex, std::vector<Vector3>&& positions);
+		//Adds count spheres from one contiguous buffer as a single set with its own BVH and material, for scenes with far more spheres
+		//than AddSphere is meant for. The set is one primitive of the top-level BVH however many spheres it holds.
+		SphereSet* AddSphereSet(const SphereRecord* pSpheres, uint32_t count, unsigned char materialIndex = 0);
+		//Moves the spheres of a set to pSpheres, count records in the order they were added, and refits its BVH.
+		//Refitting keeps the tree built for the first positions, call SphereSet::Build instead once the spheres moved far from them.
+		void UpdateSphereSet(uint32_t setIndex, const SphereRecord* pSpheres);
 
 		Light* AddPointLight(const Vector3& origin, float intensity, const ColorRGB& color);
 		Light* AddDirectionalLight(const Vector3& direction, float intensity, const ColorRGB& color);
 		unsigned char AddMaterial(Material* pMaterial);
+
+	private:
+		//Back buffer of a mesh rebuilt in the background, the task is declared last so it is joined before the mesh is destroyed
+		struct MeshRebuild
+		{
+			TriangleMesh mesh{};
+			std::future<void> buildTask{};
+		};
+		std::vector<std::unique_ptr<MeshRebuild>> m_MeshRebuilds{};
+		bool m_UseBackgroundMeshBuilds{ true };
+
+		void SwapRebuiltMeshes();
+		void BuildSpherePackets();
+		void UpdateSpherePackets();
+		void UpdatePlanePackets();
+		uint32_t GetNumBoundedPrimitives() const;
+		AABB GetPrimitiveBounds(const PrimitiveRef& primitive) const;
+		void BuildTopLevelBVH();
+		void RefitTopLevelBVH();
+		void UpdateTopLevelNodeBounds(uint32_t nodeIndx);
+		void SubdivideTopLevelNode(uint32_t nodeIndx);
+		float FindBestTopLevelSplitPlane(const TLASNode& node, int& axis, float& splitPos) const;
+		bool HitTest_Primitive(const PrimitiveRef& primitive, const Ray& ray, HitRecord& hitRecord) const;
+		bool HitTest_Primitive(const PrimitiveRef& primitive, const Ray& ray) const;
+		void FinalizeHit(const Ray& ray, HitRecord& hitRecord) const;
 	};
 
 	//+++++++++++++++++++++++++++++++++++++++++
@@ -123,8 +183,14 @@ namespace dae
 
 		void Initialize() override;
 		void Update(dae::Timer* pTimer) override;
+		void ToggleMeshDeformation();
 	private:
-		TriangleMesh* m_pMesh{ nullptr };
+		TriangleMeshInstance* m_pMeshInstance{ nullptr };
+
+		//Ripples the bunny every frame, which needs a new mesh BVH per frame
+		std::vector<Vector3> m_RestPositions{};
+		bool m_IsDeforming{ false };
+		bool m_IsShapeDirty{ false };
 	};
 	class Scene_W4_Ref final : public Scene
 	{
@@ -140,6 +206,6 @@ namespace dae
 		void Initialize() override;
 		void Update(dae::Timer* pTimer) override;
 	private:
-		TriangleMesh* m_pMeshes[3]{};
+		TriangleMeshInstance* m_pMeshInstances[3]{};
 	};
 }
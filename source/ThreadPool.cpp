@@ -0,0 +1,99 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+using namespace dae;
+
+ThreadPool::ThreadPool(uint32_t numThreads)
+{
+	numThreads = std::max(1u, numThreads);
+	m_Workers.reserve(numThreads - 1);
+	for (uint32_t i = 1; i < numThreads; ++i)
+	{
+		m_Workers.emplace_back(&ThreadPool::WorkerLoop, this);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard lock{ m_Mutex };
+		m_IsStopping = true;
+	}
+	m_WakeCondition.notify_all();
+
+	for (std::thread& worker : m_Workers)
+	{
+		worker.join();
+	}
+}
+
+void ThreadPool::ParallelFor(uint32_t count, const std::function<void(uint32_t)>& task)
+{
+	if (count == 0)
+	{
+		return;
+	}
+	if (m_Workers.empty() || count == 1)
+	{
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			task(i);
+		}
+		return;
+	}
+
+	{
+		std::lock_guard lock{ m_Mutex };
+		m_pTask = &task;
+		m_TaskCount = count;
+		m_NextTask.store(0, std::memory_order_relaxed);
+		m_BusyWorkers = static_cast<uint32_t>(m_Workers.size());
+		++m_Generation;
+	}
+	m_WakeCondition.notify_all();
+
+	RunTasks();
+
+	std::unique_lock lock{ m_Mutex };
+	m_DoneCondition.wait(lock, [this] { return m_BusyWorkers == 0; });
+	m_pTask = nullptr;
+}
+
+void ThreadPool::WorkerLoop()
+{
+	uint64_t lastGeneration{};
+	while (true)
+	{
+		{
+			std::unique_lock lock{ m_Mutex };
+			m_WakeCondition.wait(lock, [&] { return m_IsStopping || m_Generation != lastGeneration; });
+			if (m_IsStopping)
+			{
+				return;
+			}
+			lastGeneration = m_Generation;
+		}
+
+		RunTasks();
+
+		std::lock_guard lock{ m_Mutex };
+		if (--m_BusyWorkers == 0)
+		{
+			m_DoneCondition.notify_one();
+		}
+	}
+}
+
+void ThreadPool::RunTasks()
+{
+	while (true)
+	{
+		const uint32_t taskIndex = m_NextTask.fetch_add(1, std::memory_order_relaxed);
+		if (taskIndex >= m_TaskCount)
+		{
+			return;
+		}
+		(*m_pTask)(taskIndex);
+	}
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace dae
+{
+	//Persistent pool of worker threads, created once and parked on a condition variable between dispatches.
+	//The calling thread takes part in every dispatch, so a pool of N threads only spawns N - 1 workers.
+	class ThreadPool final
+	{
+	public:
+		explicit ThreadPool(uint32_t numThreads = std::thread::hardware_concurrency());
+		~ThreadPool();
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool(ThreadPool&&) noexcept = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+		ThreadPool& operator=(ThreadPool&&) noexcept = delete;
+
+		uint32_t GetNumThreads() const { return static_cast<uint32_t>(m_Workers.size()) + 1; }
+
+		//Runs task(index) for every index in [0, count) and blocks until all of them finished.
+		//Not re-entrant: a task must not dispatch on the same pool.
+		void ParallelFor(uint32_t count, const std::function<void(uint32_t)>& task);
+
+	private:
+		void WorkerLoop();
+		void RunTasks();
+
+		std::vector<std::thread> m_Workers{};
+
+		std::mutex m_Mutex{};
+		std::condition_variable m_WakeCondition{};
+		std::condition_variable m_DoneCondition{};
+
+		const std::function<void(uint32_t)>* m_pTask{};
+		uint32_t m_TaskCount{};
+		std::atomic<uint32_t> m_NextTask{};
+		uint64_t m_Generation{};
+		uint32_t m_BusyWorkers{};
+		bool m_IsStopping{ false };
+	};
+}
@@ -0,0 +1,111 @@
+#include "TileScheduler.h"
+
+#include <algorithm>
+
+using namespace dae;
+
+void TileScheduler::SetTileSize(uint32_t width, uint32_t height)
+{
+	m_TileWidth = std::max(1u, width);
+	m_TileHeight = std::max(1u, height);
+}
+
+void TileScheduler::BeginFrame(uint32_t frameWidth, uint32_t frameHeight, uint32_t numWorkers)
+{
+	numWorkers = std::max(1u, numWorkers);
+	if (numWorkers != m_NumWorkers)
+	{
+		m_pQueues = std::make_unique<WorkerQueue[]>(numWorkers);
+		m_NumWorkers = numWorkers;
+	}
+
+	//Tiles are stored row-major so every worker starts with a coherent band of the image
+	m_Tiles.clear();
+	for (uint32_t y = 0; y < frameHeight; y += m_TileHeight)
+	{
+		for (uint32_t x = 0; x < frameWidth; x += m_TileWidth)
+		{
+			m_Tiles.push_back({ x, y, std::min(m_TileWidth, frameWidth - x), std::min(m_TileHeight, frameHeight - y) });
+		}
+	}
+
+	const uint32_t numTiles = static_cast<uint32_t>(m_Tiles.size());
+	uint32_t currentTile{};
+	for (uint32_t workerId = 0; workerId < m_NumWorkers; ++workerId)
+	{
+		WorkerQueue& queue = m_pQueues[workerId];
+		queue.tiles.clear();
+		queue.tilesStolen = 0;
+
+		const uint32_t tileEnd = static_cast<uint32_t>((uint64_t(numTiles) * (workerId + 1)) / m_NumWorkers);
+		for (; currentTile < tileEnd; ++currentTile)
+		{
+			queue.tiles.push_back(currentTile);
+		}
+	}
+
+	m_FrameStart = Clock::now();
+}
+
+void TileScheduler::EndFrame()
+{
+	const Clock::time_point frameEnd = Clock::now();
+	const auto toMs = [](Clock::duration duration)
+	{
+		return std::chrono::duration<float, std::milli>(duration).count();
+	};
+
+	m_FrameStats.numWorkers = m_NumWorkers;
+	m_FrameStats.tilesTotal = static_cast<uint32_t>(m_Tiles.size());
+	m_FrameStats.tilesStolen = 0;
+	m_FrameStats.frameTimeMs = toMs(frameEnd - m_FrameStart);
+	m_FrameStats.avgIdleTimeMs = 0.f;
+	m_FrameStats.maxIdleTimeMs = 0.f;
+	m_FrameStats.workerIdleTimeMs.resize(m_NumWorkers);
+
+	for (uint32_t workerId = 0; workerId < m_NumWorkers; ++workerId)
+	{
+		const WorkerQueue& queue = m_pQueues[workerId];
+
+		//Idle = waiting to be scheduled + waiting for the other workers after running out of tiles
+		const float idleTime = toMs(queue.startTime - m_FrameStart) + toMs(frameEnd - queue.finishTime);
+		m_FrameStats.workerIdleTimeMs[workerId] = idleTime;
+		m_FrameStats.avgIdleTimeMs += idleTime;
+		m_FrameStats.maxIdleTimeMs = std::max(m_FrameStats.maxIdleTimeMs, idleTime);
+		m_FrameStats.tilesStolen += queue.tilesStolen;
+	}
+	m_FrameStats.avgIdleTimeMs /= m_NumWorkers;
+}
+
+bool TileScheduler::PopTile(uint32_t workerId, uint32_t& tileIndex)
+{
+	WorkerQueue& queue = m_pQueues[workerId];
+	std::lock_guard lock{ queue.mutex };
+	if (queue.tiles.empty())
+	{
+		return false;
+	}
+	tileIndex = queue.tiles.front();
+	queue.tiles.pop_front();
+	return true;
+}
+
+bool TileScheduler::StealTile(uint32_t workerId, uint32_t& tileIndex)
+{
+	for (uint32_t offset = 1; offset < m_NumWorkers; ++offset)
+	{
+		WorkerQueue& victim = m_pQueues[(workerId + offset) % m_NumWorkers];
+		std::lock_guard lock{ victim.mutex };
+		if (victim.tiles.empty())
+		{
+			continue;
+		}
+		//Steal from the back, furthest away from where the owner is working
+		tileIndex = victim.tiles.back();
+		victim.tiles.pop_back();
+
+		++m_pQueues[workerId].tilesStolen;
+		return true;
+	}
+	return false;
+}
@@ -0,0 +1,97 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace dae
+{
+	struct Tile
+	{
+		uint32_t x{};
+		uint32_t y{};
+		uint32_t width{};
+		uint32_t height{};
+	};
+
+	struct TileFrameStats
+	{
+		uint32_t numWorkers{};
+		uint32_t tilesTotal{};
+		uint32_t tilesStolen{};
+		float frameTimeMs{};
+		float avgIdleTimeMs{};
+		float maxIdleTimeMs{};
+		std::vector<float> workerIdleTimeMs{};
+	};
+
+	//Splits the frame into tiles and hands them out through per-worker deques.
+	//A worker pops tiles from the front of its own deque (keeping neighbouring tiles on the same thread)
+	//and, once that runs dry, steals from the back of the other workers' deques.
+	class TileScheduler final
+	{
+	public:
+		TileScheduler() = default;
+		~TileScheduler() = default;
+
+		TileScheduler(const TileScheduler&) = delete;
+		TileScheduler(TileScheduler&&) noexcept = delete;
+		TileScheduler& operator=(const TileScheduler&) = delete;
+		TileScheduler& operator=(TileScheduler&&) noexcept = delete;
+
+		void SetTileSize(uint32_t width, uint32_t height);
+		uint32_t GetTileWidth() const { return m_TileWidth; }
+		uint32_t GetTileHeight() const { return m_TileHeight; }
+
+		void BeginFrame(uint32_t frameWidth, uint32_t frameHeight, uint32_t numWorkers);
+		void EndFrame();
+
+		//Called once per worker, every worker must have a unique id in [0, numWorkers)
+		template<typename RenderTileFunc>
+		void RunWorker(uint32_t workerId, const RenderTileFunc& renderTile);
+
+		const TileFrameStats& GetFrameStats() const { return m_FrameStats; }
+
+	private:
+		using Clock = std::chrono::high_resolution_clock;
+
+		struct alignas(64) WorkerQueue
+		{
+			std::mutex mutex{};
+			std::deque<uint32_t> tiles{};
+			uint32_t tilesStolen{};
+			Clock::time_point startTime{};
+			Clock::time_point finishTime{};
+		};
+
+		bool PopTile(uint32_t workerId, uint32_t& tileIndex);
+		bool StealTile(uint32_t workerId, uint32_t& tileIndex);
+
+		uint32_t m_TileWidth{ 16 };
+		uint32_t m_TileHeight{ 16 };
+
+		std::vector<Tile> m_Tiles{};
+		std::unique_ptr<WorkerQueue[]> m_pQueues{};
+		uint32_t m_NumWorkers{};
+
+		Clock::time_point m_FrameStart{};
+		TileFrameStats m_FrameStats{};
+	};
+
+	template<typename RenderTileFunc>
+	void TileScheduler::RunWorker(uint32_t workerId, const RenderTileFunc& renderTile)
+	{
+		WorkerQueue& queue = m_pQueues[workerId];
+		queue.startTime = Clock::now();
+
+		uint32_t tileIndex{};
+		while (PopTile(workerId, tileIndex) || StealTile(workerId, tileIndex))
+		{
+			renderTile(m_Tiles[tileIndex]);
+		}
+
+		queue.finishTime = Clock::now();
+	}
+}
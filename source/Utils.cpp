@@ -0,0 +1,318 @@
+#include "Utils.h"
+#include "MappedFile.h"
+
+#include <charconv>
+#include <climits>
+#include <cstring>
+#include <future>
+#include <thread>
+
+using namespace dae;
+
+namespace
+{
+	//The file is split into at most one chunk per hardware thread, each at least this large
+	constexpr size_t minOBJChunkSize{ 1 << 20 };
+
+	//Vertices and triangles of one chunk of the file, merged once every chunk is parsed
+	struct OBJChunk
+	{
+		std::vector<Vector3> positions{};
+		std::vector<int> indices{};
+		//Negative face indices are resolved against the vertices of this chunk, these still need the vertices of the chunks before it
+		std::vector<uint32_t> relativeIndices{};
+		bool isValid{ true };
+	};
+
+	//Runs taskFunc(task) for every task in [0, nrTasks), the first on the calling thread
+	template<typename TaskFunc>
+	void RunTasks(uint32_t nrTasks, const TaskFunc& taskFunc)
+	{
+		std::vector<std::future<void>> tasks{};
+		tasks.reserve(nrTasks - 1);
+		for (uint32_t task = 1; task < nrTasks; ++task)
+		{
+			tasks.push_back(std::async(std::launch::async, taskFunc, task));
+		}
+		taskFunc(0u);
+		for (std::future<void>& task : tasks)
+		{
+			task.get();
+		}
+	}
+
+	bool IsDigit(char c)
+	{
+		return c >= '0' && c <= '9';
+	}
+	//Line ends are not spaces, '\r' is so CRLF files parse the same
+	bool IsSpace(char c)
+	{
+		return c == ' ' || c == '\t' || c == '\r';
+	}
+	const char* SkipSpaces(const char* pChar, const char* pEnd)
+	{
+		while (pChar < pEnd && IsSpace(*pChar))
+		{
+			++pChar;
+		}
+		return pChar;
+	}
+	//Returns the start of the next line
+	const char* SkipLine(const char* pChar, const char* pEnd)
+	{
+		const char* pLineEnd = static_cast<const char*>(std::memchr(pChar, '\n', pEnd - pChar));
+		return pLineEnd ? pLineEnd + 1 : pEnd;
+	}
+
+	//Parses [sign]digits[.digits][(e|E)[sign]digits] and returns the first character after it, or null when there is no number.
+	//Mantissas that fit a float exactly with a power of ten up to 1e10 take one correctly rounded float multiply or divide,
+	//anything longer goes through std::from_chars so every value rounds the same as a standard library parse.
+	const char* ParseFloat(const char* pChar, const char* pEnd, float& value)
+	{
+		static constexpr float powersOf10[]{ 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f };
+		static constexpr uint64_t maxExactMantissa{ 1 << 24 };
+
+		if (pChar < pEnd && *pChar == '+')
+		{
+			++pChar;
+		}
+		const char* pStart = pChar;
+		const bool isNegative = pChar < pEnd && *pChar == '-';
+		if (isNegative)
+		{
+			++pChar;
+		}
+
+		uint64_t mantissa{};
+		int exponent{};
+		int nrDigits{};
+		bool isExact{ true };
+		while (pChar < pEnd && IsDigit(*pChar))
+		{
+			mantissa = mantissa * 10 + (*pChar++ - '0');
+			isExact &= mantissa <= maxExactMantissa;
+			++nrDigits;
+		}
+		if (pChar < pEnd && *pChar == '.')
+		{
+			++pChar;
+			while (pChar < pEnd && IsDigit(*pChar))
+			{
+				mantissa = mantissa * 10 + (*pChar++ - '0');
+				isExact &= mantissa <= maxExactMantissa;
+				--exponent;
+				++nrDigits;
+			}
+		}
+		if (nrDigits == 0)
+		{
+			return nullptr;
+		}
+		if (pChar < pEnd && (*pChar == 'e' || *pChar == 'E'))
+		{
+			const char* pExponent = pChar + 1;
+			const bool isExponentNegative = pExponent < pEnd && *pExponent == '-';
+			if (pExponent < pEnd && (*pExponent == '-' || *pExponent == '+'))
+			{
+				++pExponent;
+			}
+			int writtenExponent{};
+			if (pExponent < pEnd && IsDigit(*pExponent))
+			{
+				while (pExponent < pEnd && IsDigit(*pExponent))
+				{
+					writtenExponent = std::min(writtenExponent * 10 + (*pExponent++ - '0'), 1000);
+				}
+				exponent += isExponentNegative ? -writtenExponent : writtenExponent;
+				pChar = pExponent;
+			}
+		}
+
+		if (!isExact || exponent < -10 || exponent > 10)
+		{
+			const std::from_chars_result result = std::from_chars(pStart, pEnd, value);
+			return result.ec == std::errc{} || result.ec == std::errc::result_out_of_range ? result.ptr : nullptr;
+		}
+		const float magnitude = exponent < 0 ? static_cast<float>(mantissa) / powersOf10[-exponent] : static_cast<float>(mantissa) * powersOf10[exponent];
+		value = isNegative ? -magnitude : magnitude;
+		return pChar;
+	}
+	//Parses [sign]digits, returns null when there is no number or its magnitude is above INT_MAX.
+	//At most 10 digits are read, so magnitude cannot overflow before that check.
+	const char* ParseInt(const char* pChar, const char* pEnd, int64_t& value)
+	{
+		const bool isNegative = pChar < pEnd && *pChar == '-';
+		if (pChar < pEnd && (*pChar == '-' || *pChar == '+'))
+		{
+			++pChar;
+		}
+		const char* pDigits = pChar;
+		int64_t magnitude{};
+		while (pChar < pEnd && IsDigit(*pChar) && pChar - pDigits < 10)
+		{
+			magnitude = magnitude * 10 + (*pChar++ - '0');
+		}
+		if (pChar == pDigits || (pChar < pEnd && IsDigit(*pChar)) || magnitude > INT_MAX)
+		{
+			return nullptr;
+		}
+		value = isNegative ? -magnitude : magnitude;
+		return pChar;
+	}
+
+	void ParseOBJChunk(const char* pChar, const char* pEnd, OBJChunk& chunk)
+	{
+		struct FaceVertex
+		{
+			int index;
+			bool isRelative;
+		};
+		std::vector<FaceVertex> polygon{};
+
+		while (pChar < pEnd)
+		{
+			pChar = SkipSpaces(pChar, pEnd);
+			if (pEnd - pChar >= 2 && pChar[0] == 'v' && IsSpace(pChar[1]))
+			{
+				//Vertex, a w component or vertex colors after x y z are skipped with the rest of the line
+				Vector3 position{};
+				++pChar;
+				for (float* pComponent : { &position.x, &position.y, &position.z })
+				{
+					pChar = ParseFloat(SkipSpaces(pChar, pEnd), pEnd, *pComponent);
+					if (!pChar)
+					{
+						chunk.isValid = false;
+						return;
+					}
+				}
+				chunk.positions.push_back(position);
+			}
+			else if (pEnd - pChar >= 2 && pChar[0] == 'f' && IsSpace(pChar[1]))
+			{
+				polygon.clear();
+				pChar = SkipSpaces(pChar + 1, pEnd);
+				while (pChar < pEnd && *pChar != '\n')
+				{
+					int64_t index{};
+					pChar = ParseInt(pChar, pEnd, index);
+					if (!pChar || index == 0)
+					{
+						chunk.isValid = false;
+						return;
+					}
+					//Skip the texture coordinate and normal indices
+					while (pChar < pEnd && *pChar != '\n' && !IsSpace(*pChar))
+					{
+						++pChar;
+					}
+					pChar = SkipSpaces(pChar, pEnd);
+
+					const bool isRelative = index < 0;
+					polygon.push_back({ static_cast<int>(isRelative ? static_cast<int64_t>(chunk.positions.size()) + index : index - 1), isRelative });
+				}
+
+				//Fan triangulation, faces with fewer than 3 vertices are dropped
+				for (size_t corner = 2; corner < polygon.size(); ++corner)
+				{
+					for (const FaceVertex& vertex : { polygon[0], polygon[corner - 1], polygon[corner] })
+					{
+						if (vertex.isRelative)
+						{
+							chunk.relativeIndices.push_back(static_cast<uint32_t>(chunk.indices.size()));
+						}
+						chunk.indices.push_back(vertex.index);
+					}
+				}
+			}
+			pChar = SkipLine(pChar, pEnd);
+		}
+	}
+}
+
+//Memory maps the file and splits it at line ends into chunks that are parsed concurrently,
+//then concatenates the chunks, resolving relative indices against the vertices of the chunks before them
+bool Utils::ParseOBJ(const std::string& filename, std::vector<Vector3>& positions, std::vector<Vector3>& normals, std::vector<int>& indices)
+{
+	const MappedFile file{ filename };
+	if (!file.GetData())
+	{
+		return false;
+	}
+	const char* pFile = reinterpret_cast<const char*>(file.GetData());
+	const char* pFileEnd = pFile + file.GetSize();
+
+	static const uint32_t hardwareThreads{ std::max(1u, std::thread::hardware_concurrency()) };
+	const uint32_t nrChunks = static_cast<uint32_t>(std::clamp<size_t>(file.GetSize() / minOBJChunkSize, 1, hardwareThreads));
+	std::vector<const char*> chunkStarts(nrChunks + 1, pFileEnd);
+	chunkStarts[0] = pFile;
+	for (uint32_t chunk = 1; chunk < nrChunks; ++chunk)
+	{
+		chunkStarts[chunk] = SkipLine(std::max(chunkStarts[chunk - 1], pFile + file.GetSize() * chunk / nrChunks), pFileEnd);
+	}
+
+	std::vector<OBJChunk> chunks(nrChunks);
+	RunTasks(nrChunks, [&](uint32_t chunk)
+		{
+			ParseOBJChunk(chunkStarts[chunk], chunkStarts[chunk + 1], chunks[chunk]);
+		});
+
+	std::vector<size_t> firstPositions(nrChunks + 1);
+	std::vector<size_t> firstIndices(nrChunks + 1);
+	for (uint32_t chunk = 0; chunk < nrChunks; ++chunk)
+	{
+		if (!chunks[chunk].isValid)
+		{
+			return false;
+		}
+		firstPositions[chunk + 1] = firstPositions[chunk] + chunks[chunk].positions.size();
+		firstIndices[chunk + 1] = firstIndices[chunk] + chunks[chunk].indices.size();
+	}
+
+	const size_t nrPositions = firstPositions[nrChunks];
+	positions.resize(nrPositions);
+	indices.resize(firstIndices[nrChunks]);
+	std::vector<char> areIndicesValid(nrChunks, 1);
+	RunTasks(nrChunks, [&](uint32_t chunk)
+		{
+			OBJChunk& parsed = chunks[chunk];
+			const int firstPosition = static_cast<int>(firstPositions[chunk]);
+			for (uint32_t index : parsed.relativeIndices)
+			{
+				parsed.indices[index] += firstPosition;
+			}
+			for (int index : parsed.indices)
+			{
+				if (index < 0 || static_cast<size_t>(index) >= nrPositions)
+				{
+					areIndicesValid[chunk] = 0;
+				}
+			}
+			std::copy(parsed.positions.begin(), parsed.positions.end(), positions.begin() + firstPositions[chunk]);
+			std::copy(parsed.indices.begin(), parsed.indices.end(), indices.begin() + firstIndices[chunk]);
+			parsed = {};
+		});
+	if (std::find(areIndicesValid.begin(), areIndicesValid.end(), 0) != areIndicesValid.end())
+	{
+		positions.clear();
+		indices.clear();
+		return false;
+	}
+
+	//Precompute normals
+	const size_t nrTriangles = indices.size() / 3;
+	normals.resize(nrTriangles);
+	RunTasks(nrChunks, [&](uint32_t chunk)
+		{
+			for (size_t triangle = nrTriangles * chunk / nrChunks; triangle < nrTriangles * (chunk + 1) / nrChunks; ++triangle)
+			{
+				const Vector3& v0 = positions[indices[3 * triangle]];
+				Vector3 normal = Vector3::Cross(positions[indices[3 * triangle + 1]] - v0, positions[indices[3 * triangle + 2]] - v0);
+				normal.Normalize();
+				normals[triangle] = normal;
+			}
+		});
+
+	return true;
+}
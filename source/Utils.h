@@ -1,9 +1,12 @@
 #pragma once
 #include <cassert>
-#include <fstream>
-#include <xmmintrin.h>
+#include <bit>
+#include <iostream>
+#include <random>
 #include "Math.h"
 #include "DataTypes.h"
+#include "BVHStatistics.h"
+#include "SIMD.h"
 
 namespace dae
 {
@@ -15,83 +18,17 @@ namespace dae
 				_mm_sqrt_ss(_mm_set_ps1(arg))
 			);
 		}
-		//Just parses vertices and indices
-#pragma warning(push)
-#pragma warning(disable : 4505) //Warning unreferenced local function
-		static bool ParseOBJ(const std::string& filename, std::vector<Vector3>& positions, std::vector<Vector3>& normals, std::vector<int>& indices)
-		{
-			std::ifstream file(filename);
-			if (!file)
-				return false;
-
-			std::string sCommand;
-			// start a while iteration ending when the end of file is reached (ios::eof)
-			while (!file.eof())
-			{
-				//read the first word of the string, use the >> operator (istream::operator>>) 
-				file >> sCommand;
-				//use conditional statements to process the different commands	
-				if (sCommand == "#")
-				{
-					// Ignore Comment
-				}
-				else if (sCommand == "v")
-				{
-					//Vertex
-					float x, y, z;
-					file >> x >> y >> z;
-					positions.push_back({ x, y, z });
-				}
-				else if (sCommand == "f")
-				{
-					float i0, i1, i2;
-					file >> i0 >> i1 >> i2;
-
-					indices.push_back((int)i0 - 1);
-					indices.push_back((int)i1 - 1);
-					indices.push_back((int)i2 - 1);
-				}
-				//read till end of line and ignore all remaining chars
-				file.ignore(1000, '\n');
-
-				if (file.eof())
-					break;
-			}
-
-			//Precompute normals
-			for (uint64_t index = 0; index < indices.size(); index += 3)
-			{
-				uint32_t i0 = indices[index];
-				uint32_t i1 = indices[index + 1];
-				uint32_t i2 = indices[index + 2];
-
-				Vector3 edgeV0V1 = positions[i1] - positions[i0];
-				Vector3 edgeV0V2 = positions[i2] - positions[i0];
-				Vector3 normal = Vector3::Cross(edgeV0V1, edgeV0V2);
-
-				if (isnan(normal.x))
-				{
-					int k = 0;
-				}
-
-				normal.Normalize();
-				if (isnan(normal.x))
-				{
-					int k = 0;
-				}
-
-				normals.push_back(normal);
-			}
-
-			return true;
-		}
-#pragma warning(pop)
+		//Parses the vertices and faces of an OBJ file into positions and indices, replacing their contents, and computes a normal per triangle.
+		//Faces may use the v, v/vt, v//vn and v/vt/vn forms with absolute or negative (relative) indices, polygons are fan triangulated.
+		//Texture coordinates, vertex normals, objects and groups are skipped, every object ends up in the one mesh.
+		bool ParseOBJ(const std::string& filename, std::vector<Vector3>& positions, std::vector<Vector3>& normals, std::vector<int>& indices);
 	}
 	namespace GeometryUtils
 	{
 #pragma region Sphere HitTest
 		//SPHERE HIT-TESTS
-		inline bool HitTest_Sphere(const Sphere& sphere, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord = false)
+		template<HitQuery Query = HitQuery::ClosestHit>
+		inline bool HitTest_Sphere(const Sphere& sphere, const Ray& ray, HitRecord& hitRecord)
 		{
 			Vector3 toCenter = sphere.origin - ray.origin;
 			float distance = Vector3::Dot(toCenter, ray.direction);
@@ -108,20 +45,17 @@ namespace dae
 			{
 				return false;
 			}
-			if (ignoreHitRecord)
+			if constexpr (Query == HitQuery::AnyHit)
 			{
 				return true;
 			}
 
-			hitRecord.didHit = true;
 			if (hitRecord.t > t)
 			{
 				hitRecord.t = t;
-				hitRecord.materialIndex = sphere.materialIndex;
-				hitRecord.origin = ray.origin + (ray.direction * hitRecord.t);
-				hitRecord.normal = (hitRecord.origin - sphere.origin).Normalized();
+				hitRecord.didHit = true;
+				return true;
 			}
-			
 
 #pragma region Analytic
 			//float a, b, c, d{};
@@ -183,18 +117,26 @@ namespace dae
 			//	}
 			//}
 #pragma endregion
-			return hitRecord.didHit;
+			return false;
 		}
 
 		inline bool HitTest_Sphere(const Sphere& sphere, const Ray& ray)
 		{
 			HitRecord temp{};
-			return HitTest_Sphere(sphere, ray, temp, true);
+			return HitTest_Sphere<HitQuery::AnyHit>(sphere, ray, temp);
+		}
+
+		inline void FinalizeHit_Sphere(const Sphere& sphere, const Ray& ray, HitRecord& hitRecord)
+		{
+			hitRecord.materialIndex = sphere.materialIndex;
+			hitRecord.origin = ray.origin + (ray.direction * hitRecord.t);
+			hitRecord.normal = (hitRecord.origin - sphere.origin).Normalized();
 		}
 #pragma endregion
 #pragma region Plane HitTest
 		//PLANE HIT-TESTS
-		inline bool HitTest_Plane(const Plane& plane, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord = false)
+		template<HitQuery Query = HitQuery::ClosestHit>
+		inline bool HitTest_Plane(const Plane& plane, const Ray& ray, HitRecord& hitRecord)
 		{
 			float t = (Vector3::Dot((plane.origin - ray.origin), plane.normal) / Vector3::Dot(ray.direction, plane.normal));
 			if (t > FLT_EPSILON)
@@ -207,79 +149,188 @@ namespace dae
 				{
 					return false;
 				}
-				if (ignoreHitRecord)
+				if constexpr (Query == HitQuery::AnyHit)
 				{
 					return true;
 				}
 				if (hitRecord.t > t)
 				{
 					hitRecord.didHit = true;
-					hitRecord.materialIndex = plane.materialIndex;
-					hitRecord.origin = ray.origin + ray.direction * t;
-					hitRecord.normal = plane.normal;
 					hitRecord.t = t;
+					return true;
 				}
 			}
-			return hitRecord.didHit;
+			return false;
 		}
 
 		inline bool HitTest_Plane(const Plane& plane, const Ray& ray)
 		{
 			HitRecord temp{};
-			return HitTest_Plane(plane, ray, temp, true);
+			return HitTest_Plane<HitQuery::AnyHit>(plane, ray, temp);
+		}
+
+		inline void FinalizeHit_Plane(const Plane& plane, const Ray& ray, HitRecord& hitRecord)
+		{
+			hitRecord.materialIndex = plane.materialIndex;
+			hitRecord.origin = ray.origin + ray.direction * hitRecord.t;
+			hitRecord.normal = plane.normal;
+		}
+#pragma endregion
+#pragma region Packet HitTest
+		//Picks the closest of the lanes in hitMask, the first one on a tie
+		template<int Width>
+		inline void GetClosestPacketLane(uint32_t hitMask, const float (&t)[Width], int& hitLane, float& hitT)
+		{
+			hitT = FLT_MAX;
+			for (uint32_t mask = hitMask; mask != 0; mask &= mask - 1)
+			{
+				const int lane = std::countr_zero(mask);
+				if (hitT > t[lane])
+				{
+					hitT = t[lane];
+					hitLane = lane;
+				}
+			}
+		}
+
+		//The scalar sphere test on Lanes spheres given one register per component, returns the mask of lanes hit within [ray.min, ray.max].
+		//pT receives every lane's t.
+		template<int Lanes>
+		inline uint32_t HitTest_SphereLanes(typename SIMDFloat<Lanes>::Reg originX, typename SIMDFloat<Lanes>::Reg originY, typename SIMDFloat<Lanes>::Reg originZ,
+			typename SIMDFloat<Lanes>::Reg sqrRadius, const Ray& ray, float* pT)
+		{
+			using F = SIMDFloat<Lanes>;
+			using Reg = typename F::Reg;
+
+			const Reg toCenterX = F::Sub(originX, F::Set(ray.origin.x));
+			const Reg toCenterY = F::Sub(originY, F::Set(ray.origin.y));
+			const Reg toCenterZ = F::Sub(originZ, F::Set(ray.origin.z));
+			const Reg distance = F::Add(F::Add(F::Mul(toCenterX, F::Set(ray.direction.x)), F::Mul(toCenterY, F::Set(ray.direction.y))), F::Mul(toCenterZ, F::Set(ray.direction.z)));
+			const Reg squaredToCenter = F::Add(F::Add(F::Mul(toCenterX, toCenterX), F::Mul(toCenterY, toCenterY)), F::Mul(toCenterZ, toCenterZ));
+			const Reg squaredSpherePoint = F::Sub(sqrRadius, F::Sub(squaredToCenter, F::Mul(distance, distance)));
+			const Reg t = F::Sub(distance, F::Sqrt(squaredSpherePoint));
+
+			Reg hit = F::GreaterEqual(squaredSpherePoint, F::Set(0.f));
+			hit = F::And(hit, F::And(F::GreaterEqual(t, F::Set(ray.min)), F::LessEqual(t, F::Set(ray.max))));
+
+			F::Store(pT, t);
+			return F::MoveMask(hit);
+		}
+		//The sphere test on Lanes spheres of a packet, pT receives every lane's t at its lane
+		template<int Lanes, int Width>
+		inline uint32_t HitTest_SpherePacketLanes(const SpherePacket<Width>& packet, int lane, const Ray& ray, float* pT)
+		{
+			using F = SIMDFloat<Lanes>;
+			return HitTest_SphereLanes<Lanes>(F::Load(packet.originX + lane), F::Load(packet.originY + lane), F::Load(packet.originZ + lane), F::Load(packet.sqrRadius + lane), ray, pT + lane);
+		}
+		//On a hit within [ray.min, ray.max] hitLane is the closest lane, any hit queries leave hitLane and hitT unset
+		template<HitQuery Query, int Width>
+		inline bool HitTest_SpherePacket(const SpherePacket<Width>& packet, const Ray& ray, int& hitLane, float& hitT)
+		{
+			constexpr int lanes{ std::min(Width, SIMD_MAX_LANES) };
+			alignas(32) float t[Width];
+			uint32_t hitMask{};
+			for (int lane = 0; lane < Width; lane += lanes)
+			{
+				hitMask |= HitTest_SpherePacketLanes<lanes>(packet, lane, ray, t) << lane;
+			}
+			if (hitMask == 0)
+			{
+				return false;
+			}
+			if constexpr (Query == HitQuery::ClosestHit)
+			{
+				GetClosestPacketLane(hitMask, t, hitLane, hitT);
+			}
+			return true;
+		}
+
+		//The scalar plane test on Lanes planes of a packet, with t from the stored distance instead of the plane origin
+		template<int Lanes, int Width>
+		inline uint32_t HitTest_PlanePacketLanes(const PlanePacket<Width>& packet, int lane, const Ray& ray, float* pT)
+		{
+			using F = SIMDFloat<Lanes>;
+			using Reg = typename F::Reg;
+
+			const Reg normalX = F::Load(packet.normalX + lane);
+			const Reg normalY = F::Load(packet.normalY + lane);
+			const Reg normalZ = F::Load(packet.normalZ + lane);
+			const Reg originDot = F::Add(F::Add(F::Mul(F::Set(ray.origin.x), normalX), F::Mul(F::Set(ray.origin.y), normalY)), F::Mul(F::Set(ray.origin.z), normalZ));
+			const Reg normalDot = F::Add(F::Add(F::Mul(F::Set(ray.direction.x), normalX), F::Mul(F::Set(ray.direction.y), normalY)), F::Mul(F::Set(ray.direction.z), normalZ));
+			const Reg t = F::Div(F::Sub(F::Load(packet.distance + lane), originDot), normalDot);
+
+			Reg hit = F::Greater(t, F::Set(FLT_EPSILON));
+			hit = F::And(hit, F::And(F::GreaterEqual(t, F::Set(ray.min)), F::LessEqual(t, F::Set(ray.max))));
+
+			F::Store(pT + lane, t);
+			return F::MoveMask(hit);
+		}
+		template<HitQuery Query, int Width>
+		inline bool HitTest_PlanePacket(const PlanePacket<Width>& packet, const Ray& ray, int& hitLane, float& hitT)
+		{
+			constexpr int lanes{ std::min(Width, SIMD_MAX_LANES) };
+			alignas(32) float t[Width];
+			uint32_t hitMask{};
+			for (int lane = 0; lane < Width; lane += lanes)
+			{
+				hitMask |= HitTest_PlanePacketLanes<lanes>(packet, lane, ray, t) << lane;
+			}
+			if (hitMask == 0)
+			{
+				return false;
+			}
+			if constexpr (Query == HitQuery::ClosestHit)
+			{
+				GetClosestPacketLane(hitMask, t, hitLane, hitT);
+			}
+			return true;
 		}
 #pragma endregion
 #pragma region Triangle HitTest
 		//TRIANGLE HIT-TESTS
-		inline bool HitTest_Triangle(const Triangle& triangle, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord = false)
+		//Shadow rays (any hit queries) test the opposite faces of a culled triangle
+		constexpr TriangleCullMode GetTestedCullMode(HitQuery query, TriangleCullMode cullMode)
+		{
+			if (query == HitQuery::ClosestHit || cullMode == TriangleCullMode::NoCulling)
+			{
+				return cullMode;
+			}
+			return cullMode == TriangleCullMode::FrontFaceCulling ? TriangleCullMode::BackFaceCulling : TriangleCullMode::FrontFaceCulling;
+		}
+		//Shared by loose triangles and the precomputed BVH triangles of a mesh, edges are relative to v0
+		template<HitQuery Query, TriangleCullMode CullMode>
+		inline bool HitTest_Triangle(const Vector3& v0, const Vector3& edge1, const Vector3& edge2, const Vector3& normal, const Ray& ray, HitRecord& hitRecord)
 		{
-			float normalDot = Vector3::Dot(ray.direction, triangle.normal);
+			float normalDot = Vector3::Dot(ray.direction, normal);
 
 			if (abs(normalDot) < FLT_EPSILON)
 			{
 				return false;
 			}
 
-			TriangleCullMode mode = triangle.cullMode;
-			if (ignoreHitRecord && mode != TriangleCullMode::NoCulling)
+			constexpr TriangleCullMode mode = GetTestedCullMode(Query, CullMode);
+			if constexpr (mode == TriangleCullMode::BackFaceCulling)
 			{
-				if (mode == TriangleCullMode::FrontFaceCulling)
-				{
-					mode = TriangleCullMode::BackFaceCulling;
-				}
-				else
-				{
-					mode = TriangleCullMode::FrontFaceCulling;
-				}
-			}
-			
-			switch (mode)
-			{
-			case dae::TriangleCullMode::BackFaceCulling:
 				if (normalDot > 0.f)
 				{
 					return false;
 				}
-				break;
-			case dae::TriangleCullMode::FrontFaceCulling:
+			}
+			else if constexpr (mode == TriangleCullMode::FrontFaceCulling)
+			{
 				if (normalDot < 0.f)
 				{
 					return false;
 				}
-				break;
-			default:
-				break;
 			}
 
 			//New code (https://en.wikipedia.org/wiki/M%C3%B6ller%E2%80%93Trumbore_intersection_algorithm)
-			Vector3 edge1, edge2, h, s, q;
+			Vector3 h, s, q;
 			float f, u, v;
 
-			edge1 = triangle.v1 - triangle.v0;
-			edge2 = triangle.v2 - triangle.v0;
 			h = Vector3::Cross(ray.direction, edge2);
 			f = 1.0f / Vector3::Dot(edge1, h);
-			s =  ray.origin - triangle.v0;
+			s =  ray.origin - v0;
 			u =  f * Vector3::Dot(s,h);
 			if (u < 0.0f || u > 1.0f)
 			{
@@ -296,16 +347,13 @@ namespace dae
 			{
 				return false;
 			}
-			if (ignoreHitRecord)
-			{
-				return true;
-			}
-			if (hitRecord.t > t)
+			if constexpr (Query == HitQuery::ClosestHit)
 			{
+				if (hitRecord.t <= t)
+				{
+					return false;
+				}
 				hitRecord.didHit = true;
-				hitRecord.materialIndex = triangle.materialIndex;
-				hitRecord.origin = ray.origin + ray.direction * t;
-				hitRecord.normal = triangle.normal;
 				hitRecord.t = t;
 			}
 
@@ -392,14 +440,102 @@ namespace dae
 #pragma endregion
 		}
 
+		template<HitQuery Query = HitQuery::ClosestHit>
+		inline bool HitTest_Triangle(const Triangle& triangle, const Ray& ray, HitRecord& hitRecord)
+		{
+			const Vector3 edge1 = triangle.v1 - triangle.v0;
+			const Vector3 edge2 = triangle.v2 - triangle.v0;
+			switch (triangle.cullMode)
+			{
+			case TriangleCullMode::FrontFaceCulling:
+				return HitTest_Triangle<Query, TriangleCullMode::FrontFaceCulling>(triangle.v0, edge1, edge2, triangle.normal, ray, hitRecord);
+			case TriangleCullMode::BackFaceCulling:
+				return HitTest_Triangle<Query, TriangleCullMode::BackFaceCulling>(triangle.v0, edge1, edge2, triangle.normal, ray, hitRecord);
+			default:
+				return HitTest_Triangle<Query, TriangleCullMode::NoCulling>(triangle.v0, edge1, edge2, triangle.normal, ray, hitRecord);
+			}
+		}
+
 		inline bool HitTest_Triangle(const Triangle& triangle, const Ray& ray)
 		{
 			HitRecord temp{};
-			return HitTest_Triangle(triangle, ray, temp, true);
+			return HitTest_Triangle<HitQuery::AnyHit>(triangle, ray, temp);
+		}
+
+		template<HitQuery Query, TriangleCullMode CullMode>
+		inline bool HitTest_Triangle(const BVHTriangle& triangle, const Ray& ray, HitRecord& hitRecord)
+		{
+			return HitTest_Triangle<Query, CullMode>(triangle.v0, triangle.edge1, triangle.edge2, triangle.normal, ray, hitRecord);
+		}
+		//The affine kernel accepts barycentrics this far outside the triangle. Rays aimed at a shared edge or vertex otherwise slip between
+		//the triangles on rounding, which is about 2e-5 for triangles 1/64 in size at unit distance from the origin, with or without FMA.
+		//Triangles further from the origin relative to their size round more, so they can still leak.
+		constexpr float affineBarycentricEpsilon{ 1e-4f };
+		//Affine kernel (see BVHTriangleAffine): the plane distance comes first, so closest hit queries skip the barycentrics of triangles behind hitRecord.t.
+		//Rays parallel to the plane get an infinite or NaN t that fails the range test, which takes the place of the normal epsilon test.
+		template<HitQuery Query, TriangleCullMode CullMode>
+		inline bool HitTest_Triangle(const BVHTriangleAffine& triangle, const Ray& ray, HitRecord& hitRecord)
+		{
+			const float normalDot = Vector3::Dot(triangle.row2, ray.direction);
+
+			constexpr TriangleCullMode mode = GetTestedCullMode(Query, CullMode);
+			if constexpr (mode == TriangleCullMode::BackFaceCulling)
+			{
+				if (normalDot > 0.f)
+				{
+					return false;
+				}
+			}
+			else if constexpr (mode == TriangleCullMode::FrontFaceCulling)
+			{
+				if (normalDot < 0.f)
+				{
+					return false;
+				}
+			}
+
+			const float t = -(Vector3::Dot(triangle.row2, ray.origin) + triangle.offset2) / normalDot;
+			if (!(t >= ray.min && t <= ray.max))
+			{
+				return false;
+			}
+			if constexpr (Query == HitQuery::ClosestHit)
+			{
+				if (hitRecord.t <= t)
+				{
+					return false;
+				}
+			}
+
+			const Vector3 point = ray.origin + ray.direction * t;
+			const float u = Vector3::Dot(triangle.row0, point) + triangle.offset0;
+			if (u < -affineBarycentricEpsilon)
+			{
+				return false;
+			}
+			const float v = Vector3::Dot(triangle.row1, point) + triangle.offset1;
+			if (v < -affineBarycentricEpsilon || u + v > 1.f + affineBarycentricEpsilon)
+			{
+				return false;
+			}
+			if constexpr (Query == HitQuery::ClosestHit)
+			{
+				hitRecord.didHit = true;
+				hitRecord.t = t;
+			}
+			return true;
+		}
+
+		inline void FinalizeHit_Triangle(const Triangle& triangle, const Ray& ray, HitRecord& hitRecord)
+		{
+			hitRecord.materialIndex = triangle.materialIndex;
+			hitRecord.origin = ray.origin + ray.direction * hitRecord.t;
+			hitRecord.normal = triangle.normal;
 		}
 #pragma endregion
-#pragma region TriangeMesh HitTest
-		inline bool SlabTest_TriangleMesh(const Ray& ray, const Vector3& minAABB, const Vector3& maxAABB)
+#pragma region AABB SlabTest
+		//Returns the distance at which the ray enters the box, FLT_MAX when the box is missed or lies outside [ray.min, ray.max]
+		inline float SlabTest_AABB(const Ray& ray, const Vector3& minAABB, const Vector3& maxAABB)
 		{
 			float tx1 = (minAABB.x - ray.origin.x) * ray.invertedDirection.x;
 			float tx2 = (maxAABB.x - ray.origin.x) * ray.invertedDirection.x;
@@ -419,60 +555,533 @@ namespace dae
 			tmin = std::max(tmin, std::min(tz1, tz2));
 			tmax = std::min(tmax, std::max(tz1, tz2));
 
-			return tmax > 0 && tmax >= tmin;
+			if (tmax >= tmin && tmax > ray.min && tmin < ray.max)
+			{
+				return tmin;
+			}
+			return FLT_MAX;
+		}
+#pragma endregion
+#pragma region TriangeMesh HitTest
+		//Distance beyond which traversal can skip a node: the closest hit so far, or the end of the ray for any hit queries
+		template<HitQuery Query>
+		inline float GetQueryMaxT(const Ray& ray, const HitRecord& hitRecord)
+		{
+			if constexpr (Query == HitQuery::ClosestHit)
+			{
+				return hitRecord.t;
+			}
+			else
+			{
+				return ray.max;
+			}
+		}
+		//Near first traversal of a binary BVH with the children of a node stored as a pair at leftChild, shared by the mesh, sphere set and scene BVHs.
+		//Nodes entered at or behind getMaxT() are skipped. intersectLeaf(nodeIndx, node) tests a leaf and returns true to end the traversal.
+		//visitChildren(leftChild) sees every child pair that gets slab tested.
+		template<typename Node, typename GetMaxT, typename IntersectLeaf, typename VisitChildren>
+		inline void TraverseBVH(const Node* pNodes, uint32_t rootNodeIndx, const Ray& ray, const GetMaxT& getMaxT, const IntersectLeaf& intersectLeaf, const VisitChildren& visitChildren)
+		{
+			//Every stack entry keeps the entry distance of its node, so nodes behind a hit found in the meantime are skipped
+			struct StackEntry
+			{
+				uint32_t nodeIndx;
+				float tEntry;
+			};
+			TraversalStack<StackEntry, 64> stack{};
+
+			const Node& root = pNodes[rootNodeIndx];
+			stack.Push({ rootNodeIndx, SlabTest_AABB(ray, root.aabbMin, root.aabbMax) });
+			while (!stack.IsEmpty())
+			{
+				const StackEntry entry = stack.Pop();
+				if (entry.tEntry >= getMaxT())
+				{
+					continue;
+				}
+
+				const Node& node = pNodes[entry.nodeIndx];
+				if (node.IsLeaf())
+				{
+					if (intersectLeaf(entry.nodeIndx, node))
+					{
+						return;
+					}
+					continue;
+				}
+
+				//Near child is pushed last so it is popped first
+				const Node& leftChild = pNodes[node.leftChild];
+				const Node& rightChild = pNodes[node.leftChild + 1];
+				visitChildren(leftChild);
+				StackEntry nearEntry{ node.leftChild, SlabTest_AABB(ray, leftChild.aabbMin, leftChild.aabbMax) };
+				StackEntry farEntry{ node.leftChild + 1, SlabTest_AABB(ray, rightChild.aabbMin, rightChild.aabbMax) };
+				if (farEntry.tEntry < nearEntry.tEntry)
+				{
+					std::swap(nearEntry, farEntry);
+				}
+
+				const float tMax = getMaxT();
+				if (farEntry.tEntry < tMax)
+				{
+					stack.Push(farEntry);
+				}
+				if (nearEntry.tEntry < tMax)
+				{
+					stack.Push(nearEntry);
+				}
+			}
+		}
+		template<typename Node, typename GetMaxT, typename IntersectLeaf>
+		inline void TraverseBVH(const Node* pNodes, uint32_t rootNodeIndx, const Ray& ray, const GetMaxT& getMaxT, const IntersectLeaf& intersectLeaf)
+		{
+			TraverseBVH(pNodes, rootNodeIndx, ray, getMaxT, intersectLeaf, [](const Node&) {});
 		}
-		inline void IntersectBVH(const TriangleMesh& mesh, const Ray& ray, Triangle& sharedTriangle, HitRecord& hitRecord, bool& hasHit, HitRecord& curClosestHit, bool ignoreHitRecord, unsigned int bvhNodeIdx)
+		//Moller-Trumbore on Lanes triangles of a packet, with the same operations in the same order as HitTest_Triangle.
+		//Returns the mask of lanes hit within [ray.min, ray.max], pT receives every lane's t.
+		template<TriangleCullMode CullMode, int Lanes, int Width>
+		inline uint32_t HitTest_TrianglePacketLanes(const BVHTrianglePacket<Width>& packet, int lane, const Ray& ray, float* pT)
 		{
-			BVHNode& node = mesh.pBvhNodes[bvhNodeIdx];
+			using F = SIMDFloat<Lanes>;
+			using Reg = typename F::Reg;
+
+			const Reg zero = F::Set(0.f);
+			const Reg one = F::Set(1.f);
+			const Reg dirX = F::Set(ray.direction.x);
+			const Reg dirY = F::Set(ray.direction.y);
+			const Reg dirZ = F::Set(ray.direction.z);
+
+			const Reg edge1X = F::Load(packet.edge1X + lane);
+			const Reg edge1Y = F::Load(packet.edge1Y + lane);
+			const Reg edge1Z = F::Load(packet.edge1Z + lane);
+			const Reg edge2X = F::Load(packet.edge2X + lane);
+			const Reg edge2Y = F::Load(packet.edge2Y + lane);
+			const Reg edge2Z = F::Load(packet.edge2Z + lane);
 
-			if (!SlabTest_TriangleMesh(ray, node.aabbMin, node.aabbMax))
+			const Reg normalDot = F::Add(F::Add(F::Mul(dirX, F::Load(packet.normalX + lane)), F::Mul(dirY, F::Load(packet.normalY + lane))), F::Mul(dirZ, F::Load(packet.normalZ + lane)));
+			Reg miss = F::Less(F::Abs(normalDot), F::Set(FLT_EPSILON));
+			if constexpr (CullMode == TriangleCullMode::BackFaceCulling)
 			{
-				return;
+				miss = F::Or(miss, F::Greater(normalDot, zero));
 			}
-			
-			if (!node.IsLeaf())
+			else if constexpr (CullMode == TriangleCullMode::FrontFaceCulling)
+			{
+				miss = F::Or(miss, F::Less(normalDot, zero));
+			}
+
+			const Reg hX = F::Sub(F::Mul(dirY, edge2Z), F::Mul(dirZ, edge2Y));
+			const Reg hY = F::Sub(F::Mul(dirZ, edge2X), F::Mul(dirX, edge2Z));
+			const Reg hZ = F::Sub(F::Mul(dirX, edge2Y), F::Mul(dirY, edge2X));
+			const Reg f = F::Div(one, F::Add(F::Add(F::Mul(edge1X, hX), F::Mul(edge1Y, hY)), F::Mul(edge1Z, hZ)));
+
+			const Reg sX = F::Sub(F::Set(ray.origin.x), F::Load(packet.v0X + lane));
+			const Reg sY = F::Sub(F::Set(ray.origin.y), F::Load(packet.v0Y + lane));
+			const Reg sZ = F::Sub(F::Set(ray.origin.z), F::Load(packet.v0Z + lane));
+			const Reg u = F::Mul(f, F::Add(F::Add(F::Mul(sX, hX), F::Mul(sY, hY)), F::Mul(sZ, hZ)));
+			miss = F::Or(miss, F::Or(F::Less(u, zero), F::Greater(u, one)));
+
+			const Reg qX = F::Sub(F::Mul(sY, edge1Z), F::Mul(sZ, edge1Y));
+			const Reg qY = F::Sub(F::Mul(sZ, edge1X), F::Mul(sX, edge1Z));
+			const Reg qZ = F::Sub(F::Mul(sX, edge1Y), F::Mul(sY, edge1X));
+			const Reg v = F::Mul(f, F::Add(F::Add(F::Mul(dirX, qX), F::Mul(dirY, qY)), F::Mul(dirZ, qZ)));
+			miss = F::Or(miss, F::Or(F::Less(v, zero), F::Greater(F::Add(u, v), one)));
+
+			const Reg t = F::Mul(f, F::Add(F::Add(F::Mul(edge2X, qX), F::Mul(edge2Y, qY)), F::Mul(edge2Z, qZ)));
+			miss = F::Or(miss, F::Or(F::Less(t, F::Set(ray.min)), F::Greater(t, F::Set(ray.max))));
+
+			F::Store(pT + lane, t);
+			return ~F::MoveMask(miss) & ((1u << Lanes) - 1);
+		}
+		//Affine kernel on Lanes triangles of a packet, the same tests as the scalar one written as a mask of the lanes that pass all of them
+		template<TriangleCullMode CullMode, int Lanes, int Width>
+		inline uint32_t HitTest_TrianglePacketLanes(const BVHTriangleAffinePacket<Width>& packet, int lane, const Ray& ray, float* pT)
+		{
+			using F = SIMDFloat<Lanes>;
+			using Reg = typename F::Reg;
+
+			const Reg zero = F::Set(0.f);
+			const Reg originX = F::Set(ray.origin.x);
+			const Reg originY = F::Set(ray.origin.y);
+			const Reg originZ = F::Set(ray.origin.z);
+			const Reg dirX = F::Set(ray.direction.x);
+			const Reg dirY = F::Set(ray.direction.y);
+			const Reg dirZ = F::Set(ray.direction.z);
+
+			const Reg row2X = F::Load(packet.row2X + lane);
+			const Reg row2Y = F::Load(packet.row2Y + lane);
+			const Reg row2Z = F::Load(packet.row2Z + lane);
+			const Reg normalDot = F::Add(F::Add(F::Mul(dirX, row2X), F::Mul(dirY, row2Y)), F::Mul(dirZ, row2Z));
+			const Reg originDistance = F::Add(F::Add(F::Add(F::Mul(originX, row2X), F::Mul(originY, row2Y)), F::Mul(originZ, row2Z)), F::Load(packet.offset2 + lane));
+			const Reg t = F::Div(F::Sub(zero, originDistance), normalDot);
+			Reg hit = F::And(F::GreaterEqual(t, F::Set(ray.min)), F::LessEqual(t, F::Set(ray.max)));
+			if constexpr (CullMode == TriangleCullMode::BackFaceCulling)
+			{
+				hit = F::And(hit, F::LessEqual(normalDot, zero));
+			}
+			else if constexpr (CullMode == TriangleCullMode::FrontFaceCulling)
+			{
+				hit = F::And(hit, F::GreaterEqual(normalDot, zero));
+			}
+
+			const Reg pointX = F::Add(originX, F::Mul(dirX, t));
+			const Reg pointY = F::Add(originY, F::Mul(dirY, t));
+			const Reg pointZ = F::Add(originZ, F::Mul(dirZ, t));
+			const Reg u = F::Add(F::Add(F::Add(F::Mul(pointX, F::Load(packet.row0X + lane)), F::Mul(pointY, F::Load(packet.row0Y + lane))), F::Mul(pointZ, F::Load(packet.row0Z + lane))), F::Load(packet.offset0 + lane));
+			const Reg v = F::Add(F::Add(F::Add(F::Mul(pointX, F::Load(packet.row1X + lane)), F::Mul(pointY, F::Load(packet.row1Y + lane))), F::Mul(pointZ, F::Load(packet.row1Z + lane))), F::Load(packet.offset1 + lane));
+			const Reg minBarycentric = F::Set(-affineBarycentricEpsilon);
+			hit = F::And(hit, F::And(F::GreaterEqual(u, minBarycentric), F::GreaterEqual(v, minBarycentric)));
+			hit = F::And(hit, F::LessEqual(F::Add(u, v), F::Set(1.f + affineBarycentricEpsilon)));
+
+			F::Store(pT + lane, t);
+			return F::MoveMask(hit);
+		}
+		//Intersects a packet of triangles, on a hit within [ray.min, ray.max] hitLane is the closest lane (the first one on a tie).
+		//Any hit queries leave hitLane and hitT unset.
+		template<HitQuery Query, TriangleCullMode CullMode, typename Packet>
+		inline bool HitTest_TrianglePacket(const Packet& packet, const Ray& ray, int& hitLane, float& hitT)
+		{
+			constexpr int Width{ Packet::width };
+			constexpr int lanes{ std::min(Width, SIMD_MAX_LANES) };
+			constexpr TriangleCullMode mode = GetTestedCullMode(Query, CullMode);
+			alignas(32) float t[Width];
+			uint32_t hitMask{};
+			for (int lane = 0; lane < Width; lane += lanes)
+			{
+				hitMask |= HitTest_TrianglePacketLanes<mode, lanes>(packet, lane, ray, t) << lane;
+			}
+			if (hitMask == 0)
 			{
-				IntersectBVH(mesh, ray, sharedTriangle, hitRecord, hasHit, curClosestHit, ignoreHitRecord, node.leftChild);
-				IntersectBVH(mesh, ray, sharedTriangle, hitRecord, hasHit, curClosestHit, ignoreHitRecord, node.leftChild + 1);
-				return;
+				return false;
+			}
+			if constexpr (Query == HitQuery::ClosestHit)
+			{
+				GetClosestPacketLane(hitMask, t, hitLane, hitT);
 			}
-			for (uint32_t i = 0; i < node.indicesCount; i+=3)
+			return true;
+		}
+		template<HitQuery Query, TriangleCullMode CullMode, typename Packet>
+		inline bool IntersectBVHLeafPackets(const std::vector<Packet>& packets, uint32_t firstPacket, uint32_t triangleCount, const Ray& ray, HitRecord& hitRecord)
+		{
+			constexpr int Width{ Packet::width };
+			bool hasHit{};
+			const uint32_t packetEnd = firstPacket + (triangleCount + Width - 1) / Width;
+			for (uint32_t i = firstPacket; i < packetEnd; ++i)
 			{
-				sharedTriangle.v0 = mesh.transformedPositions[mesh.indices[node.firstIndice + i]];
-				sharedTriangle.v1 = mesh.transformedPositions[mesh.indices[node.firstIndice + i + 1]];
-				sharedTriangle.v2 = mesh.transformedPositions[mesh.indices[node.firstIndice + i + 2]];
-				sharedTriangle.normal = mesh.transformedNormals[(node.firstIndice + i) / 3];
+				const Packet& packet = packets[i];
+				int lane{};
+				float t{};
+				if (!HitTest_TrianglePacket<Query, CullMode>(packet, ray, lane, t))
+				{
+					continue;
+				}
+				if constexpr (Query == HitQuery::AnyHit)
+				{
+					return true;
+				}
 
-				if (!HitTest_Triangle(sharedTriangle, ray, curClosestHit, ignoreHitRecord))
+				if (hitRecord.t > t)
+				{
+					hitRecord.didHit = true;
+					hitRecord.t = t;
+					hitRecord.elementIndex = i * Width + lane;
+					hasHit = true;
+				}
+			}
+			return hasHit;
+		}
+		template<HitQuery Query, TriangleCullMode CullMode, typename LeafTriangle>
+		inline bool IntersectBVHLeafTriangles(const std::vector<LeafTriangle>& triangles, uint32_t firstTriangle, uint32_t triangleCount, const Ray& ray, HitRecord& hitRecord)
+		{
+			bool hasHit{};
+			for (uint32_t i = firstTriangle; i < firstTriangle + triangleCount; ++i)
+			{
+				if (!HitTest_Triangle<Query, CullMode>(triangles[i], ray, hitRecord))
 				{
 					continue;
 				}
+				if constexpr (Query == HitQuery::AnyHit)
+				{
+					return true;
+				}
+				hitRecord.elementIndex = i;
 				hasHit = true;
+			}
+			return hasHit;
+		}
+		//Tests the triangles of one leaf. Any hit queries return true on the first hit within [ray.min, ray.max],
+		//closest hit queries when one of them is closer than hitRecord.t, after recording it as hitRecord.elementIndex.
+		template<HitQuery Query, TriangleCullMode CullMode>
+		inline bool IntersectBVHLeaf(const TriangleMesh& mesh, uint32_t firstTriangle, uint32_t triangleCount, const Ray& ray, HitRecord& hitRecord)
+		{
+			const bool isAffine = mesh.triangleKernel == TriangleKernel::Affine;
+			switch (mesh.leafLayout)
+			{
+			case LeafLayout::Packet4:
+				return isAffine ? IntersectBVHLeafPackets<Query, CullMode>(mesh.bvhAffinePackets4, firstTriangle, triangleCount, ray, hitRecord)
+					: IntersectBVHLeafPackets<Query, CullMode>(mesh.bvhPackets4, firstTriangle, triangleCount, ray, hitRecord);
+			case LeafLayout::Packet8:
+				return isAffine ? IntersectBVHLeafPackets<Query, CullMode>(mesh.bvhAffinePackets8, firstTriangle, triangleCount, ray, hitRecord)
+					: IntersectBVHLeafPackets<Query, CullMode>(mesh.bvhPackets8, firstTriangle, triangleCount, ray, hitRecord);
+			default:
+				return isAffine ? IntersectBVHLeafTriangles<Query, CullMode>(mesh.bvhTriangleAffines, firstTriangle, triangleCount, ray, hitRecord)
+					: IntersectBVHLeafTriangles<Query, CullMode>(mesh.bvhTriangles, firstTriangle, triangleCount, ray, hitRecord);
+			}
+		}
+		//Closest hit traversal skips nodes entered behind hitRecord.t, any hit traversal stops at the first hit
+		template<HitQuery Query, TriangleCullMode CullMode>
+		inline bool IntersectBVH(const TriangleMesh& mesh, const Ray& ray, HitRecord& hitRecord)
+		{
+#if defined(BVH_STATISTICS)
+			BVHNodeCache& nodeCache = BVHNodeCache::Get();
+			BVHNodeTLB& nodeTLB = BVHNodeTLB::Get();
+			uint64_t nodesVisited{ 1 };
+			uint64_t trianglesTested{};
+			uint64_t nodeCacheMisses{ nodeCache.Access(&mesh.pBvhNodes[mesh.startBvhNodeIndx], sizeof(BVHNode)) };
+			uint64_t nodeTLBMisses{ nodeTLB.Access(&mesh.pBvhNodes[mesh.startBvhNodeIndx], sizeof(BVHNode)) };
+#endif
 
-				if (ignoreHitRecord)
+			bool hasHit{};
+			TraverseBVH(mesh.pBvhNodes.get(), mesh.startBvhNodeIndx, ray,
+				[&]() { return GetQueryMaxT<Query>(ray, hitRecord); },
+				[&](uint32_t nodeIndx, const BVHNode& node)
+				{
+					const uint32_t triangleCount = node.indicesCount / 3;
+					const uint32_t firstTriangle = mesh.leafLayout == LeafLayout::Scalar ? node.firstIndice / 3 : mesh.bvhLeafFirstPacket[nodeIndx];
+#if defined(BVH_STATISTICS)
+					trianglesTested += triangleCount;
+#endif
+					if (!IntersectBVHLeaf<Query, CullMode>(mesh, firstTriangle, triangleCount, ray, hitRecord))
+					{
+						return false;
+					}
+					hasHit = true;
+					return Query == HitQuery::AnyHit;
+				},
+				[&]([[maybe_unused]] const BVHNode& leftChild)
 				{
-					return;
+#if defined(BVH_STATISTICS)
+					nodesVisited += 2;
+					nodeCacheMisses += nodeCache.Access(&leftChild, 2 * sizeof(BVHNode));
+					nodeTLBMisses += nodeTLB.Access(&leftChild, 2 * sizeof(BVHNode));
+#endif
+				});
+
+#if defined(BVH_STATISTICS)
+			BVHStatistics& statistics = BVHStatistics::Get();
+			++statistics.meshRays;
+			statistics.nodesVisited += nodesVisited;
+			statistics.trianglesTested += trianglesTested;
+			statistics.nodeCacheMisses += nodeCacheMisses;
+			statistics.nodeTLBMisses += nodeTLBMisses;
+#endif
+			return hasHit;
+		}
+		template<int Lanes, int Width>
+		inline uint32_t SlabTest_WideBVHNodeLanes(const WideBVHNode<Width>& node, int lane, const Ray& ray, float tMax, float* pTEntry)
+		{
+			using F = SIMDFloat<Lanes>;
+			using Reg = typename F::Reg;
+
+			const Reg originX = F::Set(ray.origin.x);
+			const Reg originY = F::Set(ray.origin.y);
+			const Reg originZ = F::Set(ray.origin.z);
+			const Reg invDirX = F::Set(ray.invertedDirection.x);
+			const Reg invDirY = F::Set(ray.invertedDirection.y);
+			const Reg invDirZ = F::Set(ray.invertedDirection.z);
+
+			const Reg tx1 = F::Mul(F::Sub(F::Load(node.minX + lane), originX), invDirX);
+			const Reg tx2 = F::Mul(F::Sub(F::Load(node.maxX + lane), originX), invDirX);
+			const Reg ty1 = F::Mul(F::Sub(F::Load(node.minY + lane), originY), invDirY);
+			const Reg ty2 = F::Mul(F::Sub(F::Load(node.maxY + lane), originY), invDirY);
+			const Reg tz1 = F::Mul(F::Sub(F::Load(node.minZ + lane), originZ), invDirZ);
+			const Reg tz2 = F::Mul(F::Sub(F::Load(node.maxZ + lane), originZ), invDirZ);
+
+			const Reg tmin = F::Max(F::Max(F::Min(tx1, tx2), F::Min(ty1, ty2)), F::Min(tz1, tz2));
+			const Reg tmax = F::Min(F::Min(F::Max(tx1, tx2), F::Max(ty1, ty2)), F::Max(tz1, tz2));
+
+			const Reg hit = F::And(F::And(F::GreaterEqual(tmax, tmin), F::Greater(tmax, F::Set(ray.min))), F::Less(tmin, F::Set(tMax)));
+			F::Store(pTEntry + lane, tmin);
+			return F::MoveMask(hit);
+		}
+		//Slab test of all children of a wide node at once, returns a bitmask of the children entered before tMax
+		template<int Width>
+		inline uint32_t SlabTest_WideBVHNode(const WideBVHNode<Width>& node, const Ray& ray, float tMax, float* pTEntry)
+		{
+			constexpr int lanes{ std::min(Width, SIMD_MAX_LANES) };
+			uint32_t hitMask{};
+			for (int lane = 0; lane < Width; lane += lanes)
+			{
+				hitMask |= SlabTest_WideBVHNodeLanes<lanes>(node, lane, ray, tMax, pTEntry) << lane;
+			}
+			//Unused slots stay zero initialised and can pass the slab test, only the child count masks them out
+			return hitMask & ((1u << node.childCount) - 1);
+		}
+		//Same slab test on quantized bounds, decoded as origin + q * scale exactly like the builder rounded them
+		inline uint32_t SlabTest_WideBVHNode(const QuantizedBVHNode4& node, const Ray& ray, float tMax, float* pTEntry)
+		{
+			using F = SIMDFloat<4>;
+			using Reg = F::Reg;
+
+			const Reg originX = F::Set(node.originX);
+			const Reg originY = F::Set(node.originY);
+			const Reg originZ = F::Set(node.originZ);
+			const Reg scaleX = F::Set(GetQuantizationScale(node.exponentX));
+			const Reg scaleY = F::Set(GetQuantizationScale(node.exponentY));
+			const Reg scaleZ = F::Set(GetQuantizationScale(node.exponentZ));
+
+			const Reg rayOriginX = F::Set(ray.origin.x);
+			const Reg rayOriginY = F::Set(ray.origin.y);
+			const Reg rayOriginZ = F::Set(ray.origin.z);
+			const Reg invDirX = F::Set(ray.invertedDirection.x);
+			const Reg invDirY = F::Set(ray.invertedDirection.y);
+			const Reg invDirZ = F::Set(ray.invertedDirection.z);
+
+			const Reg tx1 = F::Mul(F::Sub(F::Add(originX, F::Mul(F::LoadBytes(node.minX), scaleX)), rayOriginX), invDirX);
+			const Reg tx2 = F::Mul(F::Sub(F::Add(originX, F::Mul(F::LoadBytes(node.maxX), scaleX)), rayOriginX), invDirX);
+			const Reg ty1 = F::Mul(F::Sub(F::Add(originY, F::Mul(F::LoadBytes(node.minY), scaleY)), rayOriginY), invDirY);
+			const Reg ty2 = F::Mul(F::Sub(F::Add(originY, F::Mul(F::LoadBytes(node.maxY), scaleY)), rayOriginY), invDirY);
+			const Reg tz1 = F::Mul(F::Sub(F::Add(originZ, F::Mul(F::LoadBytes(node.minZ), scaleZ)), rayOriginZ), invDirZ);
+			const Reg tz2 = F::Mul(F::Sub(F::Add(originZ, F::Mul(F::LoadBytes(node.maxZ), scaleZ)), rayOriginZ), invDirZ);
+
+			const Reg tmin = F::Max(F::Max(F::Min(tx1, tx2), F::Min(ty1, ty2)), F::Min(tz1, tz2));
+			const Reg tmax = F::Min(F::Min(F::Max(tx1, tx2), F::Max(ty1, ty2)), F::Max(tz1, tz2));
+
+			const Reg hit = F::And(F::And(F::GreaterEqual(tmax, tmin), F::Greater(tmax, F::Set(ray.min))), F::Less(tmin, F::Set(tMax)));
+			F::Store(pTEntry, tmin);
+			return F::MoveMask(hit) & ((1u << node.childCount) - 1);
+		}
+
+		template<HitQuery Query, TriangleCullMode CullMode, typename WideNode>
+		inline bool IntersectWideBVH(const TriangleMesh& mesh, const std::vector<WideNode>& nodes, const Ray& ray, HitRecord& hitRecord)
+		{
+			constexpr int Width{ WideNode::width };
+			//Leaves are pushed as well, so triangles are tested in front-to-back order too
+			struct StackEntry
+			{
+				uint32_t child;
+				uint32_t triangleCount;
+				float tEntry;
+			};
+			TraversalStack<StackEntry, 32 * Width> stack{};
+
+#if defined(BVH_STATISTICS)
+			BVHNodeCache& nodeCache = BVHNodeCache::Get();
+			BVHNodeTLB& nodeTLB = BVHNodeTLB::Get();
+			uint64_t nodesVisited{ 1 };
+			uint64_t trianglesTested{};
+			uint64_t nodeCacheMisses{};
+			uint64_t nodeTLBMisses{};
+#endif
+
+			bool hasHit{};
+			stack.Push({ 0, 0, SlabTest_AABB(ray, mesh.minAABB, mesh.maxAABB) });
+			while (!stack.IsEmpty())
+			{
+				const StackEntry entry = stack.Pop();
+				if (entry.tEntry >= GetQueryMaxT<Query>(ray, hitRecord))
+				{
+					continue;
+				}
+
+				if (entry.triangleCount > 0)
+				{
+#if defined(BVH_STATISTICS)
+					trianglesTested += entry.triangleCount;
+#endif
+					if (IntersectBVHLeaf<Query, CullMode>(mesh, entry.child, entry.triangleCount, ray, hitRecord))
+					{
+						hasHit = true;
+						if constexpr (Query == HitQuery::AnyHit)
+						{
+							break;
+						}
+					}
+					continue;
+				}
+
+				const WideNode& node = nodes[entry.child];
+				float tEntry[Width];
+				uint32_t hitMask = SlabTest_WideBVHNode(node, ray, std::min(GetQueryMaxT<Query>(ray, hitRecord), ray.max), tEntry);
+#if defined(BVH_STATISTICS)
+				nodesVisited += node.childCount;
+				nodeCacheMisses += nodeCache.Access(&node, sizeof(WideNode));
+				nodeTLBMisses += nodeTLB.Access(&node, sizeof(WideNode));
+#endif
+
+				//Sort the entered children far to near, so the nearest one ends up on top of the stack
+				StackEntry hitChildren[Width];
+				int hitChildCount{};
+				while (hitMask != 0)
+				{
+					const int c = std::countr_zero(hitMask);
+					hitMask &= hitMask - 1;
+
+					int insertIndx = hitChildCount++;
+					while (insertIndx > 0 && hitChildren[insertIndx - 1].tEntry < tEntry[c])
+					{
+						hitChildren[insertIndx] = hitChildren[insertIndx - 1];
+						--insertIndx;
+					}
+					hitChildren[insertIndx] = { node.child[c], node.triangleCount[c], tEntry[c] };
 				}
 
-				if (hitRecord.t > curClosestHit.t)
+				for (int i = 0; i < hitChildCount; ++i)
 				{
-					hitRecord = curClosestHit;
+					stack.Push(hitChildren[i]);
 				}
 			}
+
+#if defined(BVH_STATISTICS)
+			BVHStatistics& statistics = BVHStatistics::Get();
+			++statistics.meshRays;
+			statistics.nodesVisited += nodesVisited;
+			statistics.trianglesTested += trianglesTested;
+			statistics.nodeCacheMisses += nodeCacheMisses;
+			statistics.nodeTLBMisses += nodeTLBMisses;
+#endif
+			return hasHit;
 		}
-		inline bool HitTest_TriangleMesh(const TriangleMesh& mesh, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord = false)
+		template<HitQuery Query, TriangleCullMode CullMode>
+		inline bool IntersectTriangleMesh(const TriangleMesh& mesh, const Ray& objectRay, HitRecord& hitRecord)
 		{
-			HitRecord tempHit{};
-			bool hasHit = false;
-			
-			Triangle tempTriangle{};
-			tempTriangle.cullMode = mesh.cullMode;
-			tempTriangle.materialIndex = mesh.materialIndex;
-			
-			IntersectBVH(mesh, ray, tempTriangle, hitRecord, hasHit, tempHit, ignoreHitRecord, 0);
+			switch (mesh.bvhLayout)
+			{
+			case BVHLayout::Wide4:
+				return IntersectWideBVH<Query, CullMode>(mesh, mesh.bvh4Nodes, objectRay, hitRecord);
+			case BVHLayout::Wide8:
+				return IntersectWideBVH<Query, CullMode>(mesh, mesh.bvh8Nodes, objectRay, hitRecord);
+			case BVHLayout::Quantized4:
+				return IntersectWideBVH<Query, CullMode>(mesh, mesh.bvhQuantizedNodes, objectRay, hitRecord);
+			default:
+				return IntersectBVH<Query, CullMode>(mesh, objectRay, hitRecord);
+			}
+		}
+		template<HitQuery Query = HitQuery::ClosestHit>
+		inline bool HitTest_TriangleMesh(const TriangleMesh& mesh, const TriangleMeshInstance& instance, const Ray& ray, HitRecord& hitRecord)
+		{
+			//The direction is not normalized in object space, so t stays valid in world space
+			Ray objectRay{ ray };
+			objectRay.origin = instance.inverseTransform.TransformPoint(ray.origin);
+			objectRay.direction = instance.inverseTransform.TransformVector(ray.direction);
+			objectRay.invertedDirection = objectRay.direction.Inversed();
+
+			//The cull mode is picked once per instance, so the triangle tests below compile without it
+			bool hasHit{};
+			switch (instance.cullMode)
+			{
+			case TriangleCullMode::FrontFaceCulling:
+				hasHit = IntersectTriangleMesh<Query, TriangleCullMode::FrontFaceCulling>(mesh, objectRay, hitRecord);
+				break;
+			case TriangleCullMode::BackFaceCulling:
+				hasHit = IntersectTriangleMesh<Query, TriangleCullMode::BackFaceCulling>(mesh, objectRay, hitRecord);
+				break;
+			default:
+				hasHit = IntersectTriangleMesh<Query, TriangleCullMode::NoCulling>(mesh, objectRay, hitRecord);
+				break;
+			}
 
 			//Lesson method
-			//if (!SlabTest_TriangleMesh(ray, mesh.minAABB, mesh.maxAABB))
+			//if (SlabTest_AABB(ray, mesh.minAABB, mesh.maxAABB) == FLT_MAX)
 			//{
 			//	return false;
 			//}
@@ -496,10 +1105,197 @@ namespace dae
 			return hasHit;
 		}
 
-		inline bool HitTest_TriangleMesh(const TriangleMesh& mesh, const Ray& ray)
+		inline bool HitTest_TriangleMesh(const TriangleMesh& mesh, const TriangleMeshInstance& instance, const Ray& ray)
 		{
 			HitRecord temp{};
-			return HitTest_TriangleMesh(mesh, ray, temp, true);
+			return HitTest_TriangleMesh<HitQuery::AnyHit>(mesh, instance, ray, temp);
+		}
+
+		template<typename Packet>
+		inline Vector3 GetPacketTriangleNormal(const std::vector<Packet>& packets, uint32_t triangleIndex)
+		{
+			const Packet& packet = packets[triangleIndex / Packet::width];
+			const uint32_t lane = triangleIndex % Packet::width;
+			return { packet.normalX[lane], packet.normalY[lane], packet.normalZ[lane] };
+		}
+		//Object space normal of a leaf triangle, as indexed by hitRecord.elementIndex
+		inline Vector3 GetLeafTriangleNormal(const TriangleMesh& mesh, uint32_t triangleIndex)
+		{
+			const bool isAffine = mesh.triangleKernel == TriangleKernel::Affine;
+			switch (mesh.leafLayout)
+			{
+			case LeafLayout::Packet4:
+				return isAffine ? GetPacketTriangleNormal(mesh.bvhAffinePackets4, triangleIndex) : GetPacketTriangleNormal(mesh.bvhPackets4, triangleIndex);
+			case LeafLayout::Packet8:
+				return isAffine ? GetPacketTriangleNormal(mesh.bvhAffinePackets8, triangleIndex) : GetPacketTriangleNormal(mesh.bvhPackets8, triangleIndex);
+			default:
+				return mesh.bvhTriangles[triangleIndex].normal;
+			}
+		}
+
+		inline void FinalizeHit_TriangleMesh(const TriangleMesh& mesh, const TriangleMeshInstance& instance, const Ray& ray, HitRecord& hitRecord)
+		{
+			hitRecord.materialIndex = instance.materialIndex;
+			hitRecord.origin = ray.origin + ray.direction * hitRecord.t;
+			hitRecord.normal = instance.normalTransform.TransformVector(GetLeafTriangleNormal(mesh, hitRecord.elementIndex)).Normalized();
+		}
+#pragma endregion
+#pragma region SphereSet HitTest
+		//HitTest_SphereLanes on Lanes consecutive records from pSpheres, transposed into one register per component
+		template<int Lanes>
+		inline uint32_t HitTest_SphereRecordLanes(const SphereRecord* pSpheres, const Ray& ray, float* pT)
+		{
+			using F = SIMDFloat<Lanes>;
+			using Reg = typename F::Reg;
+
+			Reg originX, originY, originZ, radius;
+			F::LoadTransposed(&pSpheres->origin.x, originX, originY, originZ, radius);
+			return HitTest_SphereLanes<Lanes>(originX, originY, originZ, F::Mul(radius, radius), ray, pT);
+		}
+		//Tests the count spheres of a leaf, reading up to maxLeafSpheres records into the padding after the last sphere
+		inline uint32_t HitTest_SphereRecords(const SphereRecord* pSpheres, uint32_t count, const Ray& ray, float* pT)
+		{
+			constexpr int lanes{ std::min(static_cast<int>(SphereSet::maxLeafSpheres), SIMD_MAX_LANES) };
+			uint32_t hitMask{};
+			for (uint32_t lane = 0; lane < count; lane += lanes)
+			{
+				hitMask |= HitTest_SphereRecordLanes<lanes>(pSpheres + lane, ray, pT + lane) << lane;
+			}
+			return hitMask & ((1u << count) - 1);
+		}
+		//TraverseBVH like IntersectBVH, closest hit queries record the sphere slot as hitRecord.elementIndex
+		template<HitQuery Query = HitQuery::ClosestHit>
+		inline bool HitTest_SphereSet(const SphereSet& sphereSet, const Ray& ray, HitRecord& hitRecord)
+		{
+			bool hasHit{};
+			TraverseBVH(sphereSet.pBvhNodes.get(), SphereSet::rootBvhNodeIndx, ray,
+				[&]() { return GetQueryMaxT<Query>(ray, hitRecord); },
+				[&](uint32_t, const BVHNode& node)
+				{
+					alignas(16) float t[SphereSet::maxLeafSpheres];
+					const uint32_t hitMask = HitTest_SphereRecords(&sphereSet.spheres[node.firstIndice], node.indicesCount, ray, t);
+					if (hitMask == 0)
+					{
+						return false;
+					}
+					if constexpr (Query == HitQuery::AnyHit)
+					{
+						hasHit = true;
+						return true;
+					}
+
+					int lane{};
+					float hitT{};
+					GetClosestPacketLane(hitMask, t, lane, hitT);
+					if (hitRecord.t > hitT)
+					{
+						hitRecord.didHit = true;
+						hitRecord.t = hitT;
+						hitRecord.elementIndex = node.firstIndice + lane;
+						hasHit = true;
+					}
+					return false;
+				});
+			return hasHit;
+		}
+
+		inline bool HitTest_SphereSet(const SphereSet& sphereSet, const Ray& ray)
+		{
+			HitRecord temp{};
+			return HitTest_SphereSet<HitQuery::AnyHit>(sphereSet, ray, temp);
+		}
+
+		inline void FinalizeHit_SphereSet(const SphereSet& sphereSet, const Ray& ray, HitRecord& hitRecord)
+		{
+			hitRecord.materialIndex = sphereSet.materialIndex;
+			hitRecord.origin = ray.origin + (ray.direction * hitRecord.t);
+			hitRecord.normal = (hitRecord.origin - sphereSet.spheres[hitRecord.elementIndex].origin).Normalized();
+		}
+#pragma endregion
+#pragma region TriangleMesh BVH Tuning
+		//Builds the mesh BVH with a few build settings, times each on the same sample of closest hit and shadow rays
+		//and keeps the fastest. Rays start on a sphere around the mesh and aim at random points inside its bounds.
+		//Costs one build per candidate, so only meant for load time.
+		inline BVHBuildSettings AutoTuneBVH(TriangleMesh& mesh, uint32_t nrSampleRays = 4096)
+		{
+			const BVHBuildSettings candidates[]
+			{
+				mesh.bvhBuildSettings,
+				{ 8, 1.f, 64 },
+				{ 16, 1.f, 64 },
+				{ 32, 1.f, 64 },
+				{ 16, 0.5f, 64 },
+				{ 16, 2.f, 64 },
+				{ 16, 1.f, 8 },
+				{ 16, 0.f, 4 }
+			};
+
+			mesh.UpdateBVH();
+			const Vector3 center = (mesh.minAABB + mesh.maxAABB) * 0.5f;
+			const Vector3 extent = mesh.maxAABB - mesh.minAABB;
+			const float radius = std::max(extent.Magnitude(), FLT_EPSILON);
+			std::mt19937 generator{ 1234 };
+			std::uniform_real_distribution<float> distribution{ -1.f, 1.f };
+			std::vector<Ray> sampleRays(nrSampleRays);
+			for (Ray& ray : sampleRays)
+			{
+				const Vector3 direction = Vector3{ distribution(generator), distribution(generator), distribution(generator) }.Normalized();
+				const Vector3 target{ center.x + extent.x * 0.5f * distribution(generator), center.y + extent.y * 0.5f * distribution(generator), center.z + extent.z * 0.5f * distribution(generator) };
+				ray.origin = center + direction * radius;
+				ray.direction = (target - ray.origin).Normalized();
+				ray.invertedDirection = ray.direction.Inversed();
+			}
+
+			TriangleMeshInstance instance{};
+			instance.cullMode = TriangleCullMode::NoCulling;
+			instance.UpdateTransforms();
+
+			float bestTime{ FLT_MAX };
+			float defaultTime{};
+			size_t bestCandidate{};
+			for (size_t c = 0; c < std::size(candidates); ++c)
+			{
+				mesh.bvhBuildSettings = candidates[c];
+				if (c > 0)
+				{
+					mesh.UpdateBVH();
+				}
+
+				//Best of three passes, the first one also warms the caches
+				float time{ FLT_MAX };
+				for (int pass = 0; pass < 3; ++pass)
+				{
+					const auto passStart = std::chrono::high_resolution_clock::now();
+					for (const Ray& ray : sampleRays)
+					{
+						HitRecord hitRecord{};
+						if (HitTest_TriangleMesh(mesh, instance, ray, hitRecord))
+						{
+							FinalizeHit_TriangleMesh(mesh, instance, ray, hitRecord);
+							const Ray shadowRay{ hitRecord.origin + hitRecord.normal * 0.001f, -ray.direction, -ray.invertedDirection };
+							HitTest_TriangleMesh(mesh, instance, shadowRay);
+						}
+					}
+					time = std::min(time, std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - passStart).count());
+				}
+
+				if (c == 0)
+				{
+					defaultTime = time;
+				}
+				if (time < bestTime)
+				{
+					bestTime = time;
+					bestCandidate = c;
+				}
+			}
+
+			const BVHBuildSettings& best = candidates[bestCandidate];
+			mesh.bvhBuildSettings = best;
+			mesh.UpdateBVH();
+			std::cout << "BVH auto-tune (" << mesh.indices.size() / 3 << " triangles): " << best.nrBins << " bins, traversal cost " << best.traversalCost
+				<< ", max leaf " << best.maxLeafTriangles << " triangles | " << bestTime << " ms vs " << defaultTime << " ms for the previous settings" << std::endl;
+			return best;
 		}
 #pragma endregion
 	}
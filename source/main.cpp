@@ -11,6 +11,8 @@
 #include "Timer.h"
 #include "Renderer.h"
 #include "Scene.h"
+#include "BVHStatistics.h"
+#include "Benchmarks.h"
 
 using namespace dae;
 
@@ -47,6 +49,7 @@ int main(int argc, char* args[])
 
 	const auto pScene = new Scene_W4();
 	pScene->Initialize();
+	pScene->PrintMeshStatistics();
 
 	//Start loop
 	pTimer->Start();
@@ -71,14 +74,29 @@ int main(int argc, char* args[])
 					pRenderer->ToggleShadows();
 				if (e.key.keysym.scancode == SDL_SCANCODE_F3)
 					pRenderer->CycleLightingMode();
+				if (e.key.keysym.scancode == SDL_SCANCODE_F4)
+					pRenderer->CycleTileSize();
+				if (e.key.keysym.scancode == SDL_SCANCODE_F5)
+					pRenderer->CycleParallelMode();
 				if (e.key.keysym.scancode == SDL_SCANCODE_F6)
 					pTimer->StartBenchmark(10);
+				if (e.key.keysym.scancode == SDL_SCANCODE_F7)
+					pScene->ToggleMeshDeformation();
+				if (e.key.keysym.scancode == SDL_SCANCODE_F8)
+					pScene->ToggleBackgroundMeshBuilds();
+				if (e.key.keysym.scancode == SDL_SCANCODE_F9)
+					Benchmarks::RunHitChecks();
+				if (e.key.keysym.scancode == SDL_SCANCODE_F10)
+					Benchmarks::RunTriangleKernelBenchmark();
+				if (e.key.keysym.scancode == SDL_SCANCODE_F11)
+					Benchmarks::RunOBJParserBenchmark();
 				break;
 			}
 		}
 
 		//--------- Update ---------
 		pScene->Update(pTimer);
+		pScene->UpdateTopLevelBVH();
 
 		//--------- Render ---------
 		pRenderer->Render(pScene);
@@ -90,6 +108,15 @@ int main(int argc, char* args[])
 		{
 			printTimer = 0.f;
 			std::cout << "dFPS: " << pTimer->GetdFPS() << std::endl;
+
+			const TileFrameStats& tileStats = pRenderer->GetTileFrameStats();
+			std::cout << "Tiles: " << tileStats.tilesTotal << " (stolen: " << tileStats.tilesStolen << ") on " << tileStats.numWorkers << " workers"
+				<< " | idle avg: " << tileStats.avgIdleTimeMs << "ms, max: " << tileStats.maxIdleTimeMs << "ms of " << tileStats.frameTimeMs << "ms" << std::endl;
+
+#if defined(BVH_STATISTICS)
+			BVHStatistics::Get().Print();
+			BVHStatistics::Get().Reset();
+#endif
 		}
 
 		//Save screenshot after full render